@@ -19,6 +19,11 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA 
  */
 
+#ifndef WIN32
+#include <sys/time.h>
+#include <errno.h>
+#endif
+
 #include "thread.h"
 
 int thread_create(thread_t *thread, thread_func_t thread_func, void* data)
@@ -97,3 +102,72 @@ void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 	pthread_once(once_control, init_routine);
 #endif	
 }
+
+void cond_init(cond_t* cond)
+{
+#ifdef WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_destroy(cond_t* cond)
+{
+#ifdef WIN32
+	/* nothing to do */
+#else
+	pthread_cond_destroy(cond);
+#endif
+}
+
+void cond_signal(cond_t* cond)
+{
+#ifdef WIN32
+	WakeConditionVariable(cond);
+#else
+	pthread_cond_signal(cond);
+#endif
+}
+
+void cond_broadcast(cond_t* cond)
+{
+#ifdef WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
+void cond_wait(cond_t* cond, mutex_t* mutex)
+{
+#ifdef WIN32
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+	pthread_cond_wait(cond, mutex);
+#endif
+}
+
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms)
+{
+#ifdef WIN32
+	if (!SleepConditionVariableCS(cond, mutex, timeout_ms)) {
+		return -1;
+	}
+	return 0;
+#else
+	struct timeval now;
+	struct timespec abstime;
+	gettimeofday(&now, NULL);
+	abstime.tv_sec = now.tv_sec + (timeout_ms / 1000);
+	abstime.tv_nsec = (now.tv_usec * 1000) + ((timeout_ms % 1000) * 1000000);
+	if (abstime.tv_nsec >= 1000000000) {
+		abstime.tv_sec++;
+		abstime.tv_nsec -= 1000000000;
+	}
+	if (pthread_cond_timedwait(cond, mutex, &abstime) == ETIMEDOUT) {
+		return -1;
+	}
+	return 0;
+#endif
+}
@@ -26,6 +26,7 @@
 #include <windows.h>
 typedef HANDLE thread_t;
 typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
 typedef volatile struct {
 	LONG lock;
 	int state;
@@ -36,6 +37,7 @@ typedef volatile struct {
 #include <pthread.h>
 typedef pthread_t thread_t;
 typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
 typedef pthread_once_t thread_once_t;
 #define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #define THREAD_ID pthread_self()
@@ -53,4 +55,11 @@ void mutex_unlock(mutex_t* mutex);
 
 void thread_once(thread_once_t *once_control, void (*init_routine)(void));
 
+void cond_init(cond_t* cond);
+void cond_destroy(cond_t* cond);
+void cond_signal(cond_t* cond);
+void cond_broadcast(cond_t* cond);
+void cond_wait(cond_t* cond, mutex_t* mutex);
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms);
+
 #endif
@@ -0,0 +1,176 @@
+/*
+ * debugserverhexbench.c
+ * Simple benchmark for the hex codec of the debugserver protocol
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA 
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/time.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/debugserver.h>
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* the previous one character per iteration codec, for comparison */
+static int reference_hex2int(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return 10 + c - 'a';
+	else if (c >= 'A' && c <= 'F')
+		return 10 + c - 'A';
+	else
+		return c;
+}
+
+static void reference_encode(const unsigned char* data, uint32_t size, char* out)
+{
+	const char *hexchars = "0123456789ABCDEF";
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		out[2*i] = hexchars[(data[i] >> 4) & 0xf];
+		out[2*i + 1] = hexchars[data[i] & 0xf];
+	}
+}
+
+static void reference_decode(const char* encoded, uint32_t size, unsigned char* out)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		out[i] = reference_hex2int(encoded[2*i]) << 4 | reference_hex2int(encoded[2*i + 1]);
+	}
+}
+
+static int check(void)
+{
+	unsigned char data[1031];
+	char reference[sizeof(data) * 2];
+	uint32_t size;
+
+	for (size = 0; size < sizeof(data); size++)
+		data[size] = (unsigned char)(size * 7 + 3);
+
+	/* all lengths around the vector widths, including the scalar tails */
+	for (size = 0; size <= sizeof(data); size += (size < 130) ? 1 : 97) {
+		char* encoded = NULL;
+		char* decoded = NULL;
+		uint32_t encoded_length = 0;
+		uint32_t decoded_size = 0;
+		uint32_t i;
+
+		reference_encode(data, size, reference);
+		if (debugserver_encode_buffer((const char*)data, size, &encoded, &encoded_length) != DEBUGSERVER_E_SUCCESS
+		    || encoded_length != 2 * size || memcmp(encoded, reference, encoded_length) != 0) {
+			printf("encoding %u bytes failed\n", size);
+			return -1;
+		}
+
+		/* lower case digits decode as well */
+		for (i = 0; i < encoded_length; i += 3)
+			encoded[i] = (char)tolower(encoded[i]);
+
+		if (debugserver_decode_buffer(encoded, encoded_length, &decoded, &decoded_size) != DEBUGSERVER_E_SUCCESS
+		    || decoded_size != size || memcmp(decoded, data, size) != 0) {
+			printf("decoding %u bytes failed\n", size);
+			return -1;
+		}
+		free(decoded);
+
+		/* an invalid digit anywhere is rejected */
+		if (size > 0) {
+			encoded[encoded_length - 1] = 'g';
+			if (debugserver_decode_buffer(encoded, encoded_length, &decoded, &decoded_size) != DEBUGSERVER_E_INVALID_ARG) {
+				printf("invalid digit in %u bytes not detected\n", size);
+				return -1;
+			}
+		}
+		free(encoded);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t size = 64 * 1024 * 1024;
+	int rounds = 5;
+	unsigned char* data;
+	char* encoded = NULL;
+	char* decoded;
+	uint32_t encoded_length = 0;
+	uint32_t decoded_size = 0;
+	double start, ref_enc = 0, ref_dec = 0, enc = 0, dec = 0;
+	uint32_t i;
+	int r;
+
+	if (argc > 1)
+		size = (uint32_t)atoi(argv[1]) * 1024 * 1024;
+
+	if (check() != 0)
+		return -1;
+	printf("codec matches reference implementation\n");
+
+	data = (unsigned char*)malloc(size);
+	for (i = 0; i < size; i++)
+		data[i] = (unsigned char)rand();
+	encoded = (char*)malloc(2 * size);
+	decoded = (char*)malloc(size);
+
+	for (r = 0; r < rounds; r++) {
+		char* buf = NULL;
+		char* out = NULL;
+
+		start = now();
+		reference_encode(data, size, encoded);
+		ref_enc += now() - start;
+
+		start = now();
+		reference_decode(encoded, size, (unsigned char*)decoded);
+		ref_dec += now() - start;
+
+		start = now();
+		debugserver_encode_buffer((const char*)data, size, &buf, &encoded_length);
+		enc += now() - start;
+
+		start = now();
+		debugserver_decode_buffer(buf, encoded_length, &out, &decoded_size);
+		dec += now() - start;
+		free(buf);
+		free(out);
+	}
+
+	printf("%u MiB x %d rounds\n", size / (1024 * 1024), rounds);
+	printf("  encode: %8.1f MiB/s (reference %8.1f MiB/s)\n", rounds * (size / 1048576.0) / enc, rounds * (size / 1048576.0) / ref_enc);
+	printf("  decode: %8.1f MiB/s (reference %8.1f MiB/s)\n", rounds * (size / 1048576.0) / dec, rounds * (size / 1048576.0) / ref_dec);
+
+	free(data);
+	free(encoded);
+	free(decoded);
+
+	return 0;
+}
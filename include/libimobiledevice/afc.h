@@ -89,9 +89,85 @@ typedef enum {
 	AFC_LOCK_UN = 8 | 4  /**< unlock */
 } afc_lock_op_t;
 
+/** Modes for afc_sync_from_device() */
+typedef enum {
+	AFC_SYNC_FILE_HASH  = 1, /**< compare whole file hashes and transfer changed files entirely */
+	AFC_SYNC_RANGE_HASH = 2  /**< compare hashes of file ranges and transfer only changed or missing ranges */
+} afc_sync_mode_t;
+
+/** Kinds of changes reported by afc_snapshot_diff() */
+typedef enum {
+	AFC_SNAPSHOT_ADDED   = 1, /**< the entry does not exist in the previous snapshot */
+	AFC_SNAPSHOT_CHANGED = 2, /**< the size, modification time or type of the entry changed */
+	AFC_SNAPSHOT_REMOVED = 3  /**< the entry only exists in the previous snapshot */
+} afc_snapshot_change_t;
+
+/** File types as reported in the st_ifmt key of afc_get_file_info() */
+typedef enum {
+	AFC_FILE_TYPE_UNKNOWN   = 0,
+	AFC_FILE_TYPE_REGULAR   = 1, /**< S_IFREG */
+	AFC_FILE_TYPE_DIRECTORY = 2, /**< S_IFDIR */
+	AFC_FILE_TYPE_SYMLINK   = 3, /**< S_IFLNK */
+	AFC_FILE_TYPE_BLOCK     = 4, /**< S_IFBLK */
+	AFC_FILE_TYPE_CHAR      = 5, /**< S_IFCHR */
+	AFC_FILE_TYPE_FIFO      = 6, /**< S_IFIFO */
+	AFC_FILE_TYPE_SOCKET    = 7  /**< S_IFSOCK */
+} afc_file_type_t;
+
+/** File information as returned by afc_stat() */
+struct afc_stat {
+	uint64_t size;          /**< size in bytes (st_size) */
+	uint64_t blocks;        /**< number of allocated blocks (st_blocks) */
+	uint32_t nlink;         /**< number of hard links (st_nlink) */
+	afc_file_type_t ifmt;   /**< file type (st_ifmt) */
+	uint64_t mtime;         /**< modification time in nanoseconds since epoch (st_mtime) */
+	uint64_t birthtime;     /**< creation time in nanoseconds since epoch (st_birthtime) */
+};
+
+/** Disk information as returned by afc_get_device_info_snapshot() */
+struct afc_device_info {
+	uint64_t total_bytes;   /**< capacity of the accessed disk partition (FSTotalBytes) */
+	uint64_t free_bytes;    /**< free space on the accessed disk partition (FSFreeBytes) */
+	uint64_t block_size;    /**< block size of the accessed disk partition (FSBlockSize) */
+};
+
+/** An entry of a metadata snapshot, see afc_snapshot_create() */
+struct afc_snapshot_entry {
+	const char *path;       /**< fully-qualified path on the device */
+	uint64_t size;          /**< size in bytes */
+	uint64_t mtime;         /**< modification time in nanoseconds since epoch */
+	afc_file_type_t ifmt;   /**< file type */
+};
+
 typedef struct afc_client_private afc_client_private;
 typedef afc_client_private *afc_client_t; /**< The client handle. */
 
+typedef struct afc_stream_private afc_stream_private;
+typedef afc_stream_private *afc_stream_t; /**< The buffered stream handle. */
+
+typedef struct afc_snapshot_private afc_snapshot_private;
+typedef afc_snapshot_private *afc_snapshot_t; /**< An opened metadata snapshot. */
+
+/** Reports a changed entry found by afc_snapshot_diff(). */
+typedef void (*afc_snapshot_diff_cb_t)(afc_snapshot_change_t change, const struct afc_snapshot_entry *entry, void *user_data);
+
+typedef struct afc_pool_private afc_pool_private;
+typedef afc_pool_private *afc_pool_t; /**< The connection pool handle. */
+
+/**
+ * Reports an entry found by afc_walk().
+ *
+ * @param path The fully-qualified path of the entry.
+ * @param stbuf The information of the entry.
+ * @param user_data The pointer passed to afc_walk().
+ *
+ * @return 0 to continue the walk, or any other value to stop it.
+ */
+typedef int (*afc_walk_cb_t)(const char *path, const struct afc_stat *stbuf, void *user_data);
+
+typedef struct afc_pool_file_private afc_pool_file_private;
+typedef afc_pool_file_private *afc_pool_file_t; /**< A file opened through a connection pool. */
+
 /* Interface */
 
 /**
@@ -143,6 +219,46 @@ afc_error_t afc_client_free(afc_client_t client);
  */
 afc_error_t afc_get_device_info(afc_client_t client, char ***device_information);
 
+/**
+ * Gets the disk information of a connected client as typed values.
+ * If a refresh interval has been set with
+ * afc_set_device_info_refresh_interval(), a cached result is returned
+ * without contacting the device.
+ *
+ * @param client The client to get device info for.
+ * @param info Pointer to a struct afc_device_info that will be filled with
+ *        the disk information.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_device_info_snapshot(afc_client_t client, struct afc_device_info *info);
+
+/**
+ * Enables or disables caching of the device information used by
+ * afc_get_device_info_snapshot() and afc_get_device_info_key(). The device
+ * information is fetched again once the interval has passed. Caching is
+ * disabled by default.
+ *
+ * @param client The client to configure.
+ * @param interval_ms Time in milliseconds after which the device information
+ *        is refreshed, or 0 to disable and flush the cache.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_set_device_info_refresh_interval(afc_client_t client, uint32_t interval_ms);
+
+/**
+ * Gets the accumulated size of a file or directory tree, as computed by the
+ * device in a single request.
+ *
+ * @param client The client to use.
+ * @param path The fully-qualified path to the file or directory.
+ * @param size Pointer that will be set to the total size in bytes.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_size_of_path_contents(afc_client_t client, const char *path, uint64_t *size);
+
 /**
  * Gets a directory listing of the directory requested.
  *
@@ -169,6 +285,35 @@ afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***di
  */
 afc_error_t afc_get_file_info(afc_client_t client, const char *filename, char ***file_information);
 
+/**
+ * Gets information about a specific file as typed values.
+ * If a stat cache has been enabled with afc_set_stat_cache_ttl(), a cached
+ * result is returned without contacting the device.
+ *
+ * @param client The client to use to get the information of the file.
+ * @param path The fully-qualified path to the file.
+ * @param stbuf Pointer to a struct afc_stat that will be filled with the
+ *        file information.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_stat(afc_client_t client, const char *path, struct afc_stat *stbuf);
+
+/**
+ * Enables or disables the per-client cache of afc_stat() results.
+ * Cached entries expire after the given time, and are invalidated when the
+ * path is modified through this client (remove, rename, write, truncate,
+ * etc.). Changes made on the device by other means are only noticed after
+ * the entry expired. The cache is disabled by default.
+ *
+ * @param client The client to configure.
+ * @param ttl_ms Time in milliseconds a result stays valid, or 0 to disable
+ *        and flush the cache.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_set_stat_cache_ttl(afc_client_t client, uint32_t ttl_ms);
+
 /**
  * Opens a file on the device.
  *
@@ -229,6 +374,40 @@ afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint
  */
 afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written);
 
+/**
+ * Reads the given number of bytes from the given file starting at offset.
+ * Unlike afc_file_read() the file position of the handle is neither used nor
+ * changed, so no prior afc_file_seek() call is needed.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param offset The position in the file to start reading at
+ * @param data The pointer to the memory region to store the read data
+ * @param length The number of bytes to read
+ * @param bytes_read The number of bytes actually read.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ * @note Only available in iOS 7 and later.
+ */
+afc_error_t afc_file_pread(afc_client_t client, uint64_t handle, uint64_t offset, char *data, uint32_t length, uint32_t *bytes_read);
+
+/**
+ * Writes a given number of bytes to a file starting at offset.
+ * Unlike afc_file_write() the file position of the handle is neither used nor
+ * changed, so no prior afc_file_seek() call is needed.
+ *
+ * @param client The client to use to write to the file.
+ * @param handle File handle of previously opened file.
+ * @param offset The position in the file to start writing at.
+ * @param data The data to write to the file.
+ * @param length How much data to write.
+ * @param bytes_written The number of bytes actually written to the file.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ * @note Only available in iOS 7 and later.
+ */
+afc_error_t afc_file_pwrite(afc_client_t client, uint64_t handle, uint64_t offset, const char *data, uint32_t length, uint32_t *bytes_written);
+
 /**
  * Seeks to a given position of a pre-opened file on the device.
  *
@@ -344,6 +523,360 @@ afc_error_t afc_set_file_time(afc_client_t client, const char *path, uint64_t mt
  */
 afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path);
 
+/**
+ * Gets a hash of the contents of a file, calculated on the device.
+ *
+ * @param client The client to use.
+ * @param path The path of the file to hash. (must be a fully-qualified path)
+ * @param hash Pointer that will be set to a newly allocated buffer holding the
+ *        binary hash (a SHA1 digest). Free with free().
+ * @param hash_len Pointer that will be set to the length of the hash.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_file_hash(afc_client_t client, const char *path, char **hash, uint32_t *hash_len);
+
+/**
+ * Gets a hash of a range of the contents of a file, calculated on the device.
+ *
+ * @param client The client to use.
+ * @param path The path of the file to hash. (must be a fully-qualified path)
+ * @param offset The start of the range to hash.
+ * @param length The number of bytes to hash.
+ * @param hash Pointer that will be set to a newly allocated buffer holding the
+ *        binary hash (a SHA1 digest). Free with free().
+ * @param hash_len Pointer that will be set to the length of the hash.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_file_hash_range(afc_client_t client, const char *path, uint64_t offset, uint64_t length, char **hash, uint32_t *hash_len);
+
+/**
+ * Gets information about several files, like afc_stat() but with the
+ * requests pipelined on the connection instead of waiting for each response
+ * before sending the next request.
+ *
+ * @param client The client to use.
+ * @param paths Array of fully-qualified paths.
+ * @param count Number of elements in paths.
+ * @param stbufs Array of count elements that will be filled with the file
+ *        information of the respective path.
+ * @param results Array of count elements that will be set to the result of
+ *        the respective request.
+ *
+ * @return AFC_E_SUCCESS if all requests succeeded, otherwise the error of the
+ *         first request that failed.
+ */
+afc_error_t afc_stat_many(afc_client_t client, const char **paths, uint32_t count, struct afc_stat *stbufs, afc_error_t *results);
+
+/**
+ * Deletes several files or directories with the requests pipelined on the
+ * connection.
+ *
+ * @param client The client to use.
+ * @param paths Array of fully-qualified paths to delete.
+ * @param count Number of elements in paths.
+ * @param results Array of count elements that will be set to the result of
+ *        the respective request.
+ *
+ * @return AFC_E_SUCCESS if all requests succeeded, otherwise the error of the
+ *         first request that failed.
+ */
+afc_error_t afc_remove_paths(afc_client_t client, const char **paths, uint32_t count, afc_error_t *results);
+
+/**
+ * Renames several files or directories with the requests pipelined on the
+ * connection.
+ *
+ * @param client The client to use.
+ * @param from Array of fully-qualified paths to rename from.
+ * @param to Array of fully-qualified paths to rename to.
+ * @param count Number of elements in from and to.
+ * @param results Array of count elements that will be set to the result of
+ *        the respective request.
+ *
+ * @return AFC_E_SUCCESS if all requests succeeded, otherwise the error of the
+ *         first request that failed.
+ */
+afc_error_t afc_rename_paths(afc_client_t client, const char **from, const char **to, uint32_t count, afc_error_t *results);
+
+/**
+ * Sets the modification time of several files with the requests pipelined
+ * on the connection.
+ *
+ * @param client The client to use.
+ * @param paths Array of fully-qualified paths.
+ * @param mtimes Array of modification times in nanoseconds since epoch.
+ * @param count Number of elements in paths and mtimes.
+ * @param results Array of count elements that will be set to the result of
+ *        the respective request.
+ *
+ * @return AFC_E_SUCCESS if all requests succeeded, otherwise the error of the
+ *         first request that failed.
+ */
+afc_error_t afc_set_file_times(afc_client_t client, const char **paths, const uint64_t *mtimes, uint32_t count, afc_error_t *results);
+
+/* Buffered streams */
+
+/**
+ * Creates a buffered stream on top of an opened file handle.
+ * Reads are served from a read-ahead window of chunks that a background
+ * thread requests from the device before the application asks for them.
+ * Writes are coalesced into chunk sized write packets which are sent to the
+ * device in the background.
+ *
+ * @param client The client the file handle belongs to.
+ * @param handle File handle of a previously opened file. The stream starts
+ *        at the current position of the handle.
+ * @param chunk_size Size of the chunks read and written, or 0 for a default.
+ * @param window Number of chunks to read ahead, or 0 for a default.
+ * @param stream Pointer that will be set to a newly allocated afc_stream_t
+ *        upon successful return. Must be freed using afc_stream_free().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_stream_new(afc_client_t client, uint64_t handle, uint32_t chunk_size, uint32_t window, afc_stream_t *stream);
+
+/**
+ * Flushes pending writes and frees a buffered stream.
+ * The underlying file handle is not closed.
+ *
+ * @param stream The stream to free.
+ *
+ * @return AFC_E_SUCCESS on success or the AFC_E_* error value of a failed
+ *         pending write.
+ */
+afc_error_t afc_stream_free(afc_stream_t stream);
+
+/**
+ * Reads from a buffered stream.
+ *
+ * @param stream The stream to read from.
+ * @param data The pointer to the memory region to store the read data.
+ * @param length The number of bytes to read.
+ * @param bytes_read The number of bytes actually read. Less than length
+ *        only at the end of the file or on error.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_stream_read(afc_stream_t stream, char *data, uint32_t length, uint32_t *bytes_read);
+
+/**
+ * Writes to a buffered stream. The data is sent to the device in the
+ * background; errors are reported by a later afc_stream_write(),
+ * afc_stream_flush() or afc_stream_free() call.
+ *
+ * @param stream The stream to write to.
+ * @param data The data to write.
+ * @param length How much data to write.
+ * @param bytes_written The number of bytes accepted by the stream.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_stream_write(afc_stream_t stream, const char *data, uint32_t length, uint32_t *bytes_written);
+
+/**
+ * Waits until all data written to a buffered stream has been sent to the
+ * device.
+ *
+ * @param stream The stream to flush.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_stream_flush(afc_stream_t stream);
+
+/**
+ * Seeks to a given position of a buffered stream. Seeking within the
+ * read-ahead window keeps the buffered data, any other seek discards it.
+ *
+ * @param stream The stream to seek.
+ * @param offset Seek offset.
+ * @param whence Seeking direction, one of SEEK_SET, SEEK_CUR, or SEEK_END.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_stream_seek(afc_stream_t stream, int64_t offset, int whence);
+
+/**
+ * Returns the current position of a buffered stream.
+ *
+ * @param stream The stream to use.
+ * @param position Position in bytes of the stream.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_stream_tell(afc_stream_t stream, uint64_t *position);
+
+/**
+ * Returns read-ahead statistics of a buffered stream. A read counts as a
+ * hit if it could be served without waiting for the device.
+ *
+ * @param stream The stream to use.
+ * @param hits Pointer that will be set to the number of reads served from
+ *        the read-ahead window.
+ * @param misses Pointer that will be set to the number of reads that had to
+ *        wait for the device.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_stream_get_stats(afc_stream_t stream, uint64_t *hits, uint64_t *misses);
+
+/* Connection pools */
+
+/**
+ * Creates a pool of up to max_channels connections to the AFC service of a
+ * device. Connections are opened on demand when all open connections are in
+ * use, so several threads can perform AFC operations in parallel.
+ *
+ * @param device The device to connect to.
+ * @param max_channels The maximum number of connections to open.
+ * @param label The label to use for communication. Usually the program name.
+ *        Pass NULL to disable sending the label in requests to lockdownd.
+ * @param pool Pointer that will be set to a newly allocated afc_pool_t upon
+ *        successful return. Must be freed using afc_pool_free() after use.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_pool_new(idevice_t device, uint32_t max_channels, const char *label, afc_pool_t *pool);
+
+/**
+ * Creates a pool of up to max_channels AFC connections vended by the
+ * house_arrest service, giving access to the container or documents of an
+ * application. See afc_pool_new().
+ *
+ * @param device The device to connect to.
+ * @param command The house_arrest command used to vend each connection,
+ *        either "VendContainer" or "VendDocuments".
+ * @param appid The identifier of the application.
+ * @param max_channels The maximum number of connections to open.
+ * @param label The label to use for communication. Usually the program name.
+ *        Pass NULL to disable sending the label in requests to lockdownd.
+ * @param pool Pointer that will be set to a newly allocated afc_pool_t upon
+ *        successful return. Must be freed using afc_pool_free() after use.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_pool_new_with_house_arrest(idevice_t device, const char *command, const char *appid, uint32_t max_channels, const char *label, afc_pool_t *pool);
+
+/**
+ * Frees a connection pool and closes all of its connections.
+ * All borrowed clients must have been returned and all pool files closed.
+ *
+ * @param pool The pool to free.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_pool_free(afc_pool_t pool);
+
+/**
+ * Borrows an idle connection of a pool, opening a new connection if all
+ * open ones are in use and the maximum is not reached yet, or waiting for
+ * one to be returned otherwise.
+ *
+ * @param pool The pool to borrow from.
+ * @param client Pointer that will be set to the borrowed client. Return it
+ *        with afc_pool_release() when done.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_pool_acquire(afc_pool_t pool, afc_client_t *client);
+
+/**
+ * Returns a client borrowed with afc_pool_acquire() to its pool.
+ *
+ * @param pool The pool the client was borrowed from.
+ * @param client The client to return.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_pool_release(afc_pool_t pool, afc_client_t client);
+
+/**
+ * Opens a file on an idle connection of a pool. All operations on the
+ * returned file are performed on the connection that opened it.
+ *
+ * @param pool The pool to use.
+ * @param filename The file to open. (must be a fully-qualified path)
+ * @param file_mode The mode to use to open the file.
+ * @param file Pointer that will be set to the opened file. Close with
+ *        afc_pool_file_close().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_pool_file_open(afc_pool_t pool, const char *filename, afc_file_mode_t file_mode, afc_pool_file_t *file);
+
+/**
+ * Closes a file opened with afc_pool_file_open().
+ *
+ * @param file The file to close.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_pool_file_close(afc_pool_file_t file);
+
+/**
+ * Gets the client and file handle of a file opened with afc_pool_file_open()
+ * for use with the other afc_file_* functions. The client stays bound to
+ * the file and must not be returned with afc_pool_release().
+ *
+ * @param file The file to query.
+ * @param client Pointer that will be set to the client the file was opened
+ *        on.
+ * @param handle Pointer that will be set to the file handle.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_pool_file_get_handle(afc_pool_file_t file, afc_client_t *client, uint64_t *handle);
+
+/**
+ * Reads from a file opened with afc_pool_file_open(). See afc_file_read().
+ */
+afc_error_t afc_pool_file_read(afc_pool_file_t file, char *data, uint32_t length, uint32_t *bytes_read);
+
+/**
+ * Writes to a file opened with afc_pool_file_open(). See afc_file_write().
+ */
+afc_error_t afc_pool_file_write(afc_pool_file_t file, const char *data, uint32_t length, uint32_t *bytes_written);
+
+/**
+ * Reads from a file opened with afc_pool_file_open() at the given offset.
+ * See afc_file_pread().
+ */
+afc_error_t afc_pool_file_pread(afc_pool_file_t file, uint64_t offset, char *data, uint32_t length, uint32_t *bytes_read);
+
+/**
+ * Writes to a file opened with afc_pool_file_open() at the given offset.
+ * See afc_file_pwrite().
+ */
+afc_error_t afc_pool_file_pwrite(afc_pool_file_t file, uint64_t offset, const char *data, uint32_t length, uint32_t *bytes_written);
+
+/**
+ * Seeks in a file opened with afc_pool_file_open(). See afc_file_seek().
+ */
+afc_error_t afc_pool_file_seek(afc_pool_file_t file, int64_t offset, int whence);
+
+/**
+ * Crawls a directory tree breadth first using several connections of a pool
+ * at once. Each connection lists a directory and fetches the information of
+ * its entries in one pipelined batch, then picks up the next queued
+ * directory, so multiple directories are processed in parallel.
+ * Directories that vanish or cannot be listed and entries that vanish or
+ * cannot be stat'ed during the walk are skipped.
+ *
+ * @param pool The pool to take connections from.
+ * @param root The directory to crawl. (must be a fully-qualified path)
+ * @param callback Function called for every entry below root. Calls are
+ *        serialized, but may happen on different threads and the order of
+ *        directories is not defined.
+ * @param user_data Pointer passed to the callback.
+ * @param parallelism The maximum number of connections to use, or 0 to use
+ *        up to the pool maximum. Only idle connections are used besides the
+ *        first.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_walk(afc_pool_t pool, const char *root, afc_walk_cb_t callback, void *user_data, uint32_t parallelism);
+
 /* Helper functions */
 
 /**
@@ -359,6 +892,165 @@ afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path);
  */
 afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char **value);
 
+/**
+ * Copies a file or directory tree from the device to the host, transferring
+ * only what differs from an existing local copy.
+ * Differences are detected by comparing hashes calculated on the device with
+ * hashes of the local data, so unchanged files are not transferred at all.
+ * In AFC_SYNC_RANGE_HASH mode, files are compared in ranges so only changed
+ * parts are transferred and interrupted transfers are resumed.
+ *
+ * @param client The client to use.
+ * @param path The file or directory on the device. (must be a fully-qualified path)
+ * @param local_path The corresponding file or directory on the host.
+ * @param mode One of AFC_SYNC_FILE_HASH or AFC_SYNC_RANGE_HASH.
+ * @param bytes_transferred Optional pointer to a counter that will be
+ *        increased by the number of bytes transferred from the device.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_sync_from_device(afc_client_t client, const char *path, const char *local_path, afc_sync_mode_t mode, uint64_t *bytes_transferred);
+
+/**
+ * Crawls a directory tree on the device and writes the path, size,
+ * modification time and type of every entry below it to a snapshot file on
+ * the host. Entries are sorted by path and stored in fixed size records, so
+ * the file can be memory mapped and searched with afc_snapshot_open().
+ *
+ * @param client The client to use.
+ * @param root The directory to crawl. (must be a fully-qualified path)
+ * @param filename The snapshot file to write. An existing file is replaced.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_snapshot_create(afc_client_t client, const char *root, const char *filename);
+
+/**
+ * Crawls a directory tree on the device like afc_snapshot_create() and
+ * reports the entries that were added, changed or removed compared to the
+ * snapshot stored in filename. Afterwards the snapshot file is replaced with
+ * the result of the new crawl. If the file does not exist yet, all entries
+ * are reported as added.
+ *
+ * @param client The client to use.
+ * @param root The directory to crawl. (must be a fully-qualified path)
+ * @param filename The snapshot file to compare with and update.
+ * @param callback Function called for each changed entry, in path order.
+ *        For AFC_SNAPSHOT_REMOVED the entry from the previous snapshot is
+ *        passed, otherwise the current one. The entry is only valid during
+ *        the call.
+ * @param user_data Pointer passed to the callback.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_snapshot_diff(afc_client_t client, const char *root, const char *filename, afc_snapshot_diff_cb_t callback, void *user_data);
+
+/**
+ * Opens a snapshot file written by afc_snapshot_create().
+ *
+ * @param filename The snapshot file to open.
+ * @param snapshot Pointer that will be set to the opened snapshot. Free with
+ *        afc_snapshot_free().
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OBJECT_NOT_FOUND if the file does
+ *  not exist, AFC_E_OP_HEADER_INVALID if it is not a valid snapshot file, or
+ *  another AFC_E_* error value.
+ */
+afc_error_t afc_snapshot_open(const char *filename, afc_snapshot_t *snapshot);
+
+/**
+ * Closes a snapshot opened with afc_snapshot_open().
+ *
+ * @param snapshot The snapshot to free.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_snapshot_free(afc_snapshot_t snapshot);
+
+/**
+ * Gets the number of entries in a snapshot.
+ *
+ * @param snapshot The snapshot to query.
+ * @param count Pointer that will be set to the number of entries.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_snapshot_get_count(afc_snapshot_t snapshot, uint32_t *count);
+
+/**
+ * Gets an entry of a snapshot by index. Entries are sorted by path.
+ *
+ * @param snapshot The snapshot to query.
+ * @param index The index of the entry.
+ * @param entry Pointer to a struct afc_snapshot_entry that will be filled.
+ *        The path stays valid until the snapshot is freed.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_snapshot_get_entry(afc_snapshot_t snapshot, uint32_t index, struct afc_snapshot_entry *entry);
+
+/**
+ * Looks up the entry of a path in a snapshot.
+ *
+ * @param snapshot The snapshot to query.
+ * @param path The fully-qualified path to look up.
+ * @param entry Pointer to a struct afc_snapshot_entry that will be filled.
+ *        The path stays valid until the snapshot is freed.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OBJECT_NOT_FOUND if the path is
+ *  not part of the snapshot, or another AFC_E_* error value.
+ */
+afc_error_t afc_snapshot_lookup(afc_snapshot_t snapshot, const char *path, struct afc_snapshot_entry *entry);
+
+/**
+ * Gets a directory listing of the directory requested, like
+ * afc_read_directory(), but with the list and all strings placed in a single
+ * allocation.
+ *
+ * @param client The client to get a directory listing from.
+ * @param path The directory for listing. (must be a fully-qualified path)
+ * @param list Pointer that will be set to a NULL-terminated list of the
+ *        files in the directory. Free with afc_string_list_free().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_read_directory_list(afc_client_t client, const char *path, char ***list);
+
+/**
+ * Gets information about a specific file, like afc_get_file_info(), but with
+ * the list and all strings placed in a single allocation.
+ *
+ * @param client The client to use to get the information of the file.
+ * @param path The fully-qualified path to the file.
+ * @param list Pointer that will be set to a NULL-terminated list of
+ *        alternating keys and values. Free with afc_string_list_free().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_file_info_list(afc_client_t client, const char *path, char ***list);
+
+/**
+ * Get device information for a connected client, like afc_get_device_info(),
+ * but with the list and all strings placed in a single allocation.
+ *
+ * @param client The client to get device info for.
+ * @param list Pointer that will be set to a NULL-terminated list of
+ *        alternating keys and values. Free with afc_string_list_free().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_device_info_list(afc_client_t client, char ***list);
+
+/**
+ * Frees a string list as returned by afc_read_directory_list(),
+ * afc_get_file_info_list() or afc_get_device_info_list().
+ *
+ * @param list The list to free.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_string_list_free(char **list);
+
 /**
  * Frees up a char dictionary as returned by some AFC functions.
  *
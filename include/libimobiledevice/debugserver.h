@@ -39,6 +39,7 @@ typedef enum {
 	DEBUGSERVER_E_MUX_ERROR      = -2,
 	DEBUGSERVER_E_SSL_ERROR      = -3,
 	DEBUGSERVER_E_RESPONSE_ERROR = -4,
+	DEBUGSERVER_E_TIMEOUT        = -5,
 	DEBUGSERVER_E_UNKNOWN_ERROR  = -256
 } debugserver_error_t;
 
@@ -144,7 +145,8 @@ debugserver_error_t debugserver_client_receive(debugserver_client_t client, char
  * @param response Response received for the command (can be NULL to ignore)
  *
  * @return DEBUGSERVER_E_SUCCESS on success,
- *  DEBUGSERVER_E_INVALID_ARG when client or command is NULL
+ *  DEBUGSERVER_E_INVALID_ARG when client or command is NULL or responses
+ *  of queued commands are outstanding
  */
 debugserver_error_t debugserver_client_send_command(debugserver_client_t client, debugserver_command_t command, char** response);
 
@@ -159,6 +161,113 @@ debugserver_error_t debugserver_client_send_command(debugserver_client_t client,
  */
 debugserver_error_t debugserver_client_receive_response(debugserver_client_t client, char** response);
 
+/**
+ * Sends a batch of commands to the debugserver service and receives their
+ * responses. In no-ack mode all commands are written at once before any
+ * response is read, so the batch costs a single round trip. Otherwise
+ * the commands are sent one by one.
+ * If a response fails, the responses of the remaining commands are read
+ * and discarded. Those that still do not arrive stay queued and have to
+ * be received with debugserver_client_receive_queued_response() before
+ * other commands can be sent.
+ *
+ * @param client The debugserver client
+ * @param commands Array of commands to send
+ * @param count Number of commands, each of which must be answered
+ * @param responses Array of count pointers receiving the responses, in
+ *    the order of the commands, each to be freed by the caller. Can be
+ *    NULL to ignore.
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when client or commands is NULL or responses
+ *  of queued commands are outstanding, DEBUGSERVER_E_TIMEOUT when a
+ *  response did not arrive in time, or an DEBUGSERVER_E_* error code
+ *  otherwise.
+ */
+debugserver_error_t debugserver_client_send_commands(debugserver_client_t client, debugserver_command_t* commands, uint32_t count, char** responses);
+
+/**
+ * Queues a command to be sent without waiting for its response. Queued
+ * commands are written together by debugserver_client_flush_commands()
+ * and their responses are read with
+ * debugserver_client_receive_queued_response(). Only available in no-ack
+ * mode, after QStartNoAckMode was sent.
+ *
+ * @param client The debugserver client
+ * @param command Command to queue
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when client or command is NULL or the client
+ *  is not in no-ack mode
+ */
+debugserver_error_t debugserver_client_queue_command(debugserver_client_t client, debugserver_command_t command);
+
+/**
+ * Sends all queued commands.
+ *
+ * @param client The debugserver client
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when client is NULL, or an DEBUGSERVER_E_*
+ *  error code otherwise
+ */
+debugserver_error_t debugserver_client_flush_commands(debugserver_client_t client);
+
+/**
+ * Receives the response of the oldest queued command, sending queued
+ * commands first if needed.
+ *
+ * @param client The debugserver client
+ * @param response Response received for the command (can be NULL to ignore)
+ * @param timeout Maximum time in milliseconds to wait for the response
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when client is NULL or no command is queued,
+ *  DEBUGSERVER_E_TIMEOUT when the response did not arrive in time, or an
+ *  DEBUGSERVER_E_* error code otherwise
+ */
+debugserver_error_t debugserver_client_receive_queued_response(debugserver_client_t client, char** response, unsigned int timeout);
+
+/**
+ * Reads memory of the debugged process. Uses binary x packets when the
+ * remote supports them and hex encoded m packets otherwise, each filled
+ * up to the maximum packet size. In no-ack mode several packets are in
+ * flight at once.
+ *
+ * @param client The debugserver client
+ * @param address Address to read from
+ * @param size Number of bytes to read
+ * @param buffer Buffer of at least size bytes receiving the memory
+ * @param bytes_read Number of bytes read, which is less than size when the
+ *    end of the range is not readable (can be NULL to ignore)
+ *
+ * @return DEBUGSERVER_E_SUCCESS when at least part of the range was read,
+ *  DEBUGSERVER_E_INVALID_ARG when client or buffer is NULL or responses
+ *  of queued commands are outstanding, DEBUGSERVER_E_RESPONSE_ERROR when
+ *  no memory could be read, or an DEBUGSERVER_E_* error code otherwise
+ */
+debugserver_error_t debugserver_client_read_memory(debugserver_client_t client, uint64_t address, uint32_t size, char* buffer, uint32_t* bytes_read);
+
+/**
+ * Writes memory of the debugged process. Uses binary X packets when the
+ * remote supports them and hex encoded M packets otherwise, each filled
+ * up to the maximum packet size. In no-ack mode several packets are in
+ * flight at once.
+ *
+ * @param client The debugserver client
+ * @param address Address to write to
+ * @param data Data to write
+ * @param size Number of bytes to write
+ * @param bytes_written Number of bytes confirmed as written (can be NULL
+ *    to ignore)
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when client or data is NULL or responses
+ *  of queued commands are outstanding, DEBUGSERVER_E_RESPONSE_ERROR when
+ *  the remote failed to write, or an DEBUGSERVER_E_* error code otherwise
+ */
+debugserver_error_t debugserver_client_write_memory(debugserver_client_t client, uint64_t address, const char* data, uint32_t size, uint32_t* bytes_written);
+
 /**
  * Sets the argv which launches an app.
  *
@@ -225,6 +334,35 @@ void debugserver_encode_string(const char* buffer, char** encoded_buffer, uint32
  */
 void debugserver_decode_string(const char *encoded_buffer, size_t encoded_length, char** buffer);
 
+/**
+ * Encodes binary data into hex notation.
+ *
+ * @param data The data to encode
+ * @param size Number of bytes to encode
+ * @param encoded_buffer The buffer receives the hex encoded data, 0
+ *    terminated, to be freed by the caller
+ * @param encoded_length Length of the hex encoded data, 2 * size
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when one or more parameters are invalid
+ */
+debugserver_error_t debugserver_encode_buffer(const char* data, uint32_t size, char** encoded_buffer, uint32_t* encoded_length);
+
+/**
+ * Decodes hex encoded binary data.
+ *
+ * @param encoded_buffer The buffer with hex encoded data
+ * @param encoded_length Length of the encoded buffer
+ * @param data The buffer receives the decoded data, 0 terminated, to be
+ *    freed by the caller
+ * @param size Number of bytes decoded, encoded_length / 2
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when one or more parameters are invalid or
+ *  encoded_buffer holds an odd number of digits or an invalid digit
+ */
+debugserver_error_t debugserver_decode_buffer(const char* encoded_buffer, uint32_t encoded_length, char** data, uint32_t* size);
+
 #ifdef __cplusplus
 }
 #endif
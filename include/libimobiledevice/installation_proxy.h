@@ -50,6 +50,15 @@ typedef instproxy_client_private *instproxy_client_t; /**< The client handle. */
 /** Reports the status of the given operation */
 typedef void (*instproxy_status_cb_t) (const char *operation, plist_t status, void *user_data);
 
+/** Receives a page of applications while browsing */
+typedef void (*instproxy_browse_cb_t) (plist_t apps, void *user_data);
+
+/** Reports the progress of a deployment to one device */
+typedef void (*instproxy_deploy_cb_t) (const char *udid, const char *operation, plist_t status, void *user_data);
+
+typedef struct instproxy_inventory_private instproxy_inventory_private;
+typedef instproxy_inventory_private *instproxy_inventory_t; /**< An opened application inventory. */
+
 /* Interface */
 
 /**
@@ -91,6 +100,21 @@ instproxy_error_t instproxy_client_start_service(idevice_t device, instproxy_cli
  */
 instproxy_error_t instproxy_client_free(instproxy_client_t client);
 
+/**
+ * Sets the minimum time between progress updates passed to the status
+ * callback of asynchronous operations. Updates arriving faster are
+ * coalesced and only the latest one is passed on. Updates reporting
+ * completion or an error are always passed on immediately.
+ *
+ * @param client The installation_proxy client.
+ * @param interval The minimum time in milliseconds between two progress
+ *        updates, or 0 (the default) to pass on every update.
+ *
+ * @return INSTPROXY_E_SUCCESS on success
+ *      or INSTPROXY_E_INVALID_ARG if client is NULL.
+ */
+instproxy_error_t instproxy_client_set_status_interval(instproxy_client_t client, uint32_t interval);
+
 
 /**
  * List installed applications. This function runs synchronously.
@@ -108,6 +132,28 @@ instproxy_error_t instproxy_client_free(instproxy_client_t client);
  */
 instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result);
 
+/**
+ * List installed applications, handing each page of results to a callback
+ * as it is received. Unlike instproxy_browse() the full list is never held
+ * in memory. This function runs synchronously.
+ * The callback is called without the client locked, but the connection is
+ * busy until browsing completed, so use another client for other requests
+ * made from the callback.
+ *
+ * @param client The connected installation_proxy client
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *        See instproxy_browse() for valid client options.
+ * @param callback Function called with a PLIST_ARRAY of PLIST_DICT holding
+ *        information about the applications of each page. The array is
+ *        owned by the library and only valid during the call, copy what
+ *        should be kept.
+ * @param user_data Callback data passed to callback.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *     an error occured.
+ */
+instproxy_error_t instproxy_browse_with_callback(instproxy_client_t client, plist_t client_options, instproxy_browse_cb_t callback, void *user_data);
+
 /**
  * Install an application on the device.
  *
@@ -128,9 +174,9 @@ instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_opt
  *     an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *     INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *     created successfully; any error occuring during the operation has to be
- *     handled inside the specified callback function.
+ *     INSTPROXY_E_SUCCESS immediately once the operation has been started;
+ *     the callback is invoked from a thread shared by all clients and any
+ *     error occuring during the operation has to be handled inside it.
  */
 instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -156,9 +202,9 @@ instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_p
  *     an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *     INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *     created successfully; any error occuring during the operation has to be
- *     handled inside the specified callback function.
+ *     INSTPROXY_E_SUCCESS immediately once the operation has been started;
+ *     the callback is invoked from a thread shared by all clients and any
+ *     error occuring during the operation has to be handled inside it.
  */
 instproxy_error_t instproxy_upgrade(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -177,9 +223,9 @@ instproxy_error_t instproxy_upgrade(instproxy_client_t client, const char *pkg_p
  *     an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *     INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *     created successfully; any error occuring during the operation has to be
- *     handled inside the specified callback function.
+ *     INSTPROXY_E_SUCCESS immediately once the operation has been started;
+ *     the callback is invoked from a thread shared by all clients and any
+ *     error occuring during the operation has to be handled inside it.
  */
 instproxy_error_t instproxy_uninstall(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -220,9 +266,9 @@ instproxy_error_t instproxy_lookup_archives(instproxy_client_t client, plist_t c
  *     an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *     INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *     created successfully; any error occuring during the operation has to be
- *     handled inside the specified callback function.
+ *     INSTPROXY_E_SUCCESS immediately once the operation has been started;
+ *     the callback is invoked from a thread shared by all clients and any
+ *     error occuring during the operation has to be handled inside it.
  */
 instproxy_error_t instproxy_archive(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -243,9 +289,9 @@ instproxy_error_t instproxy_archive(instproxy_client_t client, const char *appid
  *     an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *     INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *     created successfully; any error occuring during the operation has to be
- *     handled inside the specified callback function.
+ *     INSTPROXY_E_SUCCESS immediately once the operation has been started;
+ *     the callback is invoked from a thread shared by all clients and any
+ *     error occuring during the operation has to be handled inside it.
  */
 instproxy_error_t instproxy_restore(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -266,12 +312,47 @@ instproxy_error_t instproxy_restore(instproxy_client_t client, const char *appid
  *     an error occured.
  *
  * @note If a callback function is given (async mode), this function returns
- *     INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *     created successfully; any error occuring during the operation has to be
- *     handled inside the specified callback function.
+ *     INSTPROXY_E_SUCCESS immediately once the operation has been started;
+ *     the callback is invoked from a thread shared by all clients and any
+ *     error occuring during the operation has to be handled inside it.
  */
 instproxy_error_t instproxy_remove_archive(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
+/**
+ * Installs a package on several devices at once. The package is read from
+ * the host once and uploaded to the staging directory of every device
+ * concurrently. The installation on a device starts as soon as its upload
+ * has finished, so uploads to some devices overlap installations on
+ * others. This function returns when all installations have finished.
+ *
+ * @param pkg_path Path of the package (.ipa) on the host.
+ * @param udids Array of the UDIDs of the devices to deploy to.
+ * @param count Number of entries in udids.
+ * @param client_options The client options to use for the installation, as
+ *        PLIST_DICT, or NULL. See instproxy_install().
+ * @param max_uploads Maximum number of uploads running at the same time,
+ *        or 0 for a default.
+ * @param max_bandwidth Maximum number of bytes per second uploaded to all
+ *        devices together, or 0 for no limit.
+ * @param status_cb Optional callback function for progress and status
+ *        information. It is called with the operation "Upload" while the
+ *        package is uploaded and with the installation's status messages
+ *        afterwards. Failures before the installation is started are
+ *        reported as "Upload" with an "Error" and "ErrorDescription" key.
+ *        Calls for different devices come from different threads but never
+ *        overlap.
+ * @param user_data Callback data passed to status_cb.
+ * @param results Optional array of count entries that will be set to the
+ *        result of the deployment to each device. Entries are set on every
+ *        return, to INSTPROXY_E_UNKNOWN_ERROR for devices that were not
+ *        deployed to.
+ *
+ * @return INSTPROXY_E_SUCCESS if the package was installed on all devices,
+ *     INSTPROXY_E_OP_FAILED if it failed on any of them, or another
+ *     INSTPROXY_E_* error value if an error occured.
+ */
+instproxy_error_t instproxy_deploy(const char *pkg_path, const char **udids, uint32_t count, plist_t client_options, uint32_t max_uploads, uint64_t max_bandwidth, instproxy_deploy_cb_t status_cb, void *user_data, instproxy_error_t *results);
+
 /* Helper */
 
 /**
@@ -318,6 +399,92 @@ void instproxy_client_options_free(plist_t client_options);
  */
 instproxy_error_t instproxy_client_get_path_for_bundle_identifier(instproxy_client_t client, const char* bundle_id, char** path);
 
+/**
+ * Updates an application inventory file on the host with the applications
+ * currently installed on the device.
+ * Only the bundle identifier and change markers (version, signer identity
+ * and install path) of each application are browsed; full records are
+ * requested only for applications that were added or changed since the
+ * inventory was last refreshed. Records of unchanged applications are
+ * carried over from the existing file.
+ *
+ * @param client The connected installation_proxy client.
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *        "ApplicationType" selects the applications to include and
+ *        "ReturnAttributes" the attributes stored for each of them.
+ *        All records are requested again if the options differ from the
+ *        ones the inventory was last refreshed with.
+ * @param filename The inventory file to update. It is created if it does
+ *        not exist, and rebuilt if it is not a valid inventory file.
+ * @param changed Optional pointer that will be set to the number of
+ *        applications that were added, changed or removed.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *     an error occured.
+ */
+instproxy_error_t instproxy_inventory_refresh(instproxy_client_t client, plist_t client_options, const char *filename, uint32_t *changed);
+
+/**
+ * Opens an application inventory file written by
+ * instproxy_inventory_refresh(). The file is memory mapped where supported.
+ *
+ * @param filename The inventory file to open.
+ * @param inventory Pointer that will be set to the opened inventory. Free
+ *        with instproxy_inventory_free(). If the file does not exist, an
+ *        empty inventory is returned.
+ *
+ * @return INSTPROXY_E_SUCCESS on success, INSTPROXY_E_OP_FAILED if the file
+ *     is not a valid inventory file, or another INSTPROXY_E_* error value.
+ */
+instproxy_error_t instproxy_inventory_open(const char *filename, instproxy_inventory_t *inventory);
+
+/**
+ * Closes an inventory opened with instproxy_inventory_open().
+ *
+ * @param inventory The inventory to free.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_INVALID_ARG if
+ *     inventory is NULL.
+ */
+instproxy_error_t instproxy_inventory_free(instproxy_inventory_t inventory);
+
+/**
+ * Gets the number of applications in an inventory.
+ *
+ * @param inventory The inventory to query.
+ * @param count Pointer that will be set to the number of applications.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value.
+ */
+instproxy_error_t instproxy_inventory_get_count(instproxy_inventory_t inventory, uint32_t *count);
+
+/**
+ * Gets the bundle identifier of an application in an inventory by index.
+ * Applications are sorted by bundle identifier.
+ *
+ * @param inventory The inventory to query.
+ * @param index The index of the application.
+ * @param bundle_id Pointer that will be set to the bundle identifier. It
+ *        stays valid until the inventory is freed.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value.
+ */
+instproxy_error_t instproxy_inventory_get_bundle_identifier(instproxy_inventory_t inventory, uint32_t index, const char **bundle_id);
+
+/**
+ * Looks up the stored record of an application in an inventory.
+ *
+ * @param inventory The inventory to query.
+ * @param bundle_id The bundle identifier of the application.
+ * @param app Pointer that will be set to a newly allocated PLIST_DICT with
+ *        the application's attributes. Free with plist_free().
+ *
+ * @return INSTPROXY_E_SUCCESS on success, INSTPROXY_E_OP_FAILED if the
+ *     application is not part of the inventory, or another INSTPROXY_E_*
+ *     error value.
+ */
+instproxy_error_t instproxy_inventory_lookup(instproxy_inventory_t inventory, const char *bundle_id, plist_t *app);
+
 #ifdef __cplusplus
 }
 #endif
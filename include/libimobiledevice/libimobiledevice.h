@@ -237,6 +237,17 @@ idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection);
  */
 idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection);
 
+/**
+ * Get the underlying file descriptor for a connection, e.g. to wait for
+ * incoming data on several connections with select() or poll().
+ *
+ * @param connection The connection to get the file descriptor of.
+ * @param fd Pointer to an int that will be set to the file descriptor.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd);
+
 /* misc */
 	
 /**
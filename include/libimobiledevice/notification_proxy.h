@@ -167,9 +167,9 @@ np_error_t np_observe_notifications(np_client_t client, const char **notificatio
 /**
  * This function allows an application to define a callback function that will
  * be called when a notification has been received.
- * It will start a thread that polls for notifications and calls the callback
- * function if a notification has been received.
- * In case of an error condition when polling for notifications - e.g. device
+ * It will start a thread that waits for notifications and calls the callback
+ * function as soon as a notification has been received.
+ * In case of an error condition when waiting for notifications - e.g. device
  * disconnect - the thread will call the callback function with an empty
  * notification "" and terminate itself.
  *
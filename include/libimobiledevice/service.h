@@ -162,6 +162,20 @@ service_error_t service_enable_ssl(service_client_t client);
  */
 service_error_t service_disable_ssl(service_client_t client);
 
+/**
+ * Gets the connection of a service client, e.g. to get its file descriptor
+ * with idevice_connection_get_fd(). The connection is owned by the service
+ * client and must not be freed.
+ *
+ * @param client The service client to get the connection of.
+ * @param connection Pointer that will be set to the connection.
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *     SERVICE_E_INVALID_ARG if client, client->connection or connection is
+ *     NULL.
+ */
+service_error_t service_get_connection(service_client_t client, idevice_connection_t *connection);
+
 #ifdef __cplusplus
 }
 #endif
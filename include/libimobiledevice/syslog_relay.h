@@ -41,12 +41,68 @@ typedef enum {
 	SYSLOG_RELAY_E_UNKNOWN_ERROR = -256
 } syslog_relay_error_t;
 
+/** Message levels, ordered by severity like syslog priorities */
+typedef enum {
+	SYSLOG_RELAY_LEVEL_EMERGENCY = 0,
+	SYSLOG_RELAY_LEVEL_ALERT     = 1,
+	SYSLOG_RELAY_LEVEL_CRITICAL  = 2,
+	SYSLOG_RELAY_LEVEL_ERROR     = 3,
+	SYSLOG_RELAY_LEVEL_WARNING   = 4,
+	SYSLOG_RELAY_LEVEL_NOTICE    = 5,
+	SYSLOG_RELAY_LEVEL_INFO      = 6,
+	SYSLOG_RELAY_LEVEL_DEBUG     = 7,
+	SYSLOG_RELAY_LEVEL_UNKNOWN   = 8
+} syslog_relay_level_t;
+
+/** What to do when the queue between receiving and delivery is full */
+typedef enum {
+	SYSLOG_RELAY_QUEUE_BLOCK       = 0, /**< stop receiving until there is room */
+	SYSLOG_RELAY_QUEUE_DROP_OLDEST = 1, /**< drop the oldest queued lines */
+	SYSLOG_RELAY_QUEUE_DROP_NEWEST = 2  /**< drop the line just received */
+} syslog_relay_queue_policy_t;
+
+/**
+ * A parsed syslog line. All fields point into the received line and are not
+ * NUL terminated, except for line itself. Fields that could not be parsed
+ * have a length of 0.
+ */
+struct syslog_relay_record {
+	const char *line;              /**< the complete line */
+	uint32_t line_length;          /**< length of the line */
+	const char *timestamp;         /**< timestamp, e.g. "Oct 19 10:07:42" */
+	uint32_t timestamp_length;     /**< length of the timestamp */
+	const char *device_name;       /**< name of the device */
+	uint32_t device_name_length;   /**< length of the device name */
+	const char *process;           /**< process name, without subsystem or pid */
+	uint32_t process_length;       /**< length of the process name */
+	uint32_t pid;                  /**< process id, or 0 if not present */
+	syslog_relay_level_t level;    /**< message level */
+	const char *message;           /**< the message, or the whole line if it could not be parsed */
+	uint32_t message_length;       /**< length of the message */
+};
+
 typedef struct syslog_relay_client_private syslog_relay_client_private;
 typedef syslog_relay_client_private *syslog_relay_client_t; /**< The client handle. */
 
+typedef struct syslog_relay_archive_private syslog_relay_archive_private;
+typedef syslog_relay_archive_private *syslog_relay_archive_t; /**< The archive writer handle. */
+
 /** Receives each character received from the device. */
 typedef void (*syslog_relay_receive_cb_t)(char c, void *user_data);
 
+/**
+ * Receives each complete line received from the device. The line is not
+ * terminated by a newline, but followed by a NUL byte, and is only valid
+ * during the call.
+ */
+typedef void (*syslog_relay_receive_lines_cb_t)(const char *line, uint32_t length, void *user_data);
+
+/**
+ * Receives each parsed line received from the device. The record is only
+ * valid during the call.
+ */
+typedef void (*syslog_relay_receive_records_cb_t)(const struct syslog_relay_record *record, void *user_data);
+
 /* Interface */
 
 /**
@@ -106,6 +162,43 @@ syslog_relay_error_t syslog_relay_client_free(syslog_relay_client_t client);
  */
 syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data);
 
+/**
+ * Starts capturing the syslog of the device using a callback that receives
+ * whole lines. Data is read from the device in large blocks and split on
+ * newline and NUL boundaries. Lines longer than the internal buffer are
+ * delivered in parts.
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog.
+ *
+ * @param client The syslog_relay client to use
+ * @param callback Callback to receive each line from the syslog.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_receive_lines_cb_t callback, void* user_data);
+
+/**
+ * Starts capturing the syslog of the device using a callback that receives
+ * parsed lines. Parsing happens in the capture thread and does not copy
+ * any data. See syslog_relay_start_capture_lines().
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog.
+ *
+ * @param client The syslog_relay client to use
+ * @param callback Callback to receive each parsed line from the syslog.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+syslog_relay_error_t syslog_relay_start_capture_records(syslog_relay_client_t client, syslog_relay_receive_records_cb_t callback, void* user_data);
+
 /**
  * Stops capturing the syslog of the device.
  *
@@ -120,6 +213,205 @@ syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, sy
  */
 syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client);
 
+/**
+ * Decouples receiving from the device from calling the capture callback.
+ * Received lines are put into a ring buffer of the given size and passed to
+ * the callback by a separate thread, so a slow callback does not stall
+ * reading from the device. Has to be called while no capture is running.
+ * Without a queue the callback is called by the receiving thread.
+ *
+ * @param client The syslog_relay client to use
+ * @param capacity The size of the ring buffer in bytes, or 0 to disable the
+ *      queue. Small values are raised to fit the longest possible line.
+ * @param policy What to do when the ring buffer is full.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when a capture is running.
+ */
+syslog_relay_error_t syslog_relay_set_queue(syslog_relay_client_t client, uint32_t capacity, syslog_relay_queue_policy_t policy);
+
+/**
+ * Gets the statistics of the queue set with syslog_relay_set_queue().
+ * The values are reset when a capture is started.
+ *
+ * @param client The syslog_relay client to use
+ * @param lines_dropped Pointer that will be set to the number of lines
+ *      dropped because the queue was full. (can be NULL)
+ * @param high_water Pointer that will be set to the highest number of bytes
+ *      that were queued at once. (can be NULL)
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_INVALID_ARG
+ *      when one or more parameters are invalid.
+ */
+syslog_relay_error_t syslog_relay_get_queue_stats(syslog_relay_client_t client, uint64_t *lines_dropped, uint32_t *high_water);
+
+/* Filtering */
+
+/**
+ * Only passes lines of the given process to the lines and records
+ * callbacks. Can be called multiple times to pass lines of any of several
+ * processes. Filters can only be changed while no capture is running.
+ *
+ * @param client The syslog_relay client to use
+ * @param process The process name to match, without pid.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when a capture is running.
+ */
+syslog_relay_error_t syslog_relay_filter_add_process(syslog_relay_client_t client, const char *process);
+
+/**
+ * Only passes lines with a process id in the given range to the lines and
+ * records callbacks. Filters can only be changed while no capture is
+ * running.
+ *
+ * @param client The syslog_relay client to use
+ * @param pid_min The lowest process id to pass.
+ * @param pid_max The highest process id to pass.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when a capture is running.
+ */
+syslog_relay_error_t syslog_relay_filter_set_pid_range(syslog_relay_client_t client, uint32_t pid_min, uint32_t pid_max);
+
+/**
+ * Only passes lines with the given level or a more severe one to the lines
+ * and records callbacks. Filters can only be changed while no capture is
+ * running.
+ *
+ * @param client The syslog_relay client to use
+ * @param level The least severe level to pass.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when a capture is running.
+ */
+syslog_relay_error_t syslog_relay_filter_set_level(syslog_relay_client_t client, syslog_relay_level_t level);
+
+/**
+ * Only passes lines whose message contains the given string to the lines
+ * and records callbacks. Can be called multiple times to pass lines
+ * containing any of several strings. Filters can only be changed while no
+ * capture is running.
+ *
+ * @param client The syslog_relay client to use
+ * @param substring The string to search for.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when a capture is running.
+ */
+syslog_relay_error_t syslog_relay_filter_add_substring(syslog_relay_client_t client, const char *substring);
+
+/**
+ * Removes all filters, so all lines are passed to the callbacks again.
+ *
+ * @param client The syslog_relay client to use
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when a capture is running.
+ */
+syslog_relay_error_t syslog_relay_filter_clear(syslog_relay_client_t client);
+
+/**
+ * Parses a syslog line into its fields without copying.
+ *
+ * @param line The line to parse.
+ * @param length The length of the line.
+ * @param record Pointer to a struct syslog_relay_record that will be filled.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_INVALID_ARG
+ *      when one or more parameters are invalid. Lines that do not follow
+ *      the syslog format are returned with only the message set.
+ */
+syslog_relay_error_t syslog_relay_parse_line(const char *line, uint32_t length, struct syslog_relay_record *record);
+
+/* Archiving */
+
+/**
+ * Opens a directory for archiving syslog lines. Lines are written to
+ * segment files that are rotated by size or age. Each segment is
+ * accompanied by a sparse index of receive timestamps and file offsets, so
+ * syslog_relay_archive_read() can seek to a time range instead of scanning.
+ * Lines are stored as text, each prefixed with the receive time in
+ * milliseconds since epoch.
+ *
+ * @param directory The directory to write the segments to. It is created
+ *      if it does not exist.
+ * @param max_segment_size Size in bytes after which a new segment is
+ *      started, or 0 for no limit.
+ * @param max_segment_time Time in seconds after which a new segment is
+ *      started, or 0 for no limit.
+ * @param archive Pointer that will be set to the archive writer. Close with
+ *      syslog_relay_archive_close().
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when the directory cannot
+ *      be written to.
+ */
+syslog_relay_error_t syslog_relay_archive_open(const char *directory, uint64_t max_segment_size, uint32_t max_segment_time, syslog_relay_archive_t *archive);
+
+/**
+ * Adds a line to an archive, stamped with the current time. Writes are
+ * batched, and a segment is synced to disk when it is completed.
+ * Buffered lines are written out with a later line once a second has
+ * passed, so call syslog_relay_archive_flush() regularly to write them out
+ * when no more lines arrive.
+ * Can be used directly as a syslog_relay_receive_lines_cb_t with the
+ * archive as user data.
+ *
+ * @param line The line to add, without newline.
+ * @param length The length of the line.
+ * @param archive The archive writer to use.
+ */
+void syslog_relay_archive_write(const char *line, uint32_t length, void *archive);
+
+/**
+ * Writes out the lines added to an archive so far, without syncing.
+ * Can be called from another thread than syslog_relay_archive_write().
+ *
+ * @param archive The archive writer to use.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when archive is NULL or
+ *      SYSLOG_RELAY_E_UNKNOWN_ERROR when writing fails.
+ */
+syslog_relay_error_t syslog_relay_archive_flush(syslog_relay_archive_t archive);
+
+/**
+ * Completes the current segment and closes an archive.
+ *
+ * @param archive The archive writer to close.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when archive is NULL or
+ *      SYSLOG_RELAY_E_UNKNOWN_ERROR when writing fails.
+ */
+syslog_relay_error_t syslog_relay_archive_close(syslog_relay_archive_t archive);
+
+/**
+ * Reads the lines of an archive received within a time range, in the order
+ * they were received. Only the segments overlapping the range are opened,
+ * and reading starts at the nearest indexed offset.
+ *
+ * @param directory The archive directory.
+ * @param from Start of the range in milliseconds since epoch.
+ * @param to End of the range in milliseconds since epoch, inclusive.
+ * @param callback Callback to receive each line, without the timestamp.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when the directory cannot
+ *      be read.
+ */
+syslog_relay_error_t syslog_relay_archive_read(const char *directory, uint64_t from, uint64_t to, syslog_relay_receive_lines_cb_t callback, void *user_data);
+
 /* Receiving */
 
 /**
@@ -28,10 +28,23 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#else
+#include <gcrypt.h>
+#endif
+#include <plist/plist.h>
 
 #include "afc.h"
 #include "idevice.h"
 #include "common/debug.h"
+#include "common/utils.h"
 #include "endianness.h"
 
 /**
@@ -56,6 +69,190 @@ static void afc_unlock(afc_client_t client)
 	mutex_unlock(&client->mutex);
 }
 
+/**
+ * Returns the current time in milliseconds.
+ */
+static uint64_t afc_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+/**
+ * Calculates the stat cache bucket for a path.
+ */
+static uint32_t afc_stat_cache_bucket(const char *path)
+{
+	uint32_t hash = 5381;
+	while (*path) {
+		hash = (hash * 33) ^ (unsigned char)*path++;
+	}
+	return hash % AFC_STAT_CACHE_BUCKETS;
+}
+
+/**
+ * Removes all entries from the stat cache.
+ * The client must be locked by the caller.
+ */
+static void afc_stat_cache_flush(afc_client_t client)
+{
+	uint32_t i;
+
+	if (!client->stat_cache)
+		return;
+
+	for (i = 0; i < AFC_STAT_CACHE_BUCKETS; i++) {
+		struct afc_stat_cache_entry *entry = client->stat_cache[i];
+		while (entry) {
+			struct afc_stat_cache_entry *next = entry->next;
+			free(entry->path);
+			free(entry);
+			entry = next;
+		}
+		client->stat_cache[i] = NULL;
+	}
+	client->stat_cache_count = 0;
+}
+
+/**
+ * Looks up a non-expired stat cache entry for the given path.
+ * The client must be locked by the caller.
+ *
+ * @return 1 if stbuf was filled from the cache, 0 otherwise.
+ */
+static int afc_stat_cache_lookup(afc_client_t client, const char *path, struct afc_stat *stbuf)
+{
+	struct afc_stat_cache_entry **pentry;
+
+	if (!client->stat_cache || client->stat_cache_count == 0)
+		return 0;
+
+	pentry = &client->stat_cache[afc_stat_cache_bucket(path)];
+	while (*pentry) {
+		struct afc_stat_cache_entry *entry = *pentry;
+		if (!strcmp(entry->path, path)) {
+			if (entry->expires > afc_time_ms()) {
+				memcpy(stbuf, &entry->st, sizeof(struct afc_stat));
+				return 1;
+			}
+			/* expired */
+			*pentry = entry->next;
+			free(entry->path);
+			free(entry);
+			client->stat_cache_count--;
+			return 0;
+		}
+		pentry = &entry->next;
+	}
+	return 0;
+}
+
+/**
+ * Adds or replaces the stat cache entry for the given path.
+ * The client must be locked by the caller.
+ */
+static void afc_stat_cache_store(afc_client_t client, const char *path, const struct afc_stat *stbuf)
+{
+	struct afc_stat_cache_entry *entry;
+	uint32_t bucket;
+
+	if (!client->stat_cache || client->stat_cache_ttl == 0)
+		return;
+
+	bucket = afc_stat_cache_bucket(path);
+	for (entry = client->stat_cache[bucket]; entry; entry = entry->next) {
+		if (!strcmp(entry->path, path))
+			break;
+	}
+	if (!entry) {
+		if (client->stat_cache_count >= AFC_STAT_CACHE_MAX_ENTRIES) {
+			afc_stat_cache_flush(client);
+		}
+		entry = (struct afc_stat_cache_entry*)malloc(sizeof(struct afc_stat_cache_entry));
+		if (!entry)
+			return;
+		entry->path = strdup(path);
+		entry->next = client->stat_cache[bucket];
+		client->stat_cache[bucket] = entry;
+		client->stat_cache_count++;
+	}
+	memcpy(&entry->st, stbuf, sizeof(struct afc_stat));
+	entry->expires = afc_time_ms() + client->stat_cache_ttl;
+}
+
+/**
+ * Invalidates the stat cache entries of a path that is about to be or has
+ * been modified. This includes all entries below the path and the entry of
+ * the parent directory.
+ * The client must be locked by the caller.
+ */
+static void afc_stat_cache_invalidate(afc_client_t client, const char *path)
+{
+	uint32_t i;
+	size_t len;
+	size_t parent_len;
+	const char *slash;
+
+	if (!client->stat_cache || client->stat_cache_count == 0 || !path)
+		return;
+
+	len = strlen(path);
+	while (len > 1 && path[len-1] == '/')
+		len--;
+	slash = NULL;
+	for (i = 0; i < len; i++) {
+		if (path[i] == '/')
+			slash = path + i;
+	}
+	parent_len = (slash) ? (size_t)(slash - path) : 0;
+	if (slash && parent_len == 0)
+		parent_len = 1;
+
+	for (i = 0; i < AFC_STAT_CACHE_BUCKETS; i++) {
+		struct afc_stat_cache_entry **pentry = &client->stat_cache[i];
+		while (*pentry) {
+			struct afc_stat_cache_entry *entry = *pentry;
+			size_t elen = strlen(entry->path);
+			int match = 0;
+			if (elen >= len && !strncmp(entry->path, path, len) && (elen == len || entry->path[len] == '/')) {
+				match = 1;
+			} else if (slash && elen == parent_len && !strncmp(entry->path, path, parent_len)) {
+				match = 1;
+			}
+			if (match) {
+				*pentry = entry->next;
+				free(entry->path);
+				free(entry);
+				client->stat_cache_count--;
+			} else {
+				pentry = &entry->next;
+			}
+		}
+	}
+}
+
+/**
+ * Invalidates the stat cache entries of the file an open handle refers to.
+ * If the handle is unknown the whole cache is flushed.
+ * The client must be locked by the caller.
+ */
+static void afc_stat_cache_invalidate_handle(afc_client_t client, uint64_t handle)
+{
+	struct afc_open_file *file;
+
+	if (!client->stat_cache || client->stat_cache_count == 0)
+		return;
+
+	for (file = client->open_files; file; file = file->next) {
+		if (file->handle == handle) {
+			afc_stat_cache_invalidate(client, file->path);
+			return;
+		}
+	}
+	afc_stat_cache_flush(client);
+}
+
 /**
  * Makes a connection to the AFC service on the device using the given
  * connection.
@@ -90,6 +287,13 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_with_service_client(service_clie
 	memcpy(client_loc->afc_packet->magic, AFC_MAGIC, AFC_MAGIC_LEN);
 	client_loc->file_handle = 0;
 	client_loc->lock = 0;
+	client_loc->stat_cache_ttl = 0;
+	client_loc->stat_cache_count = 0;
+	client_loc->stat_cache = NULL;
+	client_loc->open_files = NULL;
+	client_loc->device_info_interval = 0;
+	client_loc->device_info_expires = 0;
+	client_loc->device_info_cache = NULL;
 	mutex_init(&client_loc->mutex);
 
 	*client = client_loc;
@@ -131,6 +335,16 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
 		service_client_free(client->parent);
 		client->parent = NULL;
 	}
+	afc_stat_cache_flush(client);
+	free(client->stat_cache);
+	if (client->device_info_cache)
+		afc_string_list_free(client->device_info_cache);
+	while (client->open_files) {
+		struct afc_open_file *next = client->open_files->next;
+		free(client->open_files->path);
+		free(client->open_files);
+		client->open_files = next;
+	}
 	free(client->afc_packet);
 	mutex_destroy(&client->mutex);
 	free(client);
@@ -210,15 +424,17 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation,
 }
 
 /**
- * Receives data through an AFC client and sets a variable to the received data.
- * 
+ * Receives the response to a specific packet through an AFC client and sets
+ * a variable to the received data.
+ *
  * @param client The client to receive data on.
+ * @param packet_num The number of the packet the response is expected for.
  * @param bytes The char* to point to the newly-received data.
  * @param bytes_recv How much data was received.
- * 
+ *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+static afc_error_t afc_receive_response(afc_client_t client, uint64_t packet_num, char **bytes, uint32_t *bytes_recv)
 {
 	AFCPacket header;
 	uint32_t entire_len = 0;
@@ -251,9 +467,9 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	}
 
 	/* check if it has the correct packet number */
-	if (header.packet_num != client->afc_packet->packet_num) {
+	if (header.packet_num != packet_num) {
 		/* otherwise print a warning but do not abort */
-		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, client->afc_packet->packet_num);
+		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, packet_num);
 		return AFC_E_OP_HEADER_INVALID;
 	}
 
@@ -358,6 +574,127 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	return AFC_E_SUCCESS;
 }
 
+/**
+ * Receives the response to the last dispatched packet through an AFC client
+ * and sets a variable to the received data.
+ *
+ * @param client The client to receive data on.
+ * @param bytes The char* to point to the newly-received data.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+{
+	return afc_receive_response(client, client->afc_packet->packet_num, bytes, bytes_recv);
+}
+
+/**
+ * Sends a packet of a batch. Called with the client locked.
+ *
+ * @param client The client to send the packet with.
+ * @param index Index of the batch item to send.
+ * @param user_data User data passed to afc_run_batch().
+ *
+ * @return AFC_E_SUCCESS if the packet was sent completely or an AFC_E_*
+ *  error value.
+ */
+typedef afc_error_t (*afc_batch_send_cb_t)(afc_client_t client, uint32_t index, void *user_data);
+
+/**
+ * Handles the response of a batch item. Called with the client locked.
+ *
+ * @param index Index of the batch item.
+ * @param data The received data, or NULL. Freed after the callback returned.
+ * @param length The length of the received data.
+ * @param user_data User data passed to afc_run_batch().
+ */
+typedef void (*afc_batch_recv_cb_t)(afc_client_t client, uint32_t index, const char *data, uint32_t length, void *user_data);
+
+/**
+ * Checks whether an error means the connection is not in a usable state
+ * anymore, as opposed to an error status reported by the device.
+ */
+static int afc_is_transport_error(afc_error_t err)
+{
+	return (err == AFC_E_MUX_ERROR || err == AFC_E_OP_HEADER_INVALID || err == AFC_E_NOT_ENOUGH_DATA);
+}
+
+/**
+ * Sends a batch of requests over one connection, keeping up to
+ * AFC_BATCH_WINDOW requests in flight, and collects the responses in order.
+ *
+ * @param client The client to use.
+ * @param count Number of requests in the batch.
+ * @param send_cb Callback sending the request of a batch item.
+ * @param recv_cb Optional callback handling the data of a successful response.
+ * @param user_data User data passed to the callbacks.
+ * @param results Optional array of count elements receiving the result of
+ *  each batch item.
+ *
+ * @return AFC_E_SUCCESS if all requests succeeded, otherwise the error of the
+ *  first request that failed.
+ */
+static afc_error_t afc_run_batch(afc_client_t client, uint32_t count, afc_batch_send_cb_t send_cb, afc_batch_recv_cb_t recv_cb, void *user_data, afc_error_t *results)
+{
+	afc_error_t ret = AFC_E_SUCCESS;
+	afc_error_t err = AFC_E_SUCCESS;
+	afc_error_t send_err = AFC_E_SUCCESS;
+	uint64_t first_packet_num;
+	uint32_t sent = 0;
+	uint32_t received = 0;
+
+	afc_lock(client);
+
+	first_packet_num = client->afc_packet->packet_num + 1;
+
+	while (received < count) {
+		/* fill the window */
+		while (send_err == AFC_E_SUCCESS && sent < count && (sent - received) < AFC_BATCH_WINDOW) {
+			send_err = send_cb(client, sent, user_data);
+			if (send_err == AFC_E_SUCCESS)
+				sent++;
+		}
+		if (sent == received) {
+			/* sending failed, nothing left to wait for */
+			err = send_err;
+			break;
+		}
+
+		char *data = NULL;
+		uint32_t bytes = 0;
+		err = afc_receive_response(client, first_packet_num + received, &data, &bytes);
+		if (afc_is_transport_error(err)) {
+			free(data);
+			break;
+		}
+		if (err == AFC_E_SUCCESS && recv_cb) {
+			recv_cb(client, received, data, bytes, user_data);
+		}
+		free(data);
+		if (results)
+			results[received] = err;
+		if (ret == AFC_E_SUCCESS)
+			ret = err;
+		received++;
+	}
+
+	/* the connection broke, fail everything that did not get a response */
+	if (received < count) {
+		debug_info("batch aborted after %d of %d items: %d", received, count, err);
+		if (ret == AFC_E_SUCCESS)
+			ret = err;
+		for (; received < count; received++) {
+			if (results)
+				results[received] = err;
+		}
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
 /**
  * Returns counts of null characters within a string.
  */
@@ -402,6 +739,116 @@ static char **make_strings_list(char *tokens, uint32_t length)
 	return list;
 }
 
+/**
+ * Splits a string of tokens by null characters like make_strings_list(), but
+ * places the list and a copy of all tokens into a single allocation.
+ *
+ * @param tokens The characters to split into a list.
+ * @param length The length of the tokens string.
+ *
+ * @return A char ** list with each token found in the string. The caller is
+ *  responsible for freeing the list with a single free().
+ */
+static char **make_strings_arena(const char *tokens, uint32_t length)
+{
+	uint32_t nulls = 0, i = 0, j = 0;
+	char **list = NULL;
+	char *strings = NULL;
+
+	if (!tokens || !length)
+		return NULL;
+
+	nulls = count_nullspaces((char*)tokens, length);
+	list = (char **) malloc(sizeof(char *) * (nulls + 1) + length);
+	if (!list)
+		return NULL;
+	strings = (char*)(list + nulls + 1);
+	memcpy(strings, tokens, length);
+	for (i = 0; i < nulls; i++) {
+		list[i] = strings + j;
+		j += strlen(list[i]) + 1;
+	}
+	list[i] = NULL;
+
+	return list;
+}
+
+/**
+ * Sends a request with an optional path argument and returns the response
+ * as a string list in a single allocation.
+ *
+ * @param client The client to use.
+ * @param operation The operation to perform.
+ * @param path The path argument, or NULL if the operation takes none.
+ * @param list Pointer that will be set to the resulting string list.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_request_strings_arena(afc_client_t client, uint64_t operation, const char *path, char ***list)
+{
+	uint32_t bytes = 0;
+	char *data = NULL;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	*list = NULL;
+
+	afc_lock(client);
+
+	/* Send the command */
+	ret = afc_dispatch_packet(client, operation, path, (path) ? strlen(path)+1 : 0, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive the data */
+	ret = afc_receive_data(client, &data, &bytes);
+
+	afc_unlock(client);
+
+	if (ret == AFC_E_SUCCESS && data) {
+		*list = make_strings_arena(data, bytes);
+		if (!*list && bytes > 0)
+			ret = AFC_E_NO_MEM;
+	}
+	free(data);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_read_directory_list(afc_client_t client, const char *path, char ***list)
+{
+	if (!client || !path || !list || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	return afc_request_strings_arena(client, AFC_OP_READ_DIR, path, list);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info_list(afc_client_t client, const char *path, char ***list)
+{
+	if (!client || !path || !list || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	return afc_request_strings_arena(client, AFC_OP_GET_FILE_INFO, path, list);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info_list(afc_client_t client, char ***list)
+{
+	if (!client || !list || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	return afc_request_strings_arena(client, AFC_OP_GET_DEVINFO, NULL, list);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_string_list_free(char **list)
+{
+	if (!list)
+		return AFC_E_INVALID_ARG;
+
+	free(list);
+
+	return AFC_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information)
 {
 	uint32_t bytes = 0;
@@ -475,64 +922,218 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char *
 	return ret;
 }
 
+/**
+ * Fetches the device information into the client's cache if caching is
+ * enabled and the cached copy is missing or expired.
+ *
+ * @param client The client to use.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value. On success
+ *         the client is left locked, so the cache cannot be dropped by
+ *         afc_set_device_info_refresh_interval() before it was read. The
+ *         caller has to unlock it.
+ */
+static afc_error_t afc_device_info_refresh(afc_client_t client)
+{
+	afc_error_t ret;
+	char **kvps = NULL;
+
+	afc_lock(client);
+	if (client->device_info_cache && client->device_info_expires > afc_time_ms()) {
+		return AFC_E_SUCCESS;
+	}
+	afc_unlock(client);
+
+	ret = afc_get_device_info_list(client, &kvps);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+	if (!kvps)
+		return AFC_E_NOT_ENOUGH_DATA;
+
+	afc_lock(client);
+	if (client->device_info_cache)
+		afc_string_list_free(client->device_info_cache);
+	client->device_info_cache = kvps;
+	client->device_info_expires = afc_time_ms() + client->device_info_interval;
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Fills a struct afc_device_info from a device info key/value list.
+ */
+static void afc_parse_device_info(char **kvps, struct afc_device_info *info)
+{
+	char **ptr;
+
+	memset(info, 0, sizeof(struct afc_device_info));
+	for (ptr = kvps; *ptr && *(ptr+1); ptr += 2) {
+		if (!strcmp(*ptr, "FSTotalBytes")) {
+			info->total_bytes = strtoull(*(ptr+1), NULL, 10);
+		} else if (!strcmp(*ptr, "FSFreeBytes")) {
+			info->free_bytes = strtoull(*(ptr+1), NULL, 10);
+		} else if (!strcmp(*ptr, "FSBlockSize")) {
+			info->block_size = strtoull(*(ptr+1), NULL, 10);
+		}
+	}
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char **value)
 {
 	afc_error_t ret = AFC_E_INTERNAL_ERROR;
 	char **kvps, **ptr;
 
 	*value = NULL;
-	if (key == NULL)
+	if (!client || key == NULL)
 		return AFC_E_INVALID_ARG;
 
-	ret = afc_get_device_info(client, &kvps);
-	if (ret != AFC_E_SUCCESS)
+	if (client->device_info_interval > 0) {
+		ret = afc_device_info_refresh(client);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+		for (ptr = client->device_info_cache; *ptr && *(ptr+1); ptr += 2) {
+			if (!strcmp(*ptr, key)) {
+				*value = strdup(*(ptr+1));
+				break;
+			}
+		}
+		afc_unlock(client);
+		return AFC_E_SUCCESS;
+	}
+
+	ret = afc_get_device_info_list(client, &kvps);
+	if (ret != AFC_E_SUCCESS || !kvps)
 		return ret;
 
-	for (ptr = kvps; *ptr; ptr++) {
+	for (ptr = kvps; *ptr && *(ptr+1); ptr += 2) {
 		if (!strcmp(*ptr, key)) {
 			*value = strdup(*(ptr+1));
 			break;
 		}
 	}
-	for (ptr = kvps; *ptr; ptr++) {
-		free(*ptr);
-	}
-	free(kvps);
+	afc_string_list_free(kvps);
 
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_remove_path(afc_client_t client, const char *path)
+LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info_snapshot(afc_client_t client, struct afc_device_info *info)
 {
-	uint32_t bytes = 0;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+	afc_error_t ret;
+	char **kvps = NULL;
 
-	if (!client || !path || !client->afc_packet || !client->parent)
+	if (!client || !info)
 		return AFC_E_INVALID_ARG;
 
-	afc_lock(client);
-
-	/* Send command */
-	ret = afc_dispatch_packet(client, AFC_OP_REMOVE_PATH, path, strlen(path)+1, NULL, 0, &bytes);
-	if (ret != AFC_E_SUCCESS) {
+	if (client->device_info_interval > 0) {
+		ret = afc_device_info_refresh(client);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+		afc_parse_device_info(client->device_info_cache, info);
 		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
+		return AFC_E_SUCCESS;
 	}
-	/* Receive response */
-	ret = afc_receive_data(client, NULL, &bytes);
 
-	/* special case; unknown error actually means directory not empty */
-	if (ret == AFC_E_UNKNOWN_ERROR)
-		ret = AFC_E_DIR_NOT_EMPTY;
+	ret = afc_get_device_info_list(client, &kvps);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+	if (!kvps)
+		return AFC_E_NOT_ENOUGH_DATA;
 
-	afc_unlock(client);
+	afc_parse_device_info(kvps, info);
+	afc_string_list_free(kvps);
 
-	return ret;
+	return AFC_E_SUCCESS;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_rename_path(afc_client_t client, const char *from, const char *to)
+LIBIMOBILEDEVICE_API afc_error_t afc_set_device_info_refresh_interval(afc_client_t client, uint32_t interval_ms)
 {
-	if (!client || !from || !to || !client->afc_packet || !client->parent)
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	if (client->device_info_cache) {
+		afc_string_list_free(client->device_info_cache);
+		client->device_info_cache = NULL;
+	}
+	client->device_info_expires = 0;
+	client->device_info_interval = interval_ms;
+
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_size_of_path_contents(afc_client_t client, const char *path, uint64_t *size)
+{
+	char *received = NULL;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !size || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	/* Send command */
+	ret = afc_dispatch_packet(client, AFC_OP_GET_SIZE_OF_PATH_CONTENTS, path, strlen(path)+1, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	/* Receive data */
+	ret = afc_receive_data(client, &received, &bytes);
+
+	afc_unlock(client);
+
+	if (ret == AFC_E_SUCCESS) {
+		if (received && bytes >= sizeof(uint64_t)) {
+			uint64_t total = 0;
+			memcpy(&total, received, sizeof(uint64_t));
+			*size = le64toh(total);
+		} else {
+			ret = AFC_E_NOT_ENOUGH_DATA;
+		}
+	}
+	free(received);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_remove_path(afc_client_t client, const char *path)
+{
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	/* Send command */
+	ret = afc_dispatch_packet(client, AFC_OP_REMOVE_PATH, path, strlen(path)+1, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive response */
+	ret = afc_receive_data(client, NULL, &bytes);
+
+	/* special case; unknown error actually means directory not empty */
+	if (ret == AFC_E_UNKNOWN_ERROR)
+		ret = AFC_E_DIR_NOT_EMPTY;
+
+	afc_stat_cache_invalidate(client, path);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_rename_path(afc_client_t client, const char *from, const char *to)
+{
+	if (!client || !from || !to || !client->afc_packet || !client->parent)
 		return AFC_E_INVALID_ARG;
 
 	char *buffer = (char *) malloc(sizeof(char) * (strlen(from) + strlen(to) + 1 + sizeof(uint32_t)));
@@ -554,6 +1155,9 @@ LIBIMOBILEDEVICE_API afc_error_t afc_rename_path(afc_client_t client, const char
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	afc_stat_cache_invalidate(client, from);
+	afc_stat_cache_invalidate(client, to);
+
 	afc_unlock(client);
 
 	return ret;
@@ -578,6 +1182,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_make_directory(afc_client_t client, const c
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	afc_stat_cache_invalidate(client, path);
+
 	afc_unlock(client);
 
 	return ret;
@@ -613,6 +1219,118 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 	return ret;
 }
 
+/**
+ * Parses the key/value list of a GetFileInfo response into a struct afc_stat
+ * without allocating any memory.
+ *
+ * @param data The received data.
+ * @param length The length of the received data.
+ * @param stbuf The struct afc_stat to fill.
+ */
+static void afc_parse_file_info(const char *data, uint32_t length, struct afc_stat *stbuf)
+{
+	const char *end = data + length;
+	const char *key = data;
+
+	memset(stbuf, '\0', sizeof(struct afc_stat));
+
+	while (key < end) {
+		const char *val = key + strnlen(key, end - key) + 1;
+		if (val >= end)
+			break;
+		if (!strcmp(key, "st_size")) {
+			stbuf->size = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_blocks")) {
+			stbuf->blocks = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_nlink")) {
+			stbuf->nlink = (uint32_t)strtoul(val, NULL, 10);
+		} else if (!strcmp(key, "st_mtime")) {
+			stbuf->mtime = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_birthtime")) {
+			stbuf->birthtime = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_ifmt")) {
+			if (!strcmp(val, "S_IFREG")) {
+				stbuf->ifmt = AFC_FILE_TYPE_REGULAR;
+			} else if (!strcmp(val, "S_IFDIR")) {
+				stbuf->ifmt = AFC_FILE_TYPE_DIRECTORY;
+			} else if (!strcmp(val, "S_IFLNK")) {
+				stbuf->ifmt = AFC_FILE_TYPE_SYMLINK;
+			} else if (!strcmp(val, "S_IFBLK")) {
+				stbuf->ifmt = AFC_FILE_TYPE_BLOCK;
+			} else if (!strcmp(val, "S_IFCHR")) {
+				stbuf->ifmt = AFC_FILE_TYPE_CHAR;
+			} else if (!strcmp(val, "S_IFIFO")) {
+				stbuf->ifmt = AFC_FILE_TYPE_FIFO;
+			} else if (!strcmp(val, "S_IFSOCK")) {
+				stbuf->ifmt = AFC_FILE_TYPE_SOCKET;
+			}
+		}
+		key = val + strnlen(val, end - val) + 1;
+	}
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stat(afc_client_t client, const char *path, struct afc_stat *stbuf)
+{
+	char *received = NULL;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !stbuf || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	if (afc_stat_cache_lookup(client, path, stbuf)) {
+		afc_unlock(client);
+		return AFC_E_SUCCESS;
+	}
+
+	/* Send command */
+	ret = afc_dispatch_packet(client, AFC_OP_GET_FILE_INFO, path, strlen(path)+1, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	/* Receive data */
+	ret = afc_receive_data(client, &received, &bytes);
+	if (ret == AFC_E_SUCCESS) {
+		if (received && bytes > 0) {
+			afc_parse_file_info(received, bytes, stbuf);
+			afc_stat_cache_store(client, path, stbuf);
+		} else {
+			ret = AFC_E_NOT_ENOUGH_DATA;
+		}
+	}
+	free(received);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_set_stat_cache_ttl(afc_client_t client, uint32_t ttl_ms)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	afc_stat_cache_flush(client);
+	if (ttl_ms > 0 && !client->stat_cache) {
+		client->stat_cache = (struct afc_stat_cache_entry**)calloc(AFC_STAT_CACHE_BUCKETS, sizeof(struct afc_stat_cache_entry*));
+		if (!client->stat_cache) {
+			afc_unlock(client);
+			return AFC_E_NO_MEM;
+		}
+	}
+	client->stat_cache_ttl = ttl_ms;
+
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *filename, afc_file_mode_t file_mode, uint64_t *handle)
 {
 	if (!client || !client->parent || !client->afc_packet)
@@ -643,12 +1361,26 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *
 	/* Receive the data */
 	data = NULL;
 	ret = afc_receive_data(client, &data, &bytes);
+	if (file_mode != AFC_FOPEN_RDONLY) {
+		afc_stat_cache_invalidate(client, filename);
+	}
 	if ((ret == AFC_E_SUCCESS) && (bytes > 0) && data) {
-		afc_unlock(client);
-
 		/* Get the file handle */
 		memcpy(handle, data, sizeof(uint64_t));
 		free(data);
+
+		/* remember the path so writes can invalidate cached information */
+		if (client->stat_cache_ttl > 0) {
+			struct afc_open_file *file = (struct afc_open_file*)malloc(sizeof(struct afc_open_file));
+			if (file) {
+				file->handle = *handle;
+				file->path = strdup(filename);
+				file->next = client->open_files;
+				client->open_files = file;
+			}
+		}
+
+		afc_unlock(client);
 		return ret;
 	}
 	/* in case memory was allocated but no data received or an error occurred */
@@ -732,12 +1464,14 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t ha
 	current_count += bytes_loc - (sizeof(AFCPacket) + 8);
 
 	if (ret != AFC_E_SUCCESS) {
+		afc_stat_cache_invalidate_handle(client, handle);
 		afc_unlock(client);
 		*bytes_written = current_count;
 		return AFC_E_SUCCESS;
 	}
 
 	ret = afc_receive_data(client, NULL, &bytes_loc);
+	afc_stat_cache_invalidate_handle(client, handle);
 	afc_unlock(client);
 	if (ret != AFC_E_SUCCESS) {
 		debug_info("uh oh?");
@@ -746,6 +1480,88 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t ha
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API afc_error_t afc_file_pread(afc_client_t client, uint64_t handle, uint64_t offset, char *data, uint32_t length, uint32_t *bytes_read)
+{
+	char *input = NULL;
+	uint32_t bytes_loc = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || !data || !bytes_read || handle == 0)
+		return AFC_E_INVALID_ARG;
+	debug_info("called for offset %lld length %i", offset, length);
+
+	*bytes_read = 0;
+
+	afc_lock(client);
+
+	/* Send the read command */
+	struct {
+		uint64_t handle;
+		uint64_t offset;
+		uint64_t size;
+	} readinfo;
+	readinfo.handle = handle;
+	readinfo.offset = htole64(offset);
+	readinfo.size = htole64(length);
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_READ_OFFSET, (const char*)&readinfo, sizeof(readinfo), NULL, 0, &bytes_loc);
+
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive the data */
+	ret = afc_receive_data(client, &input, &bytes_loc);
+	afc_unlock(client);
+
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
+	}
+	if (input) {
+		if (bytes_loc > length)
+			bytes_loc = length;
+		memcpy(data, input, bytes_loc);
+		free(input);
+		*bytes_read = bytes_loc;
+	}
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_pwrite(afc_client_t client, uint64_t handle, uint64_t offset, const char *data, uint32_t length, uint32_t *bytes_written)
+{
+	uint32_t bytes_loc = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+	struct {
+		uint64_t handle;
+		uint64_t offset;
+	} writeinfo;
+
+	if (!client || !client->afc_packet || !client->parent || !bytes_written || (handle == 0))
+		return AFC_E_INVALID_ARG;
+
+	*bytes_written = 0;
+
+	afc_lock(client);
+
+	debug_info("Write offset: %lld length: %i", offset, length);
+
+	writeinfo.handle = handle;
+	writeinfo.offset = htole64(offset);
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_WRITE_OFFSET, (const char*)&writeinfo, sizeof(writeinfo), data, length, &bytes_loc);
+	/* a partial payload cannot be completed later, the device expects it in one packet */
+	if (ret != AFC_E_SUCCESS || bytes_loc != sizeof(AFCPacket) + sizeof(writeinfo) + length) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	ret = afc_receive_data(client, NULL, &bytes_loc);
+	afc_stat_cache_invalidate_handle(client, handle);
+	afc_unlock(client);
+	if (ret == AFC_E_SUCCESS) {
+		*bytes_written = length;
+	}
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
 {
 	uint32_t bytes = 0;
@@ -758,6 +1574,19 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t ha
 
 	debug_info("File handle %i", handle);
 
+	/* Forget about the path of the handle */
+	struct afc_open_file **pfile = &client->open_files;
+	while (*pfile) {
+		struct afc_open_file *file = *pfile;
+		if (file->handle == handle) {
+			*pfile = file->next;
+			free(file->path);
+			free(file);
+			break;
+		}
+		pfile = &file->next;
+	}
+
 	/* Send command */
 	ret = afc_dispatch_packet(client, AFC_OP_FILE_CLOSE, (const char*)&handle, 8, NULL, 0, &bytes);
 
@@ -900,6 +1729,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_truncate(afc_client_t client, uint64_t
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	afc_stat_cache_invalidate_handle(client, handle);
+
 	afc_unlock(client);
 
 	return ret;
@@ -930,6 +1761,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_truncate(afc_client_t client, const char *p
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	afc_stat_cache_invalidate(client, path);
+
 	afc_unlock(client);
 
 	return ret;
@@ -964,6 +1797,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_make_link(afc_client_t client, afc_link_typ
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	afc_stat_cache_invalidate(client, linkname);
+
 	afc_unlock(client);
 
 	return ret;
@@ -993,6 +1828,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_set_file_time(afc_client_t client, const ch
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	afc_stat_cache_invalidate(client, path);
+
 	afc_unlock(client);
 
 	return ret;
@@ -1017,8 +1854,2236 @@ LIBIMOBILEDEVICE_API afc_error_t afc_remove_path_and_contents(afc_client_t clien
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	afc_stat_cache_invalidate(client, path);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+/**
+ * Requests a device side hash of a file or a range of it.
+ *
+ * @param client The client to use.
+ * @param operation Either AFC_OP_GET_FILE_HASH or AFC_OP_GET_FILE_HASH_RANGE.
+ * @param path The path of the file to hash.
+ * @param offset Start of the range (only used with AFC_OP_GET_FILE_HASH_RANGE).
+ * @param length Length of the range (only used with AFC_OP_GET_FILE_HASH_RANGE).
+ * @param hash Pointer that will be set to the newly allocated hash data.
+ * @param hash_len Pointer that will be set to the length of the hash data.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_get_hash_internal(afc_client_t client, uint64_t operation, const char *path, uint64_t offset, uint64_t length, char **hash, uint32_t *hash_len)
+{
+	char *buffer = NULL;
+	char *received = NULL;
+	uint32_t bytes = 0;
+	uint32_t data_len = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !hash || !hash_len || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	*hash = NULL;
+	*hash_len = 0;
+
+	if (operation == AFC_OP_GET_FILE_HASH_RANGE) {
+		uint64_t range[2];
+		range[0] = htole64(offset);
+		range[1] = htole64(length);
+		data_len = sizeof(range) + strlen(path) + 1;
+		buffer = (char *) malloc(data_len);
+		memcpy(buffer, range, sizeof(range));
+		memcpy(buffer + sizeof(range), path, strlen(path) + 1);
+	} else {
+		data_len = strlen(path) + 1;
+		buffer = strdup(path);
+	}
+
+	afc_lock(client);
+
+	/* Send command */
+	ret = afc_dispatch_packet(client, operation, buffer, data_len, NULL, 0, &bytes);
+	free(buffer);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	/* Receive data */
+	ret = afc_receive_data(client, &received, &bytes);
+
 	afc_unlock(client);
 
+	if (ret == AFC_E_SUCCESS && received && bytes > 0) {
+		*hash = received;
+		*hash_len = bytes;
+	} else {
+		free(received);
+		if (ret == AFC_E_SUCCESS)
+			ret = AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_hash(afc_client_t client, const char *path, char **hash, uint32_t *hash_len)
+{
+	return afc_get_hash_internal(client, AFC_OP_GET_FILE_HASH, path, 0, 0, hash, hash_len);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_hash_range(afc_client_t client, const char *path, uint64_t offset, uint64_t length, char **hash, uint32_t *hash_len)
+{
+	return afc_get_hash_internal(client, AFC_OP_GET_FILE_HASH_RANGE, path, offset, length, hash, hash_len);
+}
+
+/**
+ * Calculates the SHA1 hash of a range of a local file, matching what the
+ * device returns for AFC_OP_GET_FILE_HASH(_RANGE).
+ *
+ * @param f The local file to hash.
+ * @param offset Start of the range.
+ * @param length Length of the range.
+ * @param hash_out Buffer of AFC_HASH_LEN bytes receiving the hash.
+ *
+ * @return 0 on success, -1 if the range could not be read completely.
+ */
+static int afc_sync_local_hash(FILE *f, uint64_t offset, uint64_t length, unsigned char *hash_out)
+{
+	char buf[AFC_SYNC_BUFFER_SIZE];
+	int res = 0;
+#ifdef HAVE_OPENSSL
+	EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+	if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha1(), NULL)) {
+		if (ctx)
+			EVP_MD_CTX_destroy(ctx);
+		return -1;
+	}
+#else
+	gcry_md_hd_t hd = NULL;
+	if (gcry_md_open(&hd, GCRY_MD_SHA1, 0) != 0) {
+		return -1;
+	}
+#endif
+
+	if (fseeko(f, (off_t)offset, SEEK_SET) != 0) {
+		res = -1;
+	}
+	while (res == 0 && length > 0) {
+		size_t len = (length > sizeof(buf)) ? sizeof(buf) : (size_t)length;
+		if (fread(buf, 1, len, f) != len) {
+			res = -1;
+			break;
+		}
+#ifdef HAVE_OPENSSL
+		if (!EVP_DigestUpdate(ctx, buf, len)) {
+			res = -1;
+			break;
+		}
+#else
+		gcry_md_write(hd, buf, len);
+#endif
+		length -= len;
+	}
+
+#ifdef HAVE_OPENSSL
+	if (!EVP_DigestFinal_ex(ctx, hash_out, NULL))
+		res = -1;
+	EVP_MD_CTX_destroy(ctx);
+#else
+	memcpy(hash_out, gcry_md_read(hd, GCRY_MD_SHA1), AFC_HASH_LEN);
+	gcry_md_close(hd);
+#endif
+	return res;
+}
+
+/**
+ * Checks whether a range of a local file matches the given device side hash.
+ *
+ * @return 1 if the hashes match, 0 otherwise.
+ */
+static int afc_sync_range_matches(FILE *f, uint64_t offset, uint64_t length, const char *hash, uint32_t hash_len)
+{
+	unsigned char local_hash[AFC_HASH_LEN];
+
+	if (!hash || hash_len != AFC_HASH_LEN)
+		return 0;
+	if (afc_sync_local_hash(f, offset, length, local_hash) < 0)
+		return 0;
+	return (memcmp(local_hash, hash, AFC_HASH_LEN) == 0);
+}
+
+/**
+ * Copies a range of an opened device file into a local file at the same
+ * offset.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_sync_copy_range(afc_client_t client, uint64_t handle, FILE *f, uint64_t offset, uint64_t length, uint64_t *bytes_transferred)
+{
+	char buf[AFC_SYNC_BUFFER_SIZE];
+	afc_error_t ret;
+
+	ret = afc_file_seek(client, handle, (int64_t)offset, SEEK_SET);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+	if (fseeko(f, (off_t)offset, SEEK_SET) != 0)
+		return AFC_E_IO_ERROR;
+
+	while (length > 0) {
+		uint32_t bytes_read = 0;
+		uint32_t len = (length > sizeof(buf)) ? sizeof(buf) : (uint32_t)length;
+		ret = afc_file_read(client, handle, buf, len, &bytes_read);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+		if (bytes_read == 0)
+			return AFC_E_END_OF_DATA;
+		if (fwrite(buf, 1, bytes_read, f) != bytes_read)
+			return AFC_E_IO_ERROR;
+		length -= bytes_read;
+		if (bytes_transferred)
+			*bytes_transferred += bytes_read;
+	}
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Synchronizes a single regular file from the device to the host.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_sync_file(afc_client_t client, const char *path, const char *local_path, uint64_t size, afc_sync_mode_t mode, uint64_t *bytes_transferred)
+{
+	afc_error_t ret;
+	uint64_t handle = 0;
+	uint64_t local_size = 0;
+	uint64_t offset = 0;
+	char *hash = NULL;
+	uint32_t hash_len = 0;
+	struct stat st;
+	FILE *f = NULL;
+
+	if (stat(local_path, &st) == 0 && S_ISREG(st.st_mode)) {
+		local_size = (uint64_t)st.st_size;
+		f = fopen(local_path, "r+b");
+	}
+
+	/* an unchanged file is detected with a single round trip */
+	if (f && local_size == size) {
+		if (afc_get_file_hash(client, path, &hash, &hash_len) == AFC_E_SUCCESS) {
+			int match = afc_sync_range_matches(f, 0, size, hash, hash_len);
+			free(hash);
+			hash = NULL;
+			if (match) {
+				debug_info("%s is up to date", path);
+				fclose(f);
+				return AFC_E_SUCCESS;
+			}
+		}
+	}
+
+	/* open the device file first so a failure leaves the local copy intact */
+	ret = afc_file_open(client, path, AFC_FOPEN_RDONLY, &handle);
+	if (ret != AFC_E_SUCCESS) {
+		if (f)
+			fclose(f);
+		return ret;
+	}
+
+	if (f && mode != AFC_SYNC_RANGE_HASH) {
+		fclose(f);
+		f = NULL;
+		local_size = 0;
+	}
+	if (!f) {
+		f = fopen(local_path, "wb");
+		local_size = 0;
+	}
+	if (!f) {
+		debug_info("could not open local file %s", local_path);
+		afc_file_close(client, handle);
+		return AFC_E_IO_ERROR;
+	}
+
+	for (offset = 0; offset < size && ret == AFC_E_SUCCESS; offset += AFC_SYNC_RANGE_SIZE) {
+		uint64_t length = size - offset;
+		if (length > AFC_SYNC_RANGE_SIZE)
+			length = AFC_SYNC_RANGE_SIZE;
+
+		/* only compare ranges that are completely present locally */
+		if (offset + length <= local_size) {
+			if (afc_get_file_hash_range(client, path, offset, length, &hash, &hash_len) == AFC_E_SUCCESS) {
+				int match = afc_sync_range_matches(f, offset, length, hash, hash_len);
+				free(hash);
+				hash = NULL;
+				if (match)
+					continue;
+			}
+		}
+		ret = afc_sync_copy_range(client, handle, f, offset, length, bytes_transferred);
+	}
+
+	afc_file_close(client, handle);
+
+	if (ret == AFC_E_SUCCESS && local_size > size) {
+		fflush(f);
+		if (ftruncate(fileno(f), (off_t)size) != 0) {
+			ret = AFC_E_IO_ERROR;
+		}
+	}
+	if (fclose(f) != 0 && ret == AFC_E_SUCCESS) {
+		ret = AFC_E_IO_ERROR;
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_sync_from_device(afc_client_t client, const char *path, const char *local_path, afc_sync_mode_t mode, uint64_t *bytes_transferred)
+{
+	afc_error_t ret;
+	char **list = NULL;
+	struct afc_stat st;
+	int i;
+
+	if (!client || !path || !local_path || (mode != AFC_SYNC_FILE_HASH && mode != AFC_SYNC_RANGE_HASH))
+		return AFC_E_INVALID_ARG;
+
+	ret = afc_stat(client, path, &st);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	if (st.ifmt == AFC_FILE_TYPE_REGULAR) {
+		return afc_sync_file(client, path, local_path, st.size, mode, bytes_transferred);
+	}
+	if (st.ifmt != AFC_FILE_TYPE_DIRECTORY) {
+		/* links and special files are not synchronized */
+		return AFC_E_SUCCESS;
+	}
+
+#ifdef WIN32
+	mkdir(local_path);
+#else
+	mkdir(local_path, 0755);
+#endif
+
+	ret = afc_read_directory(client, path, &list);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	for (i = 0; list && list[i]; i++) {
+		if (!strcmp(list[i], ".") || !strcmp(list[i], ".."))
+			continue;
+
+		char *device_child = string_build_path(path, list[i], NULL);
+		char *local_child = string_build_path(local_path, list[i], NULL);
+		ret = afc_sync_from_device(client, device_child, local_child, mode, bytes_transferred);
+		free(device_child);
+		free(local_child);
+		if (ret != AFC_E_SUCCESS)
+			break;
+	}
+	afc_dictionary_free(list);
+
+	return ret;
+}
+
+/**
+ * Dispatches a packet with a path argument prefixed by an optional 64 bit
+ * value, as used by most path based operations.
+ *
+ * @return AFC_E_SUCCESS if the packet was sent completely, otherwise
+ *  AFC_E_NOT_ENOUGH_DATA.
+ */
+static afc_error_t afc_dispatch_path_packet(afc_client_t client, uint64_t operation, const uint64_t *prefix, const char *path, const char *path2)
+{
+	uint32_t prefix_len = (prefix) ? sizeof(uint64_t) : 0;
+	uint32_t path_len = strlen(path) + 1;
+	uint32_t path2_len = (path2) ? strlen(path2) + 1 : 0;
+	uint32_t data_len = prefix_len + path_len + path2_len;
+	uint32_t bytes = 0;
+	afc_error_t ret;
+	char *buffer = (char*)malloc(data_len);
+
+	if (!buffer)
+		return AFC_E_NO_MEM;
+
+	if (prefix) {
+		uint64_t value = htole64(*prefix);
+		memcpy(buffer, &value, sizeof(uint64_t));
+	}
+	memcpy(buffer + prefix_len, path, path_len);
+	if (path2) {
+		memcpy(buffer + prefix_len + path_len, path2, path2_len);
+	}
+
+	ret = afc_dispatch_packet(client, operation, buffer, data_len, NULL, 0, &bytes);
+	free(buffer);
+	if (ret != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + data_len)
+		return AFC_E_NOT_ENOUGH_DATA;
+
+	return AFC_E_SUCCESS;
+}
+
+struct afc_stat_many_data {
+	const char **paths;
+	struct afc_stat *stbufs;
+	uint32_t *indices;
+};
+
+static afc_error_t afc_stat_many_send(afc_client_t client, uint32_t index, void *user_data)
+{
+	struct afc_stat_many_data *smd = (struct afc_stat_many_data*)user_data;
+	return afc_dispatch_path_packet(client, AFC_OP_GET_FILE_INFO, NULL, smd->paths[smd->indices[index]], NULL);
+}
+
+static void afc_stat_many_recv(afc_client_t client, uint32_t index, const char *data, uint32_t length, void *user_data)
+{
+	struct afc_stat_many_data *smd = (struct afc_stat_many_data*)user_data;
+	uint32_t i = smd->indices[index];
+
+	if (!data || length == 0)
+		return;
+	afc_parse_file_info(data, length, &smd->stbufs[i]);
+	afc_stat_cache_store(client, smd->paths[i], &smd->stbufs[i]);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stat_many(afc_client_t client, const char **paths, uint32_t count, struct afc_stat *stbufs, afc_error_t *results)
+{
+	struct afc_stat_many_data smd;
+	afc_error_t *fetch_results = NULL;
+	afc_error_t ret = AFC_E_SUCCESS;
+	uint32_t fetch_count = 0;
+	uint32_t i;
+
+	if (!client || !client->afc_packet || !client->parent || !paths || !stbufs || !results)
+		return AFC_E_INVALID_ARG;
+	for (i = 0; i < count; i++) {
+		if (!paths[i])
+			return AFC_E_INVALID_ARG;
+	}
+	if (count == 0)
+		return AFC_E_SUCCESS;
+
+	smd.paths = paths;
+	smd.stbufs = stbufs;
+	smd.indices = (uint32_t*)malloc(sizeof(uint32_t) * count);
+	fetch_results = (afc_error_t*)malloc(sizeof(afc_error_t) * count);
+	if (!smd.indices || !fetch_results) {
+		free(smd.indices);
+		free(fetch_results);
+		return AFC_E_NO_MEM;
+	}
+
+	/* answer what we can from the cache, request the rest */
+	afc_lock(client);
+	for (i = 0; i < count; i++) {
+		if (afc_stat_cache_lookup(client, paths[i], &stbufs[i])) {
+			results[i] = AFC_E_SUCCESS;
+		} else {
+			memset(&stbufs[i], '\0', sizeof(struct afc_stat));
+			smd.indices[fetch_count++] = i;
+		}
+	}
+	afc_unlock(client);
+
+	if (fetch_count > 0) {
+		afc_run_batch(client, fetch_count, afc_stat_many_send, afc_stat_many_recv, &smd, fetch_results);
+		for (i = 0; i < fetch_count; i++) {
+			results[smd.indices[i]] = fetch_results[i];
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (results[i] != AFC_E_SUCCESS) {
+			ret = results[i];
+			break;
+		}
+	}
+
+	free(smd.indices);
+	free(fetch_results);
+
+	return ret;
+}
+
+struct afc_path_batch_data {
+	const char **paths;
+	const char **paths2;
+	const uint64_t *values;
+};
+
+static afc_error_t afc_remove_paths_send(afc_client_t client, uint32_t index, void *user_data)
+{
+	struct afc_path_batch_data *pbd = (struct afc_path_batch_data*)user_data;
+	afc_stat_cache_invalidate(client, pbd->paths[index]);
+	return afc_dispatch_path_packet(client, AFC_OP_REMOVE_PATH, NULL, pbd->paths[index], NULL);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_remove_paths(afc_client_t client, const char **paths, uint32_t count, afc_error_t *results)
+{
+	struct afc_path_batch_data pbd;
+	afc_error_t ret;
+	uint32_t i;
+
+	if (!client || !client->afc_packet || !client->parent || !paths || !results)
+		return AFC_E_INVALID_ARG;
+	for (i = 0; i < count; i++) {
+		if (!paths[i])
+			return AFC_E_INVALID_ARG;
+	}
+	if (count == 0)
+		return AFC_E_SUCCESS;
+
+	pbd.paths = paths;
+	pbd.paths2 = NULL;
+	pbd.values = NULL;
+
+	ret = afc_run_batch(client, count, afc_remove_paths_send, NULL, &pbd, results);
+
+	/* special case; unknown error actually means directory not empty */
+	if (ret == AFC_E_UNKNOWN_ERROR)
+		ret = AFC_E_DIR_NOT_EMPTY;
+	for (i = 0; i < count; i++) {
+		if (results[i] == AFC_E_UNKNOWN_ERROR)
+			results[i] = AFC_E_DIR_NOT_EMPTY;
+	}
+
+	return ret;
+}
+
+static afc_error_t afc_rename_paths_send(afc_client_t client, uint32_t index, void *user_data)
+{
+	struct afc_path_batch_data *pbd = (struct afc_path_batch_data*)user_data;
+	afc_stat_cache_invalidate(client, pbd->paths[index]);
+	afc_stat_cache_invalidate(client, pbd->paths2[index]);
+	return afc_dispatch_path_packet(client, AFC_OP_RENAME_PATH, NULL, pbd->paths[index], pbd->paths2[index]);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_rename_paths(afc_client_t client, const char **from, const char **to, uint32_t count, afc_error_t *results)
+{
+	struct afc_path_batch_data pbd;
+	uint32_t i;
+
+	if (!client || !client->afc_packet || !client->parent || !from || !to || !results)
+		return AFC_E_INVALID_ARG;
+	for (i = 0; i < count; i++) {
+		if (!from[i] || !to[i])
+			return AFC_E_INVALID_ARG;
+	}
+	if (count == 0)
+		return AFC_E_SUCCESS;
+
+	pbd.paths = from;
+	pbd.paths2 = to;
+	pbd.values = NULL;
+
+	return afc_run_batch(client, count, afc_rename_paths_send, NULL, &pbd, results);
+}
+
+static afc_error_t afc_set_file_times_send(afc_client_t client, uint32_t index, void *user_data)
+{
+	struct afc_path_batch_data *pbd = (struct afc_path_batch_data*)user_data;
+	afc_stat_cache_invalidate(client, pbd->paths[index]);
+	return afc_dispatch_path_packet(client, AFC_OP_SET_FILE_MOD_TIME, &pbd->values[index], pbd->paths[index], NULL);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_set_file_times(afc_client_t client, const char **paths, const uint64_t *mtimes, uint32_t count, afc_error_t *results)
+{
+	struct afc_path_batch_data pbd;
+	uint32_t i;
+
+	if (!client || !client->afc_packet || !client->parent || !paths || !mtimes || !results)
+		return AFC_E_INVALID_ARG;
+	for (i = 0; i < count; i++) {
+		if (!paths[i])
+			return AFC_E_INVALID_ARG;
+	}
+	if (count == 0)
+		return AFC_E_SUCCESS;
+
+	pbd.paths = paths;
+	pbd.paths2 = NULL;
+	pbd.values = mtimes;
+
+	return afc_run_batch(client, count, afc_set_file_times_send, NULL, &pbd, results);
+}
+
+struct afc_stream_read_data {
+	afc_stream_t stream;
+	uint32_t first_slot;
+};
+
+static afc_error_t afc_stream_read_send(afc_client_t client, uint32_t index, void *user_data)
+{
+	struct afc_stream_read_data *srd = (struct afc_stream_read_data*)user_data;
+	uint32_t bytes = 0;
+	afc_error_t ret;
+	struct {
+		uint64_t handle;
+		uint64_t size;
+	} readinfo;
+
+	readinfo.handle = srd->stream->handle;
+	readinfo.size = htole64(srd->stream->chunk_size);
+	ret = afc_dispatch_packet(client, AFC_OP_FILE_READ, (const char*)&readinfo, sizeof(readinfo), NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + sizeof(readinfo))
+		return AFC_E_NOT_ENOUGH_DATA;
+
+	return AFC_E_SUCCESS;
+}
+
+static void afc_stream_read_recv(afc_client_t client, uint32_t index, const char *data, uint32_t length, void *user_data)
+{
+	struct afc_stream_read_data *srd = (struct afc_stream_read_data*)user_data;
+	struct afc_stream_chunk *chunk = &srd->stream->chunks[(srd->first_slot + index) % srd->stream->window];
+
+	if (length > srd->stream->chunk_size)
+		length = srd->stream->chunk_size;
+	if (data && length > 0)
+		memcpy(chunk->data, data, length);
+	chunk->length = length;
+}
+
+/**
+ * Reads the next chunks of the read-ahead window from the device, with all
+ * read requests pipelined on the connection. Called by the stream worker
+ * without holding the stream mutex.
+ *
+ * @param stream The stream to read for.
+ * @param first_slot Index of the first chunk slot to fill.
+ * @param count Number of chunks to read.
+ * @param offset File offset of the first chunk.
+ * @param device_position Current position of the device file handle, will
+ *  be updated.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_stream_fill_chunks(afc_stream_t stream, uint32_t first_slot, uint32_t count, uint64_t offset, uint64_t *device_position)
+{
+	struct afc_stream_read_data srd;
+	afc_error_t ret;
+	uint32_t i;
+
+	if (*device_position != offset) {
+		ret = afc_file_seek(stream->client, stream->handle, (int64_t)offset, SEEK_SET);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+		*device_position = offset;
+	}
+
+	for (i = 0; i < count; i++) {
+		stream->chunks[(first_slot + i) % stream->window].length = 0;
+	}
+
+	srd.stream = stream;
+	srd.first_slot = first_slot;
+	afc_run_batch(stream->client, count, afc_stream_read_send, afc_stream_read_recv, &srd, stream->chunk_results);
+
+	for (i = 0; i < count; i++) {
+		if (stream->chunk_results[i] != AFC_E_SUCCESS)
+			break;
+		*device_position += stream->chunks[(first_slot + i) % stream->window].length;
+	}
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Writes a buffer of a stream to the device. Called by the stream worker
+ * without holding the stream mutex.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_stream_write_out(afc_stream_t stream, const char *data, uint32_t length, uint64_t offset, uint64_t *device_position)
+{
+	afc_error_t ret;
+
+	if (*device_position != offset) {
+		ret = afc_file_seek(stream->client, stream->handle, (int64_t)offset, SEEK_SET);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+		*device_position = offset;
+	}
+
+	while (length > 0) {
+		uint32_t written = 0;
+		ret = afc_file_write(stream->client, stream->handle, data, length, &written);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+		if (written == 0)
+			return AFC_E_WRITE_ERROR;
+		data += written;
+		length -= written;
+		*device_position += written;
+	}
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Background thread of a stream, writing out full write buffers and keeping
+ * the read-ahead window filled.
+ */
+static void* afc_stream_worker(void *arg)
+{
+	afc_stream_t stream = (afc_stream_t)arg;
+
+	mutex_lock(&stream->mutex);
+	while (!stream->quit) {
+		if (stream->write_pending_length > 0) {
+			uint64_t device_position = stream->device_position;
+			afc_error_t err;
+
+			stream->busy = 1;
+			mutex_unlock(&stream->mutex);
+			err = afc_stream_write_out(stream, stream->write_pending, stream->write_pending_length, stream->write_pending_offset, &device_position);
+			mutex_lock(&stream->mutex);
+			stream->busy = 0;
+
+			stream->device_position = device_position;
+			if (err != AFC_E_SUCCESS && stream->write_error == AFC_E_SUCCESS)
+				stream->write_error = err;
+			stream->write_pending_length = 0;
+			cond_broadcast(&stream->cond);
+			continue;
+		}
+
+		if (stream->prefetch && !stream->eof && stream->read_error == AFC_E_SUCCESS && stream->chunks_count < stream->window) {
+			uint32_t first_slot = (stream->chunks_head + stream->chunks_count) % stream->window;
+			uint32_t count = stream->window - stream->chunks_count;
+			uint32_t generation = stream->generation;
+			uint64_t offset = stream->prefetch_offset;
+			uint64_t device_position = stream->device_position;
+			afc_error_t err;
+			uint32_t i;
+
+			stream->busy = 1;
+			mutex_unlock(&stream->mutex);
+			err = afc_stream_fill_chunks(stream, first_slot, count, offset, &device_position);
+			mutex_lock(&stream->mutex);
+			stream->busy = 0;
+
+			stream->device_position = device_position;
+			if (generation == stream->generation) {
+				if (err != AFC_E_SUCCESS) {
+					stream->read_error = err;
+				}
+				for (i = 0; i < count && err == AFC_E_SUCCESS; i++) {
+					struct afc_stream_chunk *chunk = &stream->chunks[(first_slot + i) % stream->window];
+					if (stream->chunk_results[i] != AFC_E_SUCCESS) {
+						stream->read_error = stream->chunk_results[i];
+						break;
+					}
+					chunk->offset = stream->prefetch_offset;
+					if (chunk->length > 0) {
+						stream->chunks_count++;
+						stream->prefetch_offset += chunk->length;
+					}
+					if (chunk->length < stream->chunk_size) {
+						stream->eof = 1;
+						break;
+					}
+				}
+			}
+			cond_broadcast(&stream->cond);
+			continue;
+		}
+
+		cond_wait(&stream->cond, &stream->mutex);
+	}
+	mutex_unlock(&stream->mutex);
+
+	return NULL;
+}
+
+/**
+ * Discards the read-ahead window of a stream and stops prefetching.
+ * Called with the stream mutex held.
+ */
+static void afc_stream_invalidate_locked(afc_stream_t stream)
+{
+	stream->generation++;
+	while (stream->busy) {
+		cond_wait(&stream->cond, &stream->mutex);
+	}
+	stream->chunks_head = 0;
+	stream->chunks_count = 0;
+	stream->prefetch = 0;
+	stream->eof = 0;
+	stream->read_error = AFC_E_SUCCESS;
+}
+
+/**
+ * Hands the current write buffer of a stream over to the worker, waiting
+ * for a previously handed over buffer to be written first.
+ * Called with the stream mutex held.
+ */
+static void afc_stream_queue_write_locked(afc_stream_t stream)
+{
+	char *buffer;
+
+	if (stream->write_length == 0)
+		return;
+
+	while (stream->write_pending_length > 0) {
+		cond_wait(&stream->cond, &stream->mutex);
+	}
+
+	buffer = stream->write_pending;
+	stream->write_pending = stream->write_buffer;
+	stream->write_pending_length = stream->write_length;
+	stream->write_pending_offset = stream->write_offset;
+	stream->write_buffer = buffer;
+	stream->write_length = 0;
+
+	cond_broadcast(&stream->cond);
+}
+
+/**
+ * Waits until all written data of a stream has been sent to the device.
+ * Called with the stream mutex held.
+ *
+ * @return AFC_E_SUCCESS or the error of a failed write.
+ */
+static afc_error_t afc_stream_flush_locked(afc_stream_t stream)
+{
+	afc_error_t ret;
+
+	afc_stream_queue_write_locked(stream);
+	while (stream->write_pending_length > 0) {
+		cond_wait(&stream->cond, &stream->mutex);
+	}
+
+	ret = stream->write_error;
+	stream->write_error = AFC_E_SUCCESS;
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stream_new(afc_client_t client, uint64_t handle, uint32_t chunk_size, uint32_t window, afc_stream_t *stream)
+{
+	afc_stream_t stream_loc;
+	uint64_t position = 0;
+	afc_error_t ret;
+	uint32_t i;
+
+	if (!client || handle == 0 || !stream)
+		return AFC_E_INVALID_ARG;
+
+	if (chunk_size == 0)
+		chunk_size = AFC_STREAM_DEFAULT_CHUNK_SIZE;
+	if (window == 0)
+		window = AFC_STREAM_DEFAULT_WINDOW;
+
+	ret = afc_file_tell(client, handle, &position);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	stream_loc = (afc_stream_t)calloc(1, sizeof(struct afc_stream_private));
+	if (!stream_loc)
+		return AFC_E_NO_MEM;
+
+	stream_loc->client = client;
+	stream_loc->handle = handle;
+	stream_loc->chunk_size = chunk_size;
+	stream_loc->window = window;
+	stream_loc->position = position;
+	stream_loc->device_position = position;
+	stream_loc->prefetch_offset = position;
+	stream_loc->read_error = AFC_E_SUCCESS;
+	stream_loc->write_error = AFC_E_SUCCESS;
+
+	stream_loc->chunks = (struct afc_stream_chunk*)calloc(window, sizeof(struct afc_stream_chunk));
+	stream_loc->chunk_results = (afc_error_t*)calloc(window, sizeof(afc_error_t));
+	stream_loc->write_buffer = (char*)malloc(chunk_size);
+	stream_loc->write_pending = (char*)malloc(chunk_size);
+	ret = (stream_loc->chunks && stream_loc->chunk_results && stream_loc->write_buffer && stream_loc->write_pending) ? AFC_E_SUCCESS : AFC_E_NO_MEM;
+	for (i = 0; i < window && ret == AFC_E_SUCCESS; i++) {
+		stream_loc->chunks[i].data = (char*)malloc(chunk_size);
+		if (!stream_loc->chunks[i].data)
+			ret = AFC_E_NO_MEM;
+	}
+
+	if (ret == AFC_E_SUCCESS) {
+		mutex_init(&stream_loc->mutex);
+		cond_init(&stream_loc->cond);
+		if (thread_create(&stream_loc->worker, afc_stream_worker, stream_loc) != 0) {
+			debug_info("Could not start stream worker thread");
+			mutex_destroy(&stream_loc->mutex);
+			cond_destroy(&stream_loc->cond);
+			ret = AFC_E_NO_RESOURCES;
+		}
+	}
+
+	if (ret != AFC_E_SUCCESS) {
+		for (i = 0; stream_loc->chunks && i < window; i++) {
+			free(stream_loc->chunks[i].data);
+		}
+		free(stream_loc->chunks);
+		free(stream_loc->chunk_results);
+		free(stream_loc->write_buffer);
+		free(stream_loc->write_pending);
+		free(stream_loc);
+		return ret;
+	}
+
+	*stream = stream_loc;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stream_free(afc_stream_t stream)
+{
+	afc_error_t ret;
+	uint32_t i;
+
+	if (!stream)
+		return AFC_E_INVALID_ARG;
+
+	mutex_lock(&stream->mutex);
+	ret = afc_stream_flush_locked(stream);
+	stream->quit = 1;
+	cond_broadcast(&stream->cond);
+	mutex_unlock(&stream->mutex);
+
+	thread_join(stream->worker);
+
+	mutex_destroy(&stream->mutex);
+	cond_destroy(&stream->cond);
+	for (i = 0; i < stream->window; i++) {
+		free(stream->chunks[i].data);
+	}
+	free(stream->chunks);
+	free(stream->chunk_results);
+	free(stream->write_buffer);
+	free(stream->write_pending);
+	free(stream);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stream_read(afc_stream_t stream, char *data, uint32_t length, uint32_t *bytes_read)
+{
+	afc_error_t ret = AFC_E_SUCCESS;
+	uint32_t copied = 0;
+	int waited = 0;
+
+	if (!stream || !data || !bytes_read)
+		return AFC_E_INVALID_ARG;
+
+	*bytes_read = 0;
+
+	mutex_lock(&stream->mutex);
+
+	/* written data has to reach the device before reading it back */
+	if (stream->write_length > 0 || stream->write_pending_length > 0) {
+		ret = afc_stream_flush_locked(stream);
+		if (ret != AFC_E_SUCCESS) {
+			mutex_unlock(&stream->mutex);
+			return ret;
+		}
+	}
+
+	if (!stream->prefetch) {
+		stream->prefetch = 1;
+		stream->prefetch_offset = stream->position;
+		cond_broadcast(&stream->cond);
+	}
+
+	while (copied < length) {
+		if (stream->chunks_count > 0) {
+			struct afc_stream_chunk *chunk = &stream->chunks[stream->chunks_head];
+			uint64_t chunk_end = chunk->offset + chunk->length;
+			if (stream->position >= chunk->offset && stream->position < chunk_end) {
+				uint32_t avail = (uint32_t)(chunk_end - stream->position);
+				uint32_t len = (length - copied < avail) ? length - copied : avail;
+				memcpy(data + copied, chunk->data + (stream->position - chunk->offset), len);
+				copied += len;
+				stream->position += len;
+			}
+			if (stream->position >= chunk_end) {
+				/* chunk consumed, make room for the next one */
+				stream->chunks_head = (stream->chunks_head + 1) % stream->window;
+				stream->chunks_count--;
+				cond_broadcast(&stream->cond);
+			}
+			continue;
+		}
+		if (stream->read_error != AFC_E_SUCCESS) {
+			ret = stream->read_error;
+			break;
+		}
+		if (stream->eof) {
+			break;
+		}
+		waited = 1;
+		cond_wait(&stream->cond, &stream->mutex);
+	}
+
+	if (waited) {
+		stream->misses++;
+	} else {
+		stream->hits++;
+	}
+
+	mutex_unlock(&stream->mutex);
+
+	*bytes_read = copied;
+
+	return (copied > 0) ? AFC_E_SUCCESS : ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stream_write(afc_stream_t stream, const char *data, uint32_t length, uint32_t *bytes_written)
+{
+	afc_error_t ret;
+	uint32_t written = 0;
+
+	if (!stream || !data || !bytes_written)
+		return AFC_E_INVALID_ARG;
+
+	*bytes_written = 0;
+
+	mutex_lock(&stream->mutex);
+
+	ret = stream->write_error;
+	if (ret != AFC_E_SUCCESS) {
+		stream->write_error = AFC_E_SUCCESS;
+		mutex_unlock(&stream->mutex);
+		return ret;
+	}
+
+	/* the read-ahead data becomes stale */
+	if (stream->prefetch) {
+		afc_stream_invalidate_locked(stream);
+	}
+
+	while (written < length) {
+		uint32_t len;
+		if (stream->write_length > 0 && stream->write_offset + stream->write_length != stream->position) {
+			afc_stream_queue_write_locked(stream);
+		}
+		if (stream->write_length == 0) {
+			stream->write_offset = stream->position;
+		}
+		len = stream->chunk_size - stream->write_length;
+		if (len > length - written)
+			len = length - written;
+		memcpy(stream->write_buffer + stream->write_length, data + written, len);
+		stream->write_length += len;
+		stream->position += len;
+		written += len;
+		if (stream->write_length == stream->chunk_size) {
+			afc_stream_queue_write_locked(stream);
+		}
+	}
+
+	mutex_unlock(&stream->mutex);
+
+	*bytes_written = written;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stream_flush(afc_stream_t stream)
+{
+	afc_error_t ret;
+
+	if (!stream)
+		return AFC_E_INVALID_ARG;
+
+	mutex_lock(&stream->mutex);
+	ret = afc_stream_flush_locked(stream);
+	mutex_unlock(&stream->mutex);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stream_seek(afc_stream_t stream, int64_t offset, int whence)
+{
+	afc_error_t ret = AFC_E_SUCCESS;
+	int64_t new_position;
+
+	if (!stream)
+		return AFC_E_INVALID_ARG;
+
+	mutex_lock(&stream->mutex);
+
+	switch (whence) {
+	case SEEK_SET:
+		new_position = offset;
+		break;
+	case SEEK_CUR:
+		new_position = (int64_t)stream->position + offset;
+		break;
+	case SEEK_END:
+		/* the file size is only known to the device */
+		ret = afc_stream_flush_locked(stream);
+		if (ret == AFC_E_SUCCESS) {
+			uint64_t end = 0;
+			afc_stream_invalidate_locked(stream);
+			ret = afc_file_seek(stream->client, stream->handle, offset, SEEK_END);
+			if (ret == AFC_E_SUCCESS)
+				ret = afc_file_tell(stream->client, stream->handle, &end);
+			if (ret == AFC_E_SUCCESS)
+				stream->device_position = end;
+			new_position = (int64_t)end;
+		} else {
+			new_position = -1;
+		}
+		break;
+	default:
+		new_position = -1;
+		break;
+	}
+	if (ret == AFC_E_SUCCESS && new_position < 0) {
+		ret = AFC_E_INVALID_ARG;
+	}
+	if (ret != AFC_E_SUCCESS) {
+		mutex_unlock(&stream->mutex);
+		return ret;
+	}
+
+	if ((uint64_t)new_position != stream->position) {
+		/* pending writes carry their own offset */
+		afc_stream_queue_write_locked(stream);
+
+		if (stream->prefetch) {
+			if (stream->chunks_count > 0 && (uint64_t)new_position >= stream->chunks[stream->chunks_head].offset && (uint64_t)new_position <= stream->prefetch_offset) {
+				/* still inside the read-ahead window, drop what was skipped */
+				while (stream->chunks_count > 0) {
+					struct afc_stream_chunk *chunk = &stream->chunks[stream->chunks_head];
+					if ((uint64_t)new_position < chunk->offset + chunk->length)
+						break;
+					stream->chunks_head = (stream->chunks_head + 1) % stream->window;
+					stream->chunks_count--;
+				}
+				cond_broadcast(&stream->cond);
+			} else if (stream->chunks_count > 0 || (uint64_t)new_position != stream->prefetch_offset) {
+				afc_stream_invalidate_locked(stream);
+			}
+		}
+		stream->position = (uint64_t)new_position;
+	}
+
+	mutex_unlock(&stream->mutex);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stream_tell(afc_stream_t stream, uint64_t *position)
+{
+	if (!stream || !position)
+		return AFC_E_INVALID_ARG;
+
+	mutex_lock(&stream->mutex);
+	*position = stream->position;
+	mutex_unlock(&stream->mutex);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_stream_get_stats(afc_stream_t stream, uint64_t *hits, uint64_t *misses)
+{
+	if (!stream || !hits || !misses)
+		return AFC_E_INVALID_ARG;
+
+	mutex_lock(&stream->mutex);
+	*hits = stream->hits;
+	*misses = stream->misses;
+	mutex_unlock(&stream->mutex);
+
+	return AFC_E_SUCCESS;
+}
+
+struct afc_snapshot_item {
+	char *path;
+	struct afc_stat st;
+};
+
+static int afc_snapshot_item_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct afc_snapshot_item*)a)->path, ((const struct afc_snapshot_item*)b)->path);
+}
+
+static void afc_snapshot_items_free(struct afc_snapshot_item *items, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		free(items[i].path);
+	}
+	free(items);
+}
+
+/**
+ * Lists a directory and fetches the information of all of its entries in
+ * one pipelined batch.
+ *
+ * @param client The client to use.
+ * @param dir The directory to list.
+ * @param paths Pointer that will be set to the fully-qualified paths of the
+ *        entries. Free each path and the array with free().
+ * @param stbufs Pointer that will be set to the array of entry information.
+ * @param results Pointer that will be set to the array of per entry results.
+ *        Entries that could not be stat'ed have a result other than
+ *        AFC_E_SUCCESS and should be skipped.
+ * @param count Pointer that will be set to the number of entries.
+ *
+ * @return AFC_E_SUCCESS on success, or an AFC_E_* error value if the
+ *         directory could not be listed or the connection failed.
+ */
+static afc_error_t afc_read_directory_stat(afc_client_t client, const char *dir, char ***paths, struct afc_stat **stbufs, afc_error_t **results, uint32_t *count)
+{
+	char **list = NULL;
+	char **paths_loc;
+	struct afc_stat *stbufs_loc;
+	afc_error_t *results_loc;
+	uint32_t n = 0;
+	uint32_t i;
+	afc_error_t ret;
+
+	*paths = NULL;
+	*stbufs = NULL;
+	*results = NULL;
+	*count = 0;
+
+	ret = afc_read_directory_list(client, dir, &list);
+	if (ret != AFC_E_SUCCESS || !list)
+		return ret;
+
+	for (i = 0; list[i]; i++);
+	paths_loc = (char**)calloc(i + 1, sizeof(char*));
+	stbufs_loc = (struct afc_stat*)malloc((i + 1) * sizeof(struct afc_stat));
+	results_loc = (afc_error_t*)malloc((i + 1) * sizeof(afc_error_t));
+	if (!paths_loc || !stbufs_loc || !results_loc) {
+		free(paths_loc);
+		free(stbufs_loc);
+		free(results_loc);
+		afc_string_list_free(list);
+		return AFC_E_NO_MEM;
+	}
+
+	for (i = 0; list[i]; i++) {
+		if (!strcmp(list[i], ".") || !strcmp(list[i], ".."))
+			continue;
+		paths_loc[n++] = string_build_path(dir, list[i], NULL);
+	}
+	afc_string_list_free(list);
+
+	/* entries that vanished or cannot be accessed only fail individually,
+	 * the listing is dropped only if the connection itself failed */
+	ret = afc_stat_many(client, (const char**)paths_loc, n, stbufs_loc, results_loc);
+	if (ret != AFC_E_SUCCESS && !afc_is_transport_error(ret) && ret != AFC_E_NO_MEM) {
+		ret = AFC_E_SUCCESS;
+		for (i = 0; i < n; i++) {
+			if (afc_is_transport_error(results_loc[i])) {
+				ret = results_loc[i];
+				break;
+			}
+		}
+	}
+	if (ret != AFC_E_SUCCESS) {
+		for (i = 0; i < n; i++) {
+			free(paths_loc[i]);
+		}
+		free(paths_loc);
+		free(stbufs_loc);
+		free(results_loc);
+		return ret;
+	}
+
+	*paths = paths_loc;
+	*stbufs = stbufs_loc;
+	*results = results_loc;
+	*count = n;
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Crawls a directory tree breadth first, one directory at a time.
+ * Directories that vanish or cannot be listed are skipped.
+ *
+ * @param client The client to use.
+ * @param root The directory to crawl.
+ * @param items Pointer that will be set to the entries found, sorted by path.
+ * @param count Pointer that will be set to the number of entries.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_snapshot_crawl(afc_client_t client, const char *root, struct afc_snapshot_item **items, uint32_t *count)
+{
+	struct afc_snapshot_item *items_loc = NULL;
+	uint32_t count_loc = 0;
+	uint32_t capacity = 0;
+	uint32_t next = 0;
+	const char *dir = root;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	while (dir) {
+		char **paths = NULL;
+		struct afc_stat *stbufs = NULL;
+		afc_error_t *results = NULL;
+		uint32_t n = 0;
+		uint32_t i;
+
+		ret = afc_read_directory_stat(client, dir, &paths, &stbufs, &results, &n);
+		for (i = 0; ret == AFC_E_SUCCESS && i < n; i++) {
+			if (results[i] != AFC_E_SUCCESS)
+				continue;
+			if (count_loc == capacity) {
+				struct afc_snapshot_item *newitems;
+				capacity = (capacity) ? capacity * 2 : 256;
+				newitems = (struct afc_snapshot_item*)realloc(items_loc, capacity * sizeof(struct afc_snapshot_item));
+				if (!newitems) {
+					ret = AFC_E_NO_MEM;
+					break;
+				}
+				items_loc = newitems;
+			}
+			items_loc[count_loc].path = paths[i];
+			items_loc[count_loc].st = stbufs[i];
+			paths[i] = NULL;
+			count_loc++;
+		}
+		for (i = 0; i < n; i++) {
+			free(paths[i]);
+		}
+		free(paths);
+		free(stbufs);
+		free(results);
+
+		if (ret != AFC_E_SUCCESS && dir != root && !afc_is_transport_error(ret) && ret != AFC_E_NO_MEM) {
+			/* skip directories that vanished or are not accessible */
+			ret = AFC_E_SUCCESS;
+		}
+		if (ret != AFC_E_SUCCESS)
+			break;
+
+		/* the item list doubles as the queue of directories to visit */
+		dir = NULL;
+		while (next < count_loc) {
+			if (items_loc[next++].st.ifmt == AFC_FILE_TYPE_DIRECTORY) {
+				dir = items_loc[next-1].path;
+				break;
+			}
+		}
+	}
+
+	if (ret != AFC_E_SUCCESS) {
+		afc_snapshot_items_free(items_loc, count_loc);
+		return ret;
+	}
+
+	if (count_loc > 0)
+		qsort(items_loc, count_loc, sizeof(struct afc_snapshot_item), afc_snapshot_item_cmp);
+
+	*items = items_loc;
+	*count = count_loc;
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Writes crawled entries to a snapshot file, replacing it atomically.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_snapshot_write(const char *filename, struct afc_snapshot_item *items, uint32_t count)
+{
+	AFCSnapshotHeader header;
+	AFCSnapshotRecord *records;
+	uint64_t strings_length = 0;
+	char *tmpname;
+	FILE *f;
+	uint32_t i;
+	int res = 1;
+
+	records = (AFCSnapshotRecord*)malloc((count + 1) * sizeof(AFCSnapshotRecord));
+	if (!records)
+		return AFC_E_NO_MEM;
+
+	for (i = 0; i < count; i++) {
+		records[i].size = htole64(items[i].st.size);
+		records[i].mtime = htole64(items[i].st.mtime);
+		records[i].ifmt = htole32((uint32_t)items[i].st.ifmt);
+		records[i].path_offset = htole32((uint32_t)strings_length);
+		strings_length += strlen(items[i].path) + 1;
+	}
+	if (strings_length > UINT32_MAX) {
+		free(records);
+		return AFC_E_INTERNAL_ERROR;
+	}
+
+	memcpy(header.magic, AFC_SNAPSHOT_MAGIC, AFC_SNAPSHOT_MAGIC_LEN);
+	header.count = htole32(count);
+	header.reserved = 0;
+	header.strings_length = htole64(strings_length);
+
+	tmpname = string_concat(filename, ".tmp", NULL);
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		debug_info("could not open %s for writing", tmpname);
+		free(tmpname);
+		free(records);
+		return AFC_E_IO_ERROR;
+	}
+	res = (fwrite(&header, sizeof(header), 1, f) == 1);
+	if (res && count > 0)
+		res = (fwrite(records, sizeof(AFCSnapshotRecord), count, f) == count);
+	for (i = 0; res && i < count; i++) {
+		res = (fwrite(items[i].path, 1, strlen(items[i].path) + 1, f) == strlen(items[i].path) + 1);
+	}
+	if (fclose(f) != 0)
+		res = 0;
+	free(records);
+
+#ifdef WIN32
+	if (res)
+		remove(filename);
+#endif
+	if (!res || rename(tmpname, filename) != 0) {
+		remove(tmpname);
+		free(tmpname);
+		return AFC_E_IO_ERROR;
+	}
+	free(tmpname);
+
+	return AFC_E_SUCCESS;
+}
+
+static void afc_snapshot_record_to_entry(afc_snapshot_t snapshot, uint32_t index, struct afc_snapshot_entry *entry)
+{
+	const AFCSnapshotRecord *record = (const AFCSnapshotRecord*)(snapshot->data + sizeof(AFCSnapshotHeader)) + index;
+	const char *strings = snapshot->data + sizeof(AFCSnapshotHeader) + (uint64_t)snapshot->count * sizeof(AFCSnapshotRecord);
+
+	entry->path = strings + le32toh(record->path_offset);
+	entry->size = le64toh(record->size);
+	entry->mtime = le64toh(record->mtime);
+	entry->ifmt = (afc_file_type_t)le32toh(record->ifmt);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_snapshot_open(const char *filename, afc_snapshot_t *snapshot)
+{
+	afc_snapshot_t snapshot_loc;
+	AFCSnapshotHeader header;
+	uint64_t strings_length;
+	uint32_t i;
+
+	if (!filename || !snapshot)
+		return AFC_E_INVALID_ARG;
+
+	snapshot_loc = (afc_snapshot_t)calloc(1, sizeof(struct afc_snapshot_private));
+	if (!snapshot_loc)
+		return AFC_E_NO_MEM;
+
+#ifdef WIN32
+	buffer_read_from_filename(filename, &snapshot_loc->data, &snapshot_loc->length);
+	if (!snapshot_loc->data) {
+		free(snapshot_loc);
+		return AFC_E_OBJECT_NOT_FOUND;
+	}
+#else
+	{
+		struct stat st;
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			free(snapshot_loc);
+			return AFC_E_OBJECT_NOT_FOUND;
+		}
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(AFCSnapshotHeader)) {
+			close(fd);
+			free(snapshot_loc);
+			return AFC_E_OP_HEADER_INVALID;
+		}
+		snapshot_loc->length = st.st_size;
+		snapshot_loc->data = (char*)mmap(NULL, snapshot_loc->length, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (snapshot_loc->data == MAP_FAILED) {
+			free(snapshot_loc);
+			return AFC_E_IO_ERROR;
+		}
+		snapshot_loc->mapped = 1;
+	}
+#endif
+
+	/* validate the header and the string table */
+	if (snapshot_loc->length < sizeof(AFCSnapshotHeader)) {
+		afc_snapshot_free(snapshot_loc);
+		return AFC_E_OP_HEADER_INVALID;
+	}
+	memcpy(&header, snapshot_loc->data, sizeof(AFCSnapshotHeader));
+	snapshot_loc->count = le32toh(header.count);
+	strings_length = le64toh(header.strings_length);
+	if (memcmp(header.magic, AFC_SNAPSHOT_MAGIC, AFC_SNAPSHOT_MAGIC_LEN) != 0
+	    || snapshot_loc->length != sizeof(AFCSnapshotHeader) + (uint64_t)snapshot_loc->count * sizeof(AFCSnapshotRecord) + strings_length
+	    || (strings_length > 0 && snapshot_loc->data[snapshot_loc->length-1] != '\0')) {
+		debug_info("%s is not a valid snapshot file", filename);
+		afc_snapshot_free(snapshot_loc);
+		return AFC_E_OP_HEADER_INVALID;
+	}
+	for (i = 0; i < snapshot_loc->count; i++) {
+		const AFCSnapshotRecord *record = (const AFCSnapshotRecord*)(snapshot_loc->data + sizeof(AFCSnapshotHeader)) + i;
+		if (le32toh(record->path_offset) >= strings_length) {
+			afc_snapshot_free(snapshot_loc);
+			return AFC_E_OP_HEADER_INVALID;
+		}
+	}
+	*snapshot = snapshot_loc;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_snapshot_free(afc_snapshot_t snapshot)
+{
+	if (!snapshot)
+		return AFC_E_INVALID_ARG;
+
+#ifndef WIN32
+	if (snapshot->mapped) {
+		munmap(snapshot->data, snapshot->length);
+	} else
+#endif
+	free(snapshot->data);
+	free(snapshot);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_snapshot_get_count(afc_snapshot_t snapshot, uint32_t *count)
+{
+	if (!snapshot || !count)
+		return AFC_E_INVALID_ARG;
+
+	*count = snapshot->count;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_snapshot_get_entry(afc_snapshot_t snapshot, uint32_t index, struct afc_snapshot_entry *entry)
+{
+	if (!snapshot || !entry || index >= snapshot->count)
+		return AFC_E_INVALID_ARG;
+
+	afc_snapshot_record_to_entry(snapshot, index, entry);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_snapshot_lookup(afc_snapshot_t snapshot, const char *path, struct afc_snapshot_entry *entry)
+{
+	uint32_t lo = 0;
+	uint32_t hi;
+
+	if (!snapshot || !path || !entry)
+		return AFC_E_INVALID_ARG;
+
+	hi = snapshot->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp;
+		afc_snapshot_record_to_entry(snapshot, mid, entry);
+		cmp = strcmp(path, entry->path);
+		if (cmp == 0)
+			return AFC_E_SUCCESS;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return AFC_E_OBJECT_NOT_FOUND;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_snapshot_create(afc_client_t client, const char *root, const char *filename)
+{
+	struct afc_snapshot_item *items = NULL;
+	uint32_t count = 0;
+	afc_error_t ret;
+
+	if (!client || !root || !filename)
+		return AFC_E_INVALID_ARG;
+
+	ret = afc_snapshot_crawl(client, root, &items, &count);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	ret = afc_snapshot_write(filename, items, count);
+	afc_snapshot_items_free(items, count);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_snapshot_diff(afc_client_t client, const char *root, const char *filename, afc_snapshot_diff_cb_t callback, void *user_data)
+{
+	struct afc_snapshot_item *items = NULL;
+	struct afc_snapshot_entry old_entry;
+	struct afc_snapshot_entry new_entry;
+	afc_snapshot_t old = NULL;
+	uint32_t count = 0;
+	uint32_t old_count = 0;
+	uint32_t i = 0;
+	uint32_t j = 0;
+	afc_error_t ret;
+
+	if (!client || !root || !filename || !callback)
+		return AFC_E_INVALID_ARG;
+
+	ret = afc_snapshot_open(filename, &old);
+	if (ret == AFC_E_SUCCESS) {
+		old_count = old->count;
+	} else if (ret != AFC_E_OBJECT_NOT_FOUND) {
+		return ret;
+	}
+
+	ret = afc_snapshot_crawl(client, root, &items, &count);
+	if (ret != AFC_E_SUCCESS) {
+		if (old)
+			afc_snapshot_free(old);
+		return ret;
+	}
+
+	/* both lists are sorted by path, so a single merge pass finds all changes */
+	while (i < count || j < old_count) {
+		int cmp;
+		if (i < count) {
+			new_entry.path = items[i].path;
+			new_entry.size = items[i].st.size;
+			new_entry.mtime = items[i].st.mtime;
+			new_entry.ifmt = items[i].st.ifmt;
+		}
+		if (j < old_count) {
+			afc_snapshot_record_to_entry(old, j, &old_entry);
+		}
+		if (i >= count) {
+			cmp = 1;
+		} else if (j >= old_count) {
+			cmp = -1;
+		} else {
+			cmp = strcmp(new_entry.path, old_entry.path);
+		}
+		if (cmp < 0) {
+			callback(AFC_SNAPSHOT_ADDED, &new_entry, user_data);
+			i++;
+		} else if (cmp > 0) {
+			callback(AFC_SNAPSHOT_REMOVED, &old_entry, user_data);
+			j++;
+		} else {
+			if (new_entry.size != old_entry.size || new_entry.mtime != old_entry.mtime || new_entry.ifmt != old_entry.ifmt) {
+				callback(AFC_SNAPSHOT_CHANGED, &new_entry, user_data);
+			}
+			i++;
+			j++;
+		}
+	}
+
+	if (old)
+		afc_snapshot_free(old);
+
+	ret = afc_snapshot_write(filename, items, count);
+	afc_snapshot_items_free(items, count);
+
+	return ret;
+}
+
+/**
+ * Opens the connection of a pool channel.
+ *
+ * @param pool The pool to open the connection for.
+ * @param channel The channel to set up.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_pool_channel_open(afc_pool_t pool, struct afc_pool_channel *channel)
+{
+	afc_error_t ret;
+	house_arrest_client_t house_arrest = NULL;
+	afc_client_t client = NULL;
+	plist_t dict = NULL;
+
+	if (!pool->house_arrest_command) {
+		ret = afc_client_start_service(pool->device, &client, pool->label);
+		if (ret == AFC_E_SUCCESS) {
+			channel->client = client;
+		}
+		return ret;
+	}
+
+	if (house_arrest_client_start_service(pool->device, &house_arrest, pool->label) != HOUSE_ARREST_E_SUCCESS) {
+		return AFC_E_MUX_ERROR;
+	}
+	if (house_arrest_send_command(house_arrest, pool->house_arrest_command, pool->house_arrest_appid) != HOUSE_ARREST_E_SUCCESS
+	    || house_arrest_get_result(house_arrest, &dict) != HOUSE_ARREST_E_SUCCESS) {
+		house_arrest_client_free(house_arrest);
+		return AFC_E_MUX_ERROR;
+	}
+	if (plist_dict_get_item(dict, "Error")) {
+		debug_info("house_arrest refused to vend %s for %s", pool->house_arrest_command, pool->house_arrest_appid);
+		plist_free(dict);
+		house_arrest_client_free(house_arrest);
+		return AFC_E_PERM_DENIED;
+	}
+	plist_free(dict);
+
+	ret = afc_client_new_from_house_arrest_client(house_arrest, &client);
+	if (ret != AFC_E_SUCCESS) {
+		house_arrest_client_free(house_arrest);
+		return ret;
+	}
+	channel->client = client;
+	channel->house_arrest = house_arrest;
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Borrows an idle channel of a pool, opening a new connection if needed.
+ * If all channels are busy, waits for one to be released, or fails with
+ * AFC_E_OP_WOULD_BLOCK if wait is 0.
+ *
+ * @return The index of the borrowed channel, or -1 on error.
+ */
+static int afc_pool_channel_acquire(afc_pool_t pool, int wait, afc_error_t *error)
+{
+	uint32_t i;
+	int idx = -1;
+	int unopened = -1;
+
+	*error = AFC_E_SUCCESS;
+
+	mutex_lock(&pool->mutex);
+	while (idx < 0) {
+		unopened = -1;
+		for (i = 0; i < pool->max_channels; i++) {
+			if (pool->channels[i].in_use)
+				continue;
+			if (pool->channels[i].client) {
+				idx = i;
+				break;
+			}
+			if (unopened < 0)
+				unopened = i;
+		}
+		if (idx >= 0 || unopened >= 0)
+			break;
+		if (!wait) {
+			mutex_unlock(&pool->mutex);
+			*error = AFC_E_OP_WOULD_BLOCK;
+			return -1;
+		}
+		cond_wait(&pool->cond, &pool->mutex);
+	}
+	if (idx < 0)
+		idx = unopened;
+	pool->channels[idx].in_use++;
+	mutex_unlock(&pool->mutex);
+
+	if (!pool->channels[idx].client) {
+		/* open a new connection outside of the lock */
+		*error = afc_pool_channel_open(pool, &pool->channels[idx]);
+		if (*error != AFC_E_SUCCESS) {
+			mutex_lock(&pool->mutex);
+			pool->channels[idx].in_use--;
+			cond_broadcast(&pool->cond);
+			mutex_unlock(&pool->mutex);
+			return -1;
+		}
+	}
+
+	return idx;
+}
+
+/**
+ * Marks a channel of a pool as idle again.
+ */
+static void afc_pool_channel_release(afc_pool_t pool, uint32_t idx)
+{
+	mutex_lock(&pool->mutex);
+	pool->channels[idx].in_use--;
+	cond_broadcast(&pool->cond);
+	mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Marks the channel of a pool file as in use for the duration of an
+ * operation, so other borrowers prefer a different channel. Operations on
+ * files bound to the same channel are serialized by the client itself.
+ */
+static void afc_pool_file_begin(afc_pool_file_t file)
+{
+	mutex_lock(&file->pool->mutex);
+	file->pool->channels[file->channel].in_use++;
+	mutex_unlock(&file->pool->mutex);
+}
+
+static void afc_pool_file_end(afc_pool_file_t file)
+{
+	mutex_lock(&file->pool->mutex);
+	file->pool->channels[file->channel].in_use--;
+	cond_broadcast(&file->pool->cond);
+	mutex_unlock(&file->pool->mutex);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_new_with_house_arrest(idevice_t device, const char *command, const char *appid, uint32_t max_channels, const char *label, afc_pool_t *pool)
+{
+	afc_pool_t pool_loc;
+	afc_error_t ret = AFC_E_SUCCESS;
+	int idx;
+
+	if (!device || !pool || max_channels == 0 || (command && !appid))
+		return AFC_E_INVALID_ARG;
+
+	pool_loc = (afc_pool_t)calloc(1, sizeof(struct afc_pool_private));
+	if (!pool_loc)
+		return AFC_E_NO_MEM;
+
+	pool_loc->channels = (struct afc_pool_channel*)calloc(max_channels, sizeof(struct afc_pool_channel));
+	if (!pool_loc->channels) {
+		free(pool_loc);
+		return AFC_E_NO_MEM;
+	}
+	pool_loc->device = device;
+	pool_loc->max_channels = max_channels;
+	pool_loc->label = (label) ? strdup(label) : NULL;
+	pool_loc->house_arrest_command = (command) ? strdup(command) : NULL;
+	pool_loc->house_arrest_appid = (appid) ? strdup(appid) : NULL;
+	mutex_init(&pool_loc->mutex);
+	cond_init(&pool_loc->cond);
+
+	/* open the first connection right away to report errors early */
+	idx = afc_pool_channel_acquire(pool_loc, 1, &ret);
+	if (idx < 0) {
+		afc_pool_free(pool_loc);
+		return ret;
+	}
+	afc_pool_channel_release(pool_loc, idx);
+
+	*pool = pool_loc;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_new(idevice_t device, uint32_t max_channels, const char *label, afc_pool_t *pool)
+{
+	return afc_pool_new_with_house_arrest(device, NULL, NULL, max_channels, label, pool);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_free(afc_pool_t pool)
+{
+	uint32_t i;
+
+	if (!pool)
+		return AFC_E_INVALID_ARG;
+
+	for (i = 0; i < pool->max_channels; i++) {
+		if (pool->channels[i].client) {
+			afc_client_free(pool->channels[i].client);
+		}
+		if (pool->channels[i].house_arrest) {
+			house_arrest_client_free(pool->channels[i].house_arrest);
+		}
+	}
+	free(pool->channels);
+	free(pool->label);
+	free(pool->house_arrest_command);
+	free(pool->house_arrest_appid);
+	mutex_destroy(&pool->mutex);
+	cond_destroy(&pool->cond);
+	free(pool);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_acquire(afc_pool_t pool, afc_client_t *client)
+{
+	afc_error_t ret = AFC_E_SUCCESS;
+	int idx;
+
+	if (!pool || !client)
+		return AFC_E_INVALID_ARG;
+
+	idx = afc_pool_channel_acquire(pool, 1, &ret);
+	if (idx < 0)
+		return ret;
+
+	*client = pool->channels[idx].client;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_release(afc_pool_t pool, afc_client_t client)
+{
+	uint32_t i;
+
+	if (!pool || !client)
+		return AFC_E_INVALID_ARG;
+
+	for (i = 0; i < pool->max_channels; i++) {
+		if (pool->channels[i].client == client) {
+			afc_pool_channel_release(pool, i);
+			return AFC_E_SUCCESS;
+		}
+	}
+
+	return AFC_E_INVALID_ARG;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_file_open(afc_pool_t pool, const char *filename, afc_file_mode_t file_mode, afc_pool_file_t *file)
+{
+	afc_pool_file_t file_loc;
+	afc_error_t ret = AFC_E_SUCCESS;
+	uint64_t handle = 0;
+	int idx;
+
+	if (!pool || !filename || !file)
+		return AFC_E_INVALID_ARG;
+
+	idx = afc_pool_channel_acquire(pool, 1, &ret);
+	if (idx < 0)
+		return ret;
+
+	ret = afc_file_open(pool->channels[idx].client, filename, file_mode, &handle);
+	afc_pool_channel_release(pool, idx);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	file_loc = (afc_pool_file_t)malloc(sizeof(struct afc_pool_file_private));
+	if (!file_loc) {
+		afc_file_close(pool->channels[idx].client, handle);
+		return AFC_E_NO_MEM;
+	}
+	file_loc->pool = pool;
+	file_loc->channel = idx;
+	file_loc->handle = handle;
+
+	*file = file_loc;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_file_close(afc_pool_file_t file)
+{
+	afc_error_t ret;
+
+	if (!file)
+		return AFC_E_INVALID_ARG;
+
+	afc_pool_file_begin(file);
+	ret = afc_file_close(file->pool->channels[file->channel].client, file->handle);
+	afc_pool_file_end(file);
+	free(file);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_file_get_handle(afc_pool_file_t file, afc_client_t *client, uint64_t *handle)
+{
+	if (!file || !client || !handle)
+		return AFC_E_INVALID_ARG;
+
+	*client = file->pool->channels[file->channel].client;
+	*handle = file->handle;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_file_read(afc_pool_file_t file, char *data, uint32_t length, uint32_t *bytes_read)
+{
+	afc_error_t ret;
+
+	if (!file)
+		return AFC_E_INVALID_ARG;
+
+	afc_pool_file_begin(file);
+	ret = afc_file_read(file->pool->channels[file->channel].client, file->handle, data, length, bytes_read);
+	afc_pool_file_end(file);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_file_write(afc_pool_file_t file, const char *data, uint32_t length, uint32_t *bytes_written)
+{
+	afc_error_t ret;
+
+	if (!file)
+		return AFC_E_INVALID_ARG;
+
+	afc_pool_file_begin(file);
+	ret = afc_file_write(file->pool->channels[file->channel].client, file->handle, data, length, bytes_written);
+	afc_pool_file_end(file);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_file_pread(afc_pool_file_t file, uint64_t offset, char *data, uint32_t length, uint32_t *bytes_read)
+{
+	afc_error_t ret;
+
+	if (!file)
+		return AFC_E_INVALID_ARG;
+
+	afc_pool_file_begin(file);
+	ret = afc_file_pread(file->pool->channels[file->channel].client, file->handle, offset, data, length, bytes_read);
+	afc_pool_file_end(file);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_file_pwrite(afc_pool_file_t file, uint64_t offset, const char *data, uint32_t length, uint32_t *bytes_written)
+{
+	afc_error_t ret;
+
+	if (!file)
+		return AFC_E_INVALID_ARG;
+
+	afc_pool_file_begin(file);
+	ret = afc_file_pwrite(file->pool->channels[file->channel].client, file->handle, offset, data, length, bytes_written);
+	afc_pool_file_end(file);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_file_seek(afc_pool_file_t file, int64_t offset, int whence)
+{
+	afc_error_t ret;
+
+	if (!file)
+		return AFC_E_INVALID_ARG;
+
+	afc_pool_file_begin(file);
+	ret = afc_file_seek(file->pool->channels[file->channel].client, file->handle, offset, whence);
+	afc_pool_file_end(file);
+
+	return ret;
+}
+
+struct afc_walk_dir {
+	char *path;
+	struct afc_walk_dir *next;
+};
+
+struct afc_walk_state {
+	afc_pool_t pool;
+	const char *root;
+	afc_walk_cb_t callback;
+	void *user_data;
+	mutex_t mutex;
+	cond_t cond;
+	mutex_t callback_mutex;
+	struct afc_walk_dir *head;
+	struct afc_walk_dir *tail;
+	uint32_t active;
+	int stop;
+	afc_error_t error;
+};
+
+struct afc_walk_worker {
+	struct afc_walk_state *state;
+	int channel;
+	thread_t thread;
+};
+
+/**
+ * Lists one directory of a walk, reports its entries and queues the
+ * subdirectories found.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_walk_dir(struct afc_walk_state *state, afc_client_t client, const char *dir)
+{
+	struct afc_walk_dir *head = NULL;
+	struct afc_walk_dir *tail = NULL;
+	char **paths = NULL;
+	struct afc_stat *stbufs = NULL;
+	afc_error_t *results = NULL;
+	uint32_t n = 0;
+	uint32_t i;
+	afc_error_t ret;
+	int stop = 0;
+
+	ret = afc_read_directory_stat(client, dir, &paths, &stbufs, &results, &n);
+	if (ret != AFC_E_SUCCESS) {
+		if (strcmp(dir, state->root) != 0 && !afc_is_transport_error(ret) && ret != AFC_E_NO_MEM) {
+			/* skip directories that vanished or are not accessible */
+			return AFC_E_SUCCESS;
+		}
+		return ret;
+	}
+
+	mutex_lock(&state->callback_mutex);
+	for (i = 0; i < n && !stop; i++) {
+		/* entries removed since the listing are not reported */
+		if (results[i] != AFC_E_SUCCESS)
+			continue;
+		if (state->callback(paths[i], &stbufs[i], state->user_data) != 0) {
+			stop = 1;
+			break;
+		}
+		if (stbufs[i].ifmt == AFC_FILE_TYPE_DIRECTORY) {
+			struct afc_walk_dir *entry = (struct afc_walk_dir*)malloc(sizeof(struct afc_walk_dir));
+			if (!entry) {
+				ret = AFC_E_NO_MEM;
+				break;
+			}
+			entry->path = paths[i];
+			entry->next = NULL;
+			paths[i] = NULL;
+			if (tail)
+				tail->next = entry;
+			else
+				head = entry;
+			tail = entry;
+		}
+	}
+	mutex_unlock(&state->callback_mutex);
+
+	for (i = 0; i < n; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(stbufs);
+	free(results);
+
+	mutex_lock(&state->mutex);
+	if (stop)
+		state->stop = 1;
+	if (head) {
+		if (state->tail)
+			state->tail->next = head;
+		else
+			state->head = head;
+		state->tail = tail;
+		cond_broadcast(&state->cond);
+	}
+	mutex_unlock(&state->mutex);
+
+	return ret;
+}
+
+static void *afc_walk_worker_thread(void *arg)
+{
+	struct afc_walk_worker *worker = (struct afc_walk_worker*)arg;
+	struct afc_walk_state *state = worker->state;
+	afc_client_t client = state->pool->channels[worker->channel].client;
+
+	while (1) {
+		struct afc_walk_dir *dir;
+		afc_error_t ret;
+
+		mutex_lock(&state->mutex);
+		while (!state->head && state->active > 0 && !state->stop) {
+			cond_wait(&state->cond, &state->mutex);
+		}
+		if (state->stop || !state->head) {
+			mutex_unlock(&state->mutex);
+			break;
+		}
+		dir = state->head;
+		state->head = dir->next;
+		if (!state->head)
+			state->tail = NULL;
+		state->active++;
+		mutex_unlock(&state->mutex);
+
+		ret = afc_walk_dir(state, client, dir->path);
+		free(dir->path);
+		free(dir);
+
+		mutex_lock(&state->mutex);
+		state->active--;
+		if (ret != AFC_E_SUCCESS) {
+			if (state->error == AFC_E_SUCCESS)
+				state->error = ret;
+			state->stop = 1;
+		}
+		if (state->stop || (!state->head && state->active == 0))
+			cond_broadcast(&state->cond);
+		mutex_unlock(&state->mutex);
+	}
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_walk(afc_pool_t pool, const char *root, afc_walk_cb_t callback, void *user_data, uint32_t parallelism)
+{
+	struct afc_walk_state state;
+	struct afc_walk_worker *workers;
+	struct afc_walk_dir *dir;
+	afc_error_t ret = AFC_E_SUCCESS;
+	uint32_t count = 0;
+	uint32_t i;
+
+	if (!pool || !root || !callback)
+		return AFC_E_INVALID_ARG;
+
+	if (parallelism == 0 || parallelism > pool->max_channels)
+		parallelism = pool->max_channels;
+
+	workers = (struct afc_walk_worker*)calloc(parallelism, sizeof(struct afc_walk_worker));
+	dir = (struct afc_walk_dir*)malloc(sizeof(struct afc_walk_dir));
+	if (!workers || !dir) {
+		free(workers);
+		free(dir);
+		return AFC_E_NO_MEM;
+	}
+	dir->path = strdup(root);
+	dir->next = NULL;
+
+	memset(&state, 0, sizeof(state));
+	state.pool = pool;
+	state.root = root;
+	state.callback = callback;
+	state.user_data = user_data;
+	state.head = dir;
+	state.tail = dir;
+	state.error = AFC_E_SUCCESS;
+	mutex_init(&state.mutex);
+	cond_init(&state.cond);
+	mutex_init(&state.callback_mutex);
+
+	/* wait for the first channel, but only use more if they are available */
+	for (i = 0; i < parallelism; i++) {
+		workers[i].state = &state;
+		workers[i].channel = afc_pool_channel_acquire(pool, (i == 0), &ret);
+		if (workers[i].channel < 0)
+			break;
+		count++;
+	}
+
+	if (count > 0) {
+		ret = AFC_E_SUCCESS;
+		for (i = 1; i < count; i++) {
+			if (thread_create(&workers[i].thread, afc_walk_worker_thread, &workers[i]) != 0) {
+				afc_pool_channel_release(pool, workers[i].channel);
+				workers[i].channel = -1;
+			}
+		}
+		afc_walk_worker_thread(&workers[0]);
+		for (i = 1; i < count; i++) {
+			if (workers[i].channel < 0)
+				continue;
+			thread_join(workers[i].thread);
+			afc_pool_channel_release(pool, workers[i].channel);
+		}
+		afc_pool_channel_release(pool, workers[0].channel);
+		ret = state.error;
+	}
+
+	/* free directories left over after the walk was stopped */
+	while (state.head) {
+		dir = state.head;
+		state.head = dir->next;
+		free(dir->path);
+		free(dir);
+	}
+
+	mutex_destroy(&state.mutex);
+	cond_destroy(&state.cond);
+	mutex_destroy(&state.callback_mutex);
+	free(workers);
+
 	return ret;
 }
 
@@ -26,6 +26,7 @@
 #include <stdint.h>
 
 #include "libimobiledevice/afc.h"
+#include "libimobiledevice/house_arrest.h"
 #include "service.h"
 #include "endianness.h"
 #include "common/thread.h"
@@ -33,6 +34,29 @@
 #define AFC_MAGIC "CFA6LPAA"
 #define AFC_MAGIC_LEN (8)
 
+/* Length of the SHA1 hashes returned by AFC_OP_GET_FILE_HASH(_RANGE) */
+#define AFC_HASH_LEN (20)
+
+/* Size of the ranges compared in AFC_SYNC_RANGE_HASH mode */
+#define AFC_SYNC_RANGE_SIZE (4 * 1024 * 1024)
+#define AFC_SYNC_BUFFER_SIZE (0x10000)
+
+/* On-disk format of metadata snapshots, all values little endian */
+#define AFC_SNAPSHOT_MAGIC "AFCSNAP1"
+#define AFC_SNAPSHOT_MAGIC_LEN (8)
+
+typedef struct {
+	char magic[AFC_SNAPSHOT_MAGIC_LEN];
+	uint32_t count, reserved;
+	uint64_t strings_length;
+} AFCSnapshotHeader;
+
+/* followed by count records sorted by path, then the NUL terminated paths */
+typedef struct {
+	uint64_t size, mtime;
+	uint32_t ifmt, path_offset;
+} AFCSnapshotRecord;
+
 typedef struct {
 	char magic[AFC_MAGIC_LEN];
 	uint64_t entire_length, this_length, packet_num, operation;
@@ -50,6 +74,30 @@ typedef struct {
 	(x)->packet_num    = le64toh((x)->packet_num); \
 	(x)->operation     = le64toh((x)->operation);
 
+/* Number of hash buckets and maximum number of entries of the stat cache */
+#define AFC_STAT_CACHE_BUCKETS (256)
+#define AFC_STAT_CACHE_MAX_ENTRIES (4096)
+
+/* Maximum number of requests a batch keeps in flight */
+#define AFC_BATCH_WINDOW (32)
+
+/* Defaults for afc_stream_new() */
+#define AFC_STREAM_DEFAULT_CHUNK_SIZE (0x10000)
+#define AFC_STREAM_DEFAULT_WINDOW (4)
+
+struct afc_stat_cache_entry {
+	char *path;
+	struct afc_stat st;
+	uint64_t expires;
+	struct afc_stat_cache_entry *next;
+};
+
+struct afc_open_file {
+	uint64_t handle;
+	char *path;
+	struct afc_open_file *next;
+};
+
 struct afc_client_private {
 	service_client_t parent;
 	AFCPacket *afc_packet;
@@ -57,6 +105,13 @@ struct afc_client_private {
 	int lock;
 	mutex_t mutex;
 	int free_parent;
+	uint32_t stat_cache_ttl;
+	uint32_t stat_cache_count;
+	struct afc_stat_cache_entry **stat_cache;
+	struct afc_open_file *open_files;
+	uint32_t device_info_interval;
+	uint64_t device_info_expires;
+	char **device_info_cache;
 };
 
 /* AFC Operations */
@@ -106,6 +161,77 @@ enum {
 	AFC_OP_FILE_WRITE_OFFSET         = 0x00000028	/* FileRefWriteWithOffset */
 };
 
+struct afc_stream_chunk {
+	char *data;
+	uint32_t length;
+	uint64_t offset;
+};
+
+struct afc_stream_private {
+	afc_client_t client;
+	uint64_t handle;
+	uint32_t chunk_size;
+	uint32_t window;
+	mutex_t mutex;
+	cond_t cond;
+	thread_t worker;
+	int quit;
+	int busy;
+	uint32_t generation;
+	uint64_t position;
+	uint64_t device_position;
+	/* read-ahead */
+	struct afc_stream_chunk *chunks;
+	afc_error_t *chunk_results;
+	uint32_t chunks_head;
+	uint32_t chunks_count;
+	uint64_t prefetch_offset;
+	int prefetch;
+	int eof;
+	afc_error_t read_error;
+	/* write-behind */
+	char *write_buffer;
+	uint32_t write_length;
+	uint64_t write_offset;
+	char *write_pending;
+	uint32_t write_pending_length;
+	uint64_t write_pending_offset;
+	afc_error_t write_error;
+	/* statistics */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+struct afc_snapshot_private {
+	char *data;
+	uint64_t length;
+	uint32_t count;
+	int mapped;
+};
+
+struct afc_pool_channel {
+	afc_client_t client;
+	house_arrest_client_t house_arrest;
+	int in_use;
+};
+
+struct afc_pool_private {
+	idevice_t device;
+	char *label;
+	char *house_arrest_command;
+	char *house_arrest_appid;
+	uint32_t max_channels;
+	struct afc_pool_channel *channels;
+	mutex_t mutex;
+	cond_t cond;
+};
+
+struct afc_pool_file_private {
+	afc_pool_t pool;
+	uint32_t channel;
+	uint64_t handle;
+};
+
 afc_error_t afc_client_new_with_service_client(service_client_t service_client, afc_client_t *client);
 
 #endif
@@ -27,6 +27,7 @@
 #define _GNU_SOURCE 1
 #define __USE_GNU 1
 #include <stdio.h>
+#include <ctype.h>
 
 #include "debugserver.h"
 #include "lockdown.h"
@@ -78,9 +79,12 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_new(idevice_t device
 		return ret;
 	}
 
-	debugserver_client_t client_loc = (debugserver_client_t) malloc(sizeof(struct debugserver_client_private));
+	debugserver_client_t client_loc = (debugserver_client_t) calloc(1, sizeof(struct debugserver_client_private));
 	client_loc->parent = parent;
 	client_loc->noack_mode = 0;
+	client_loc->recv_capacity = DEBUGSERVER_RECV_BUFFER_SIZE;
+	client_loc->recv_buffer = (char*)malloc(client_loc->recv_capacity);
+	client_loc->binary_memory = -1;
 
 	*client = client_loc;
 
@@ -102,6 +106,9 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_free(debugserver_cli
 
 	debugserver_error_t err = debugserver_error(service_client_free(client->parent));
 	client->parent = NULL;
+	free(client->recv_buffer);
+	free(client->last_packet);
+	free(client->send_queue);
 	free(client);
 
 	return err;
@@ -137,6 +144,19 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_with_timeout
 		return DEBUGSERVER_E_INVALID_ARG;
 	}
 
+	/* hand out bytes left over from framing packets first */
+	if (client->recv_end > client->recv_start) {
+		bytes = client->recv_end - client->recv_start;
+		if ((uint32_t)bytes > size)
+			bytes = size;
+		memcpy(data, client->recv_buffer + client->recv_start, bytes);
+		client->recv_start += bytes;
+		if (received) {
+			*received = (uint32_t)bytes;
+		}
+		return DEBUGSERVER_E_SUCCESS;
+	}
+
 	res = debugserver_error(service_receive_with_timeout(client->parent, data, size, (uint32_t*)&bytes, timeout));
 	if (bytes <= 0) {
 		debug_info("Could not read data, error %d", res);
@@ -225,7 +245,57 @@ static char debugserver_int2hex(int x)
 #define DEBUGSERVER_HEX_DECODE_FIRST_BYTE(byte) ((byte >> 0x4) & 0xf)
 #define DEBUGSERVER_HEX_DECODE_SECOND_BYTE(byte) (byte & 0xf)
 
-static uint32_t debugserver_get_checksum_for_buffer(const char* buffer, uint32_t size)
+/*
+ * Hex codec and checksum kernels. Memory reads and writes move large hex
+ * encoded payloads, so these are vectorized where the CPU allows it. The
+ * kernel is picked at runtime, the scalar versions handle the remaining
+ * bytes and all other platforms.
+ */
+#define DEBUGSERVER_SIMD_SCALAR 0
+#define DEBUGSERVER_SIMD_SSE2 1
+#define DEBUGSERVER_SIMD_AVX2 2
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DEBUGSERVER_HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+static int debugserver_simd_level(void)
+{
+	static int level = -1;
+
+	if (level < 0) {
+		int detected = DEBUGSERVER_SIMD_SCALAR;
+#ifdef DEBUGSERVER_HAVE_X86_KERNELS
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			detected = DEBUGSERVER_SIMD_AVX2;
+		else if (__builtin_cpu_supports("sse2"))
+			detected = DEBUGSERVER_SIMD_SSE2;
+#endif
+		level = detected;
+	}
+
+	return level;
+}
+
+static const char debugserver_hexchars[16] = {
+	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+/* nibble value of a hex digit, or -1 */
+static int debugserver_hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return 10 + c - 'a';
+	else if (c >= 'A' && c <= 'F')
+		return 10 + c - 'A';
+	return -1;
+}
+
+static uint32_t debugserver_checksum_scalar(const unsigned char* buffer, uint32_t size)
 {
 	uint32_t checksum = 0;
 	uint32_t i;
@@ -237,47 +307,277 @@ static uint32_t debugserver_get_checksum_for_buffer(const char* buffer, uint32_t
 	return checksum;
 }
 
-static int debugserver_response_is_checksum_valid(const char* response, uint32_t size)
+static void debugserver_hex_encode_scalar(const unsigned char* data, uint32_t size, char* out)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		out[2*i] = debugserver_hexchars[data[i] >> 4];
+		out[2*i + 1] = debugserver_hexchars[data[i] & 0xf];
+	}
+}
+
+static uint32_t debugserver_hex_decode_scalar(const char* encoded, uint32_t count, unsigned char* out)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		int hi = debugserver_hex_nibble(encoded[2*i]);
+		int lo = debugserver_hex_nibble(encoded[2*i + 1]);
+		if (hi < 0 || lo < 0)
+			break;
+		out[i] = (unsigned char)((hi << 4) | lo);
+	}
+
+	return i;
+}
+
+#ifdef DEBUGSERVER_HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static uint32_t debugserver_checksum_sse2(const unsigned char* buffer, uint32_t size, uint32_t* done)
+{
+	__m128i sum = _mm_setzero_si128();
+	uint32_t i;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(buffer + i));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(v, _mm_setzero_si128()));
+	}
+	*done = i;
+
+	return (uint32_t)(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+}
+
+__attribute__((target("sse2")))
+static __m128i debugserver_nibbles_to_hex_sse2(__m128i n)
+{
+	/* '0' + n, plus 7 to reach 'A' for n > 9 */
+	__m128i letters = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8(7));
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letters);
+}
+
+__attribute__((target("sse2")))
+static uint32_t debugserver_hex_encode_sse2(const unsigned char* data, uint32_t size, char* out)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	uint32_t i;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+		__m128i hi = debugserver_nibbles_to_hex_sse2(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		__m128i lo = debugserver_nibbles_to_hex_sse2(_mm_and_si128(v, mask));
+		_mm_storeu_si128((__m128i*)(out + 2*i), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*)(out + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+
+	return i;
+}
+
+__attribute__((target("sse2")))
+static __m128i debugserver_hex_to_nibbles_sse2(__m128i c, int* invalid)
+{
+	__m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	/* unsigned range checks: x <= max when max(x, max) == max */
+	__m128i is_digit = _mm_cmpeq_epi8(_mm_max_epu8(digit, _mm_set1_epi8(9)), _mm_set1_epi8(9));
+	__m128i is_letter = _mm_cmpeq_epi8(_mm_max_epu8(letter, _mm_set1_epi8(5)), _mm_set1_epi8(5));
+
+	*invalid |= (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff);
+
+	return _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+__attribute__((target("sse2")))
+static uint32_t debugserver_hex_decode_sse2(const char* encoded, uint32_t count, unsigned char* out)
+{
+	const __m128i low_byte = _mm_set1_epi16(0xff);
+	uint32_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		int invalid = 0;
+		__m128i a = debugserver_hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i*)(encoded + 2*i)), &invalid);
+		__m128i b = debugserver_hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i*)(encoded + 2*i + 16)), &invalid);
+		if (invalid)
+			break;
+		/* each 16 bit lane holds the high nibble in its low byte */
+		a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, low_byte), 4), _mm_srli_epi16(a, 8));
+		b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, low_byte), 4), _mm_srli_epi16(b, 8));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(a, b));
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static uint32_t debugserver_checksum_avx2(const unsigned char* buffer, uint32_t size, uint32_t* done)
+{
+	__m256i sum = _mm256_setzero_si256();
+	__m128i half;
+	uint32_t i;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(buffer + i));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(v, _mm256_setzero_si256()));
+	}
+	*done = i;
+
+	half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	return (uint32_t)(_mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)));
+}
+
+__attribute__((target("avx2")))
+static __m256i debugserver_nibbles_to_hex_avx2(__m256i n)
+{
+	__m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)), _mm256_set1_epi8(7));
+	return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')), letters);
+}
+
+__attribute__((target("avx2")))
+static uint32_t debugserver_hex_encode_avx2(const unsigned char* data, uint32_t size, char* out)
 {
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	uint32_t i;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+		__m256i hi = debugserver_nibbles_to_hex_avx2(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+		__m256i lo = debugserver_nibbles_to_hex_avx2(_mm256_and_si256(v, mask));
+		/* unpacking works per 128 bit lane, put the lanes back in order */
+		__m256i first = _mm256_unpacklo_epi8(hi, lo);
+		__m256i second = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i*)(out + 2*i), _mm256_permute2x128_si256(first, second, 0x20));
+		_mm256_storeu_si256((__m256i*)(out + 2*i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static __m256i debugserver_hex_to_nibbles_avx2(__m256i c, int* invalid)
+{
+	__m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	__m256i letter = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	__m256i is_digit = _mm256_cmpeq_epi8(_mm256_max_epu8(digit, _mm256_set1_epi8(9)), _mm256_set1_epi8(9));
+	__m256i is_letter = _mm256_cmpeq_epi8(_mm256_max_epu8(letter, _mm256_set1_epi8(5)), _mm256_set1_epi8(5));
+
+	*invalid |= (_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter)) != -1);
+
+	return _mm256_or_si256(_mm256_and_si256(is_digit, digit), _mm256_and_si256(is_letter, _mm256_add_epi8(letter, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+static uint32_t debugserver_hex_decode_avx2(const char* encoded, uint32_t count, unsigned char* out)
+{
+	const __m256i low_byte = _mm256_set1_epi16(0xff);
+	uint32_t i;
+
+	for (i = 0; i + 32 <= count; i += 32) {
+		int invalid = 0;
+		__m256i a = debugserver_hex_to_nibbles_avx2(_mm256_loadu_si256((const __m256i*)(encoded + 2*i)), &invalid);
+		__m256i b = debugserver_hex_to_nibbles_avx2(_mm256_loadu_si256((const __m256i*)(encoded + 2*i + 32)), &invalid);
+		if (invalid)
+			break;
+		a = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(a, low_byte), 4), _mm256_srli_epi16(a, 8));
+		b = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(b, low_byte), 4), _mm256_srli_epi16(b, 8));
+		/* packing works per 128 bit lane, put the quarters back in order */
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+	}
+
+	return i;
+}
+#endif
+
+static uint32_t debugserver_get_checksum_for_buffer(const char* buffer, uint32_t size)
+{
+	const unsigned char* data = (const unsigned char*)buffer;
 	uint32_t checksum = 0;
-	if ((size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1) > 0)
-		checksum = debugserver_get_checksum_for_buffer(&response[1], size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1);
+	uint32_t done = 0;
 
-	debug_info("checksum: 0x%x", checksum);
+#ifdef DEBUGSERVER_HAVE_X86_KERNELS
+	switch (debugserver_simd_level()) {
+		case DEBUGSERVER_SIMD_AVX2:
+			checksum = debugserver_checksum_avx2(data, size, &done);
+			break;
+		case DEBUGSERVER_SIMD_SSE2:
+			checksum = debugserver_checksum_sse2(data, size, &done);
+			break;
+		default:
+			break;
+	}
+#endif
 
-	if ((unsigned)debugserver_hex2int(response[size - 2]) != DEBUGSERVER_HEX_DECODE_FIRST_BYTE(checksum))
-		return 0;
+	return checksum + debugserver_checksum_scalar(data + done, size - done);
+}
 
-	if ((unsigned)debugserver_hex2int(response[size - 1]) != DEBUGSERVER_HEX_DECODE_SECOND_BYTE(checksum))
-		return 0;
+/**
+ * Hex encodes size bytes of data into out, which must hold 2 * size chars.
+ */
+static void debugserver_hex_encode(const char* data, uint32_t size, char* out)
+{
+	const unsigned char* in = (const unsigned char*)data;
+	uint32_t done = 0;
+
+#ifdef DEBUGSERVER_HAVE_X86_KERNELS
+	switch (debugserver_simd_level()) {
+		case DEBUGSERVER_SIMD_AVX2:
+			done = debugserver_hex_encode_avx2(in, size, out);
+			break;
+		case DEBUGSERVER_SIMD_SSE2:
+			done = debugserver_hex_encode_sse2(in, size, out);
+			break;
+		default:
+			break;
+	}
+#endif
+
+	debugserver_hex_encode_scalar(in + done, size - done, out + 2*done);
+}
+
+/**
+ * Decodes count hex encoded bytes into out.
+ *
+ * @return The number of bytes decoded before the first invalid digit.
+ */
+static uint32_t debugserver_hex_decode(const char* encoded, uint32_t count, char* out)
+{
+	unsigned char* dst = (unsigned char*)out;
+	uint32_t done = 0;
 
-	debug_info("valid checksum");
+#ifdef DEBUGSERVER_HAVE_X86_KERNELS
+	switch (debugserver_simd_level()) {
+		case DEBUGSERVER_SIMD_AVX2:
+			done = debugserver_hex_decode_avx2(encoded, count, dst);
+			break;
+		case DEBUGSERVER_SIMD_SSE2:
+			done = debugserver_hex_decode_sse2(encoded, count, dst);
+			break;
+		default:
+			break;
+	}
+#endif
 
-	return 1;
+	return done + debugserver_hex_decode_scalar(encoded + 2*done, count - done, dst + done);
 }
 
 LIBIMOBILEDEVICE_API void debugserver_encode_string(const char* buffer, char** encoded_buffer, uint32_t* encoded_length)
 {
-	uint32_t position;
-	uint32_t index;
 	uint32_t length = strlen(buffer);
 	*encoded_length = (2 * length) + DEBUGSERVER_CHECKSUM_HASH_LENGTH + 1;
 
 	*encoded_buffer = malloc(sizeof(char) * (*encoded_length));
 	memset(*encoded_buffer, '\0', *encoded_length);
-	for (position = 0, index = 0; index < length; index++) {
-		position = (index * (2 * sizeof(char)));
-		(*encoded_buffer)[position] = DEBUGSERVER_HEX_ENCODE_FIRST_BYTE(buffer[index]);
-		(*encoded_buffer)[position + 1] = DEBUGSERVER_HEX_ENCODE_SECOND_BYTE(buffer[index]);
-	}
+	debugserver_hex_encode(buffer, length, *encoded_buffer);
 }
 
 LIBIMOBILEDEVICE_API void debugserver_decode_string(const char *encoded_buffer, size_t encoded_length, char** buffer)
 {
 	*buffer = malloc(sizeof(char) * ((encoded_length / 2)+1));
-	char* t = *buffer;
-	const char *f = encoded_buffer;
-	const char *fend = f + encoded_length;
+	uint32_t count = encoded_length / 2;
+	uint32_t done = debugserver_hex_decode(encoded_buffer, count, *buffer);
+	char* t = *buffer + done;
+	const char *f = encoded_buffer + 2*done;
+	const char *fend = encoded_buffer + encoded_length;
+	/* lenient about invalid digits and a trailing half byte */
 	while (f < fend) {
 		*t++ = debugserver_hex2int(*f) << 4 | debugserver_hex2int(f[1]);
 		f += 2;
@@ -285,6 +585,44 @@ LIBIMOBILEDEVICE_API void debugserver_decode_string(const char *encoded_buffer,
 	*t = '\0';
 }
 
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_encode_buffer(const char* data, uint32_t size, char** encoded_buffer, uint32_t* encoded_length)
+{
+	if (!data || !encoded_buffer || !encoded_length || size > (UINT32_MAX - 1) / 2)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	*encoded_buffer = (char*)malloc(2 * size + 1);
+	if (!*encoded_buffer)
+		return DEBUGSERVER_E_UNKNOWN_ERROR;
+
+	debugserver_hex_encode(data, size, *encoded_buffer);
+	(*encoded_buffer)[2 * size] = '\0';
+	*encoded_length = 2 * size;
+
+	return DEBUGSERVER_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_decode_buffer(const char* encoded_buffer, uint32_t encoded_length, char** data, uint32_t* size)
+{
+	uint32_t count = encoded_length / 2;
+
+	if (!encoded_buffer || !data || !size || (encoded_length % 2) != 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	*data = (char*)malloc(count + 1);
+	if (!*data)
+		return DEBUGSERVER_E_UNKNOWN_ERROR;
+
+	if (debugserver_hex_decode(encoded_buffer, count, *data) != count) {
+		free(*data);
+		*data = NULL;
+		return DEBUGSERVER_E_INVALID_ARG;
+	}
+	(*data)[count] = '\0';
+	*size = count;
+
+	return DEBUGSERVER_E_SUCCESS;
+}
+
 static void debugserver_format_command(const char* prefix, const char* command, const char* arguments, int calculate_checksum, char** buffer, uint32_t* size)
 {
 	char checksum_hash[DEBUGSERVER_CHECKSUM_HASH_LENGTH + 1] = {'#', '0', '0', '\0'};
@@ -343,141 +681,226 @@ static debugserver_error_t debugserver_client_set_ack_mode(debugserver_client_t
 	return DEBUGSERVER_E_SUCCESS;
 }
 
-static int debugserver_client_receive_internal_check(debugserver_client_t client, char* received_char)
+/**
+ * Reads the next block of data from the device into the receive buffer,
+ * growing the buffer if a partial packet fills most of it.
+ */
+static debugserver_error_t debugserver_client_fill_buffer(debugserver_client_t client, unsigned int timeout)
 {
-	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
-	int did_receive_char = 0;
-	char buffer = 0;
+	debugserver_error_t res;
 	uint32_t bytes = 0;
 
-	/* we loop here as we expect an answer */
-	res = debugserver_client_receive_with_timeout(client, &buffer, sizeof(char), &bytes, 1000);
-	if (res == DEBUGSERVER_E_SUCCESS && received_char[0] != 0) {
-		if (memcmp(&buffer, received_char, sizeof(char)) == 0) {
-			did_receive_char = 1;
-		}
-	} else {
-		did_receive_char = 0;
+	/* move a partial packet to the front */
+	if (client->recv_start > 0) {
+		memmove(client->recv_buffer, client->recv_buffer + client->recv_start, client->recv_end - client->recv_start);
+		client->recv_end -= client->recv_start;
+		client->recv_start = 0;
 	}
 
-	if (!did_receive_char) {
-		memcpy(received_char, &buffer, sizeof(char));
+	if (client->recv_capacity - client->recv_end < DEBUGSERVER_RECV_MIN_READ) {
+		char* newbuffer = (char*)realloc(client->recv_buffer, client->recv_capacity * 2);
+		if (!newbuffer)
+			return DEBUGSERVER_E_UNKNOWN_ERROR;
+		client->recv_buffer = newbuffer;
+		client->recv_capacity *= 2;
 	}
 
-	return did_receive_char;
+	res = debugserver_error(service_receive_with_timeout(client->parent, client->recv_buffer + client->recv_end, client->recv_capacity - client->recv_end, &bytes, timeout));
+	if (bytes == 0 && res == DEBUGSERVER_E_SUCCESS)
+		res = DEBUGSERVER_E_UNKNOWN_ERROR;
+	client->recv_end += bytes;
+
+	return (bytes > 0) ? DEBUGSERVER_E_SUCCESS : res;
 }
 
-LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_response(debugserver_client_t client, char** response)
+/**
+ * Returns the number of repetitions encoded by the character following a
+ * '*', or 0 if it is not a valid repeat count. Counts are printable and
+ * never '#' or '$', which would be mistaken for packet delimiters.
+ */
+static uint32_t debugserver_rle_count(char c)
 {
-	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	unsigned char count = (unsigned char)c;
 
-	int should_receive = 1;
-	int skip_prefix = 0;
-	char* command_prefix = strdup("$");
+	if (count < 32 || count > 126 || count == '#' || count == '$')
+		return 0;
 
-	char* buffer = NULL;
-	uint32_t buffer_size = 0;
+	return count - 29;
+}
 
-	if (response)
-		*response = NULL;
+/**
+ * Decodes the run-length encoding of a packet. A '*' followed by a
+ * character n repeats the preceding character n - 29 times. A '*' without
+ * a valid count is copied as is.
+ */
+static char* debugserver_decode_packet(const char* data, uint32_t size, uint32_t* decoded_size)
+{
+	uint32_t length = 0;
+	uint32_t i;
+	char* decoded;
+	char* p;
 
-	if (!client->noack_mode) {
-		char ack[2] = {'+', '\0'};
-		debug_info("attempting to receive ACK %c", *ack);
-		should_receive = debugserver_client_receive_internal_check(client, ack);
-		debug_info("received char: %c", *ack);
-		if (strncmp(ack, command_prefix, sizeof(char)) == 0) {
-			should_receive = 1;
-			skip_prefix = 1;
-			buffer = strdup(command_prefix);
-			buffer_size += sizeof(char);
-			debug_info("received ACK");
+	for (i = 0; i < size; i++) {
+		if (data[i] == '*' && i > 0 && i + 1 < size && debugserver_rle_count(data[i + 1]) > 0) {
+			length += debugserver_rle_count(data[i + 1]);
+			i++;
+		} else {
+			length++;
 		}
 	}
 
-	debug_info("should_receive: %d, skip_prefix: %d", should_receive, skip_prefix);
+	decoded = (char*)malloc(length + 1);
+	if (!decoded)
+		return NULL;
 
-	if (should_receive && !skip_prefix) {
-		debug_info("attempting to receive prefix");
-		should_receive = debugserver_client_receive_internal_check(client, command_prefix);
-		debug_info("received command_prefix: %c", *command_prefix);
-		if (should_receive) {
-			if (buffer) {
-				memcpy(buffer, command_prefix, sizeof(char));
-			} else {
-				buffer = strdup(command_prefix);
-				buffer_size += sizeof(char);
-			}
+	p = decoded;
+	for (i = 0; i < size; i++) {
+		if (data[i] == '*' && i > 0 && i + 1 < size && debugserver_rle_count(data[i + 1]) > 0) {
+			uint32_t repeat = debugserver_rle_count(data[i + 1]);
+			memset(p, data[i - 1], repeat);
+			p += repeat;
+			i++;
+		} else {
+			*p++ = data[i];
 		}
 	}
+	*p = '\0';
 
-	debug_info("buffer: %*s, should_receive: %d, skip_prefix: %d", buffer_size, buffer, should_receive, skip_prefix);
+	if (decoded_size)
+		*decoded_size = length;
 
-	if (should_receive) {
-		uint32_t checksum_length = DEBUGSERVER_CHECKSUM_HASH_LENGTH;
-		int receiving_checksum_response = 0;
-		debug_info("attempting to read up response until checksum");
-		while ((checksum_length > 0)) {
-			char data[2] = {'#', '\0'};
-			if (debugserver_client_receive_internal_check(client, data)) {
-				receiving_checksum_response = 1;
-			}
-			if (receiving_checksum_response) {
-				checksum_length--;
-			}
-			char* newbuffer = string_concat(buffer, data, NULL);
-			buffer_size += sizeof(char);
-			free(buffer);
-			buffer = NULL;
-			buffer = newbuffer;
-			newbuffer = NULL;
+	return decoded;
+}
+
+/**
+ * Extracts the next packet from the receive buffer. Acknowledgements are
+ * consumed, a NAK retransmits the last packet sent and stray bytes before
+ * a packet are skipped.
+ *
+ * @return 1 if a complete packet was found, 0 if more data is needed.
+ */
+static int debugserver_client_frame_packet(debugserver_client_t client, const char** data, uint32_t* size, int* valid)
+{
+	while (client->recv_start < client->recv_end) {
+		char* start = client->recv_buffer + client->recv_start;
+		uint32_t available = client->recv_end - client->recv_start;
+		uint32_t checksum;
+		char* hash;
+
+		if (*start == '+') {
+			debug_info("received ACK");
+			client->recv_start++;
+			continue;
 		}
-		debug_info("validating response checksum...");
-		int valid_response = debugserver_response_is_checksum_valid(buffer, buffer_size);
-		if (valid_response) {
-			if (response) {
-				/* assemble response string */
-				uint32_t response_size = sizeof(char) * (buffer_size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1);
-				*response = (char*)malloc(response_size + 1);
-				memcpy(*response, buffer + 1, response_size);
-				(*response)[response_size] = '\0';
-			}
-			if (!client->noack_mode) {
-				/* confirm valid command */
-				debugserver_client_send_ack(client);
+
+		if (*start == '-') {
+			debug_info("received NAK");
+			client->recv_start++;
+			if (!client->noack_mode && client->last_packet) {
+				debug_info("retransmitting last packet");
+				service_send(client->parent, client->last_packet, client->last_packet_size, NULL);
 			}
+			continue;
+		}
+
+		if (*start != '$') {
+			client->recv_start++;
+			continue;
+		}
+
+		hash = memchr(start + 1, '#', available - 1);
+		if (!hash || (uint32_t)(hash - start) + DEBUGSERVER_CHECKSUM_HASH_LENGTH > available)
+			return 0;
+
+		*data = start + 1;
+		*size = hash - start - 1;
+		if (client->noack_mode) {
+			/* checksums need not be valid without acknowledgements */
+			*valid = 1;
 		} else {
-			/* response was invalid */
-			res = DEBUGSERVER_E_RESPONSE_ERROR;
-			if (!client->noack_mode) {
-				/* report invalid command */
-				debugserver_client_send_noack(client);
-			}
+			checksum = debugserver_get_checksum_for_buffer(*data, *size);
+			*valid = ((unsigned)debugserver_hex2int(hash[1]) == DEBUGSERVER_HEX_DECODE_FIRST_BYTE(checksum)
+			       && (unsigned)debugserver_hex2int(hash[2]) == DEBUGSERVER_HEX_DECODE_SECOND_BYTE(checksum));
 		}
-	}
+		client->recv_start += (hash - start) + DEBUGSERVER_CHECKSUM_HASH_LENGTH;
 
-	if (response) {
-		debug_info("response: %s", *response);
+		return 1;
 	}
 
-	if (buffer)
-		free(buffer);
+	/* everything consumed */
+	client->recv_start = 0;
+	client->recv_end = 0;
+
+	return 0;
+}
 
-	if (command_prefix)
-		free(command_prefix);
+/**
+ * Receives the next response packet.
+ *
+ * @return DEBUGSERVER_E_TIMEOUT when no packet started to arrive within
+ *     timeout milliseconds.
+ */
+static debugserver_error_t debugserver_client_receive_packet(debugserver_client_t client, char** response, uint32_t* response_size, unsigned int timeout)
+{
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	const char* data = NULL;
+	uint32_t size = 0;
+	int valid = 0;
+
+	if (response)
+		*response = NULL;
+
+	if (!client)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	while (!debugserver_client_frame_packet(client, &data, &size, &valid)) {
+		int in_packet = (client->recv_end > client->recv_start);
+		res = debugserver_client_fill_buffer(client, timeout);
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			/* partial packets are kept for the next call */
+			return (in_packet) ? res : DEBUGSERVER_E_TIMEOUT;
+		}
+	}
+
+	if (valid) {
+		if (response) {
+			*response = debugserver_decode_packet(data, size, response_size);
+			debug_info("response: %s", *response);
+		}
+		if (!client->noack_mode) {
+			/* confirm valid command */
+			debugserver_client_send_ack(client);
+		}
+	} else {
+		/* response was invalid */
+		debug_info("invalid response checksum");
+		res = DEBUGSERVER_E_RESPONSE_ERROR;
+		if (!client->noack_mode) {
+			/* report invalid command */
+			debugserver_client_send_noack(client);
+		}
+	}
 
 	return res;
 }
 
-LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugserver_client_t client, debugserver_command_t command, char** response)
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_response(debugserver_client_t client, char** response)
 {
-	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
-	int i;
-	uint32_t bytes = 0;
+	debugserver_error_t res = debugserver_client_receive_packet(client, response, NULL, 1000);
 
-	char* send_buffer = NULL;
-	uint32_t send_buffer_size = 0;
+	/* no response pending */
+	if (res == DEBUGSERVER_E_TIMEOUT)
+		res = DEBUGSERVER_E_SUCCESS;
+
+	return res;
+}
 
+/**
+ * Assembles the packet for a command, with a checksum unless in no-ack mode.
+ */
+static void debugserver_client_format_packet(debugserver_client_t client, debugserver_command_t command, char** buffer, uint32_t* size)
+{
+	int i;
 	char* command_arguments = NULL;
 
 	/* concat all arguments */
@@ -499,11 +922,35 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugse
 	debug_info("command_arguments(%d): %s", command->argc, command_arguments);
 
 	/* encode command arguments, add checksum if required and assemble entire command */
-	debugserver_format_command("$", command->name, command_arguments, !client->noack_mode, &send_buffer, &send_buffer_size);
+	debugserver_format_command("$", command->name, command_arguments, !client->noack_mode, buffer, size);
+
+	if (command_arguments)
+		free(command_arguments);
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugserver_client_t client, debugserver_command_t command, char** response)
+{
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	uint32_t bytes = 0;
+
+	char* send_buffer = NULL;
+	uint32_t send_buffer_size = 0;
+
+	/* the response would be taken for the one of a queued command */
+	if (!client || !command || client->queued_responses > 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	debugserver_client_format_packet(client, command, &send_buffer, &send_buffer_size);
 
 	debug_info("sending encoded command: %s", send_buffer);
 
-	res = debugserver_client_send(client, send_buffer, send_buffer_size, &bytes);
+	/* keep the packet for retransmission on NAK */
+	free(client->last_packet);
+	client->last_packet = send_buffer;
+	client->last_packet_size = send_buffer_size;
+	send_buffer = NULL;
+
+	res = debugserver_client_send(client, client->last_packet, client->last_packet_size, &bytes);
 	debug_info("command result: %d", res);
 	if (res != DEBUGSERVER_E_SUCCESS) {
 		goto cleanup;
@@ -526,15 +973,523 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugse
 	}
 
 cleanup:
-	if (command_arguments)
-		free(command_arguments);
-
 	if (send_buffer)
 		free(send_buffer);
 
 	return res;
 }
 
+/**
+ * Appends an assembled packet to the send queue.
+ */
+static debugserver_error_t debugserver_client_queue_packet(debugserver_client_t client, const char* packet, uint32_t packet_size)
+{
+	if (client->send_queue_length + packet_size > client->send_queue_capacity) {
+		uint32_t capacity = (client->send_queue_capacity) ? client->send_queue_capacity : 4096;
+		char* newqueue;
+		while (capacity < client->send_queue_length + packet_size)
+			capacity *= 2;
+		newqueue = (char*)realloc(client->send_queue, capacity);
+		if (!newqueue)
+			return DEBUGSERVER_E_UNKNOWN_ERROR;
+		client->send_queue = newqueue;
+		client->send_queue_capacity = capacity;
+	}
+	memcpy(client->send_queue + client->send_queue_length, packet, packet_size);
+	client->send_queue_length += packet_size;
+	client->send_queue_unsent_packets++;
+	client->queued_responses++;
+
+	return DEBUGSERVER_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_queue_command(debugserver_client_t client, debugserver_command_t command)
+{
+	debugserver_error_t res;
+	char* packet = NULL;
+	uint32_t packet_size = 0;
+
+	if (!client || !command || !client->noack_mode)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	debugserver_client_format_packet(client, command, &packet, &packet_size);
+	res = debugserver_client_queue_packet(client, packet, packet_size);
+	free(packet);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_flush_commands(debugserver_client_t client)
+{
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	uint32_t sent = 0;
+
+	if (!client)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	while (sent < client->send_queue_length) {
+		uint32_t bytes = 0;
+		res = debugserver_client_send(client, client->send_queue + sent, client->send_queue_length - sent, &bytes);
+		if (res != DEBUGSERVER_E_SUCCESS || bytes == 0) {
+			if (res == DEBUGSERVER_E_SUCCESS)
+				res = DEBUGSERVER_E_UNKNOWN_ERROR;
+			break;
+		}
+		sent += bytes;
+	}
+
+	/* keep what could not be sent */
+	memmove(client->send_queue, client->send_queue + sent, client->send_queue_length - sent);
+	client->send_queue_length -= sent;
+	if (sent <= client->send_queue_unsent_offset) {
+		client->send_queue_unsent_offset -= sent;
+	} else {
+		/* the boundaries of partially sent packets are not known */
+		client->send_queue_unsent_offset = client->send_queue_length;
+		client->send_queue_unsent_packets = 0;
+	}
+
+	return res;
+}
+
+/**
+ * Removes the queued packets of which nothing was sent yet, no response
+ * will arrive for them.
+ */
+static void debugserver_client_drop_unsent_packets(debugserver_client_t client)
+{
+	client->send_queue_length = client->send_queue_unsent_offset;
+	client->queued_responses -= client->send_queue_unsent_packets;
+	client->send_queue_unsent_packets = 0;
+}
+
+/**
+ * Receives the response of the oldest queued packet, with its length.
+ */
+static debugserver_error_t debugserver_client_receive_queued_packet(debugserver_client_t client, char** response, uint32_t* response_size, unsigned int timeout)
+{
+	debugserver_error_t res;
+
+	if (response)
+		*response = NULL;
+
+	if (!client || client->queued_responses == 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	if (client->send_queue_length > 0) {
+		res = debugserver_client_flush_commands(client);
+		if (res != DEBUGSERVER_E_SUCCESS)
+			return res;
+	}
+
+	res = debugserver_client_receive_packet(client, response, response_size, timeout);
+	if (res == DEBUGSERVER_E_SUCCESS || res == DEBUGSERVER_E_RESPONSE_ERROR) {
+		/* a corrupt response still answers its command */
+		client->queued_responses--;
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_queued_response(debugserver_client_t client, char** response, unsigned int timeout)
+{
+	return debugserver_client_receive_queued_packet(client, response, NULL, timeout);
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_commands(debugserver_client_t client, debugserver_command_t* commands, uint32_t count, char** responses)
+{
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	uint32_t i;
+
+	if (!client || !commands || count == 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	if (responses)
+		memset(responses, 0, count * sizeof(char*));
+
+	if (!client->noack_mode) {
+		/* every packet has to be acknowledged before the next one is sent */
+		for (i = 0; i < count && res == DEBUGSERVER_E_SUCCESS; i++) {
+			res = debugserver_client_send_command(client, commands[i], (responses) ? &responses[i] : NULL);
+		}
+		return res;
+	}
+
+	/* responses to commands queued earlier come first */
+	if (client->queued_responses > 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	for (i = 0; i < count; i++) {
+		res = debugserver_client_queue_command(client, commands[i]);
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			/* nothing was sent yet */
+			debugserver_client_drop_unsent_packets(client);
+			return res;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		res = debugserver_client_receive_queued_response(client, (responses) ? &responses[i] : NULL, 10000);
+		if (res != DEBUGSERVER_E_SUCCESS)
+			break;
+	}
+
+	/* read the replies still in flight, so they are not taken as responses
+	 * to later commands. Those that cannot be read stay queued and further
+	 * commands are refused until they are. */
+	while (res != DEBUGSERVER_E_SUCCESS && client->queued_responses > 0) {
+		char* response = NULL;
+		debugserver_error_t drain_res = debugserver_client_receive_queued_packet(client, &response, NULL, 10000);
+		free(response);
+		if (drain_res != DEBUGSERVER_E_SUCCESS && drain_res != DEBUGSERVER_E_RESPONSE_ERROR)
+			break;
+	}
+
+	return res;
+}
+
+/**
+ * Assembles a packet around an already encoded body, which may contain
+ * binary data.
+ */
+static char* debugserver_client_build_packet(debugserver_client_t client, const char* body, uint32_t body_size, uint32_t* packet_size)
+{
+	char* packet = (char*)malloc(body_size + DEBUGSERVER_CHECKSUM_HASH_LENGTH + 1);
+	uint32_t checksum = 0;
+
+	if (!packet)
+		return NULL;
+
+	if (!client->noack_mode)
+		checksum = debugserver_get_checksum_for_buffer(body, body_size);
+
+	packet[0] = '$';
+	memcpy(packet + 1, body, body_size);
+	packet[body_size + 1] = '#';
+	packet[body_size + 2] = DEBUGSERVER_HEX_ENCODE_FIRST_BYTE(checksum);
+	packet[body_size + 3] = DEBUGSERVER_HEX_ENCODE_SECOND_BYTE(checksum);
+	*packet_size = body_size + DEBUGSERVER_CHECKSUM_HASH_LENGTH + 1;
+
+	return packet;
+}
+
+/**
+ * Sends a packet for a memory transfer. In no-ack mode it is queued so
+ * several requests can be in flight, otherwise it is sent right away and
+ * its response has to be read before the next one is sent.
+ */
+static debugserver_error_t debugserver_client_issue_packet(debugserver_client_t client, const char* body, uint32_t body_size)
+{
+	debugserver_error_t res;
+	uint32_t packet_size = 0;
+	char* packet = debugserver_client_build_packet(client, body, body_size, &packet_size);
+
+	if (!packet)
+		return DEBUGSERVER_E_UNKNOWN_ERROR;
+
+	if (client->noack_mode) {
+		res = debugserver_client_queue_packet(client, packet, packet_size);
+		free(packet);
+		return res;
+	}
+
+	/* keep the packet for retransmission on NAK */
+	free(client->last_packet);
+	client->last_packet = packet;
+	client->last_packet_size = packet_size;
+
+	return debugserver_client_send(client, packet, packet_size, NULL);
+}
+
+static debugserver_error_t debugserver_client_collect_packet(debugserver_client_t client, char** response, uint32_t* response_size)
+{
+	if (client->noack_mode)
+		return debugserver_client_receive_queued_packet(client, response, response_size, DEBUGSERVER_MEMORY_TIMEOUT);
+
+	return debugserver_client_receive_packet(client, response, response_size, DEBUGSERVER_MEMORY_TIMEOUT);
+}
+
+static debugserver_error_t debugserver_client_exchange_packet(debugserver_client_t client, const char* body, char** response, uint32_t* response_size)
+{
+	debugserver_error_t res = debugserver_client_issue_packet(client, body, strlen(body));
+
+	if (res != DEBUGSERVER_E_SUCCESS)
+		return res;
+
+	return debugserver_client_collect_packet(client, response, response_size);
+}
+
+static int debugserver_response_is_error(const char* response, uint32_t size)
+{
+	return (!response || (size == 3 && response[0] == 'E' && isxdigit((unsigned char)response[1]) && isxdigit((unsigned char)response[2])));
+}
+
+/**
+ * Queries the packet size and whether binary memory transfers are
+ * supported, once per client.
+ */
+static debugserver_error_t debugserver_client_query_memory_support(debugserver_client_t client)
+{
+	debugserver_error_t res;
+	char* response = NULL;
+	uint32_t response_size = 0;
+
+	if (client->max_packet_size == 0) {
+		res = debugserver_client_exchange_packet(client, "qSupported", &response, &response_size);
+		if (res != DEBUGSERVER_E_SUCCESS)
+			return res;
+		client->max_packet_size = DEBUGSERVER_DEFAULT_PACKET_SIZE;
+		if (response) {
+			char* packet_size = strstr(response, "PacketSize=");
+			if (packet_size) {
+				unsigned long value = strtoul(packet_size + 11, NULL, 16);
+				if (value >= DEBUGSERVER_MIN_PACKET_SIZE && value <= DEBUGSERVER_MAX_PACKET_SIZE)
+					client->max_packet_size = (uint32_t)value;
+			}
+			free(response);
+			response = NULL;
+		}
+		debug_info("max packet size: %u", client->max_packet_size);
+	}
+
+	if (client->binary_memory < 0) {
+		/* an empty response means the packet is unsupported */
+		res = debugserver_client_exchange_packet(client, "x0,0", &response, &response_size);
+		if (res != DEBUGSERVER_E_SUCCESS)
+			return res;
+		client->binary_memory = (response && strcmp(response, "OK") == 0) ? 1 : 0;
+		free(response);
+		debug_info("binary memory transfers: %s", client->binary_memory ? "yes" : "no");
+	}
+
+	return DEBUGSERVER_E_SUCCESS;
+}
+
+/**
+ * Reads the responses of requests still in flight after a transfer ended
+ * early, so they are not taken as responses to later commands. Requests
+ * that were queued but not sent are dropped. In no-ack mode, responses
+ * that do not arrive stay queued and further commands are refused until
+ * they are received.
+ */
+static void debugserver_client_drain_packets(debugserver_client_t client, uint32_t count)
+{
+	if (client->noack_mode) {
+		debugserver_client_drop_unsent_packets(client);
+		count = client->queued_responses;
+	}
+
+	while (count-- > 0) {
+		char* response = NULL;
+		if (debugserver_client_collect_packet(client, &response, NULL) != DEBUGSERVER_E_SUCCESS && !response)
+			break;
+		free(response);
+	}
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_read_memory(debugserver_client_t client, uint64_t address, uint32_t size, char* buffer, uint32_t* bytes_read)
+{
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	uint32_t lengths[DEBUGSERVER_MEMORY_PIPELINE_DEPTH];
+	uint32_t window;
+	uint32_t chunk;
+	uint32_t requested = 0;
+	uint32_t received = 0;
+	uint32_t in_flight = 0;
+	uint32_t head = 0;
+
+	if (bytes_read)
+		*bytes_read = 0;
+
+	if (!client || !buffer || client->queued_responses > 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	res = debugserver_client_query_memory_support(client);
+	if (res != DEBUGSERVER_E_SUCCESS)
+		return res;
+
+	/* fill each response packet, hex encoding doubles the size */
+	chunk = client->max_packet_size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1;
+	if (!client->binary_memory)
+		chunk /= 2;
+	window = (client->noack_mode) ? DEBUGSERVER_MEMORY_PIPELINE_DEPTH : 1;
+
+	while (received < size) {
+		char* response = NULL;
+		uint32_t response_size = 0;
+		uint32_t expected;
+		uint32_t length;
+
+		while (requested < size && in_flight < window) {
+			char body[48];
+			uint32_t n = (size - requested < chunk) ? size - requested : chunk;
+			snprintf(body, sizeof(body), "%c%llx,%x", (client->binary_memory) ? 'x' : 'm', (unsigned long long)(address + requested), n);
+			res = debugserver_client_issue_packet(client, body, strlen(body));
+			if (res != DEBUGSERVER_E_SUCCESS)
+				break;
+			lengths[(head + in_flight) % window] = n;
+			requested += n;
+			in_flight++;
+		}
+		if (res != DEBUGSERVER_E_SUCCESS || in_flight == 0)
+			break;
+
+		res = debugserver_client_collect_packet(client, &response, &response_size);
+		expected = lengths[head];
+		head = (head + 1) % window;
+		in_flight--;
+		if (res == DEBUGSERVER_E_SUCCESS && debugserver_response_is_error(response, response_size))
+			res = DEBUGSERVER_E_RESPONSE_ERROR;
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			free(response);
+			break;
+		}
+
+		if (client->binary_memory) {
+			/* undo the escaping of special characters */
+			uint32_t i;
+			length = 0;
+			for (i = 0; i < response_size && length < expected; i++) {
+				if (response[i] == '}' && i + 1 < response_size) {
+					buffer[received + length++] = response[++i] ^ 0x20;
+				} else {
+					buffer[received + length++] = response[i];
+				}
+			}
+		} else {
+			length = debugserver_hex_decode(response, response_size / 2, buffer + received);
+			if (length > expected)
+				length = expected;
+		}
+		free(response);
+
+		received += length;
+		if (length == 0) {
+			/* the rest of the range is not readable */
+			break;
+		}
+		if (length < expected) {
+			/* a short reply does not mean the rest is unreadable, request
+			 * it again, discarding the replies to the requests after it */
+			debugserver_client_drain_packets(client, in_flight);
+			if (client->queued_responses > 0)
+				break;
+			requested = received;
+			in_flight = 0;
+			head = 0;
+		}
+	}
+
+	debugserver_client_drain_packets(client, in_flight);
+
+	if (bytes_read)
+		*bytes_read = received;
+
+	/* a partial read is reported as such */
+	if (received > 0)
+		res = DEBUGSERVER_E_SUCCESS;
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_write_memory(debugserver_client_t client, uint64_t address, const char* data, uint32_t size, uint32_t* bytes_written)
+{
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	uint32_t lengths[DEBUGSERVER_MEMORY_PIPELINE_DEPTH];
+	uint32_t window;
+	uint32_t limit;
+	uint32_t requested = 0;
+	uint32_t written = 0;
+	uint32_t in_flight = 0;
+	uint32_t head = 0;
+	char* body;
+
+	if (bytes_written)
+		*bytes_written = 0;
+
+	if (!client || !data || client->queued_responses > 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	res = debugserver_client_query_memory_support(client);
+	if (res != DEBUGSERVER_E_SUCCESS)
+		return res;
+
+	limit = client->max_packet_size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1;
+	body = (char*)malloc(limit);
+	if (!body)
+		return DEBUGSERVER_E_UNKNOWN_ERROR;
+	window = (client->noack_mode) ? DEBUGSERVER_MEMORY_PIPELINE_DEPTH : 1;
+
+	while (written < size) {
+		char* response = NULL;
+		uint32_t response_size = 0;
+		uint32_t expected;
+
+		while (requested < size && in_flight < window) {
+			char header[DEBUGSERVER_MEMORY_HEADER_SIZE + 1];
+			int header_size;
+			uint32_t body_size;
+			uint32_t n;
+
+			/* leave room for the header, which is written last */
+			body_size = DEBUGSERVER_MEMORY_HEADER_SIZE;
+			if (client->binary_memory) {
+				for (n = 0; requested + n < size; n++) {
+					char c = data[requested + n];
+					int escape = (c == '#' || c == '$' || c == '}' || c == '*');
+					if (body_size + 1 + escape > limit)
+						break;
+					if (escape) {
+						body[body_size++] = '}';
+						body[body_size++] = c ^ 0x20;
+					} else {
+						body[body_size++] = c;
+					}
+				}
+			} else {
+				n = (limit - body_size) / 2;
+				if (n > size - requested)
+					n = size - requested;
+				debugserver_hex_encode(data + requested, n, body + body_size);
+				body_size += 2 * n;
+			}
+
+			/* put the header right in front of the data */
+			header_size = snprintf(header, sizeof(header), "%c%llx,%x:", (client->binary_memory) ? 'X' : 'M', (unsigned long long)(address + requested), n);
+			memcpy(body + DEBUGSERVER_MEMORY_HEADER_SIZE - header_size, header, header_size);
+
+			res = debugserver_client_issue_packet(client, body + DEBUGSERVER_MEMORY_HEADER_SIZE - header_size, body_size - DEBUGSERVER_MEMORY_HEADER_SIZE + header_size);
+			if (res != DEBUGSERVER_E_SUCCESS)
+				break;
+			lengths[(head + in_flight) % window] = n;
+			requested += n;
+			in_flight++;
+		}
+		if (res != DEBUGSERVER_E_SUCCESS || in_flight == 0)
+			break;
+
+		res = debugserver_client_collect_packet(client, &response, &response_size);
+		expected = lengths[head];
+		head = (head + 1) % window;
+		in_flight--;
+		if (res == DEBUGSERVER_E_SUCCESS && (!response || strcmp(response, "OK") != 0))
+			res = DEBUGSERVER_E_RESPONSE_ERROR;
+		free(response);
+		if (res != DEBUGSERVER_E_SUCCESS)
+			break;
+
+		written += expected;
+	}
+	free(body);
+
+	debugserver_client_drain_packets(client, in_flight);
+
+	if (bytes_written)
+		*bytes_written = written;
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_environment_hex_encoded(debugserver_client_t client, const char* env, char** response)
 {
 	if (!client || !env)
@@ -591,13 +1546,7 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_argv(debugserver
 		asprintf(&prefix, ",%d,%d,", arg_hexlen, i);
 
 		m = (char *) malloc(arg_hexlen);
-		char *p = m;
-		char *q = (char*)argv[i];
-		while (*q) {
-			*p++ = debugserver_int2hex(*q >> 4);
-			*p++ = debugserver_int2hex(*q & 0xf);
-			q++;
-		}
+		debugserver_hex_encode(argv[i], arg_len, m);
 
 		memcpy(pktp, prefix, strlen(prefix));
 		pktp += strlen(prefix);
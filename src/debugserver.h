@@ -26,10 +26,39 @@
 #include "service.h"
 
 #define DEBUGSERVER_CHECKSUM_HASH_LENGTH 0x3
+#define DEBUGSERVER_RECV_BUFFER_SIZE (65536)
+#define DEBUGSERVER_RECV_MIN_READ (4096)
+
+/* memory transfers, see debugserver_client_read_memory() */
+#define DEBUGSERVER_DEFAULT_PACKET_SIZE (1024)
+#define DEBUGSERVER_MIN_PACKET_SIZE (64)
+#define DEBUGSERVER_MAX_PACKET_SIZE (16 * 1024 * 1024)
+#define DEBUGSERVER_MEMORY_PIPELINE_DEPTH (16)
+#define DEBUGSERVER_MEMORY_HEADER_SIZE (32)
+#define DEBUGSERVER_MEMORY_TIMEOUT (10000)
 
 struct debugserver_client_private {
 	service_client_t parent;
 	int noack_mode;
+	/* bytes received but not yet framed into packets */
+	char* recv_buffer;
+	uint32_t recv_capacity;
+	uint32_t recv_start;
+	uint32_t recv_end;
+	/* last packet sent, retransmitted on NAK */
+	char* last_packet;
+	uint32_t last_packet_size;
+	/* commands queued in no-ack mode, see debugserver_client_queue_command() */
+	char* send_queue;
+	uint32_t send_queue_length;
+	uint32_t send_queue_capacity;
+	uint32_t queued_responses;
+	/* packets at the end of the send queue of which nothing was sent yet */
+	uint32_t send_queue_unsent_offset;
+	uint32_t send_queue_unsent_packets;
+	/* remote capabilities for memory transfers, queried on first use */
+	uint32_t max_packet_size;
+	int binary_memory;
 };
 
 struct debugserver_command_private {
@@ -819,3 +819,18 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_disable_ssl(idevice_conn
 
 	return IDEVICE_E_SUCCESS;
 }
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd)
+{
+	if (!connection || !fd) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->type == CONNECTION_USBMUXD) {
+		*fd = (int)(long)connection->data;
+		return IDEVICE_E_SUCCESS;
+	}
+
+	debug_info("Unknown connection type %d", connection->type);
+	return IDEVICE_E_UNKNOWN_ERROR;
+}
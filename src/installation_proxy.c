@@ -20,14 +20,32 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA 
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#ifdef WIN32
+#include <winsock2.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <sys/mman.h>
+#endif
 #include <plist/plist.h>
 
 #include "installation_proxy.h"
 #include "property_list_service.h"
+#include "libimobiledevice/afc.h"
 #include "common/debug.h"
+#include "common/utils.h"
+#include "endianness.h"
 
 struct instproxy_status_data {
 	instproxy_client_t client;
@@ -36,6 +54,8 @@ struct instproxy_status_data {
 	void *user_data;
 };
 
+static void instproxy_executor_cancel(instproxy_client_t client);
+
 /**
  * Locks an installation_proxy client, used for thread safety.
  *
@@ -98,6 +118,8 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_new(idevice_t device, lo
 	client_loc->parent = plistclient;
 	mutex_init(&client_loc->mutex);
 	client_loc->status_updater = (thread_t)NULL;
+	client_loc->status_job = NULL;
+	client_loc->status_interval = 0;
 
 	*client = client_loc;
 	return INSTPROXY_E_SUCCESS;
@@ -115,6 +137,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_free(instproxy_client_t
 	if (!client)
 		return INSTPROXY_E_INVALID_ARG;
 
+	instproxy_executor_cancel(client);
 	property_list_service_client_free(client->parent);
 	client->parent = NULL;
 	if (client->status_updater) {
@@ -127,6 +150,16 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_free(instproxy_client_t
 	return INSTPROXY_E_SUCCESS;
 }
 
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_set_status_interval(instproxy_client_t client, uint32_t interval)
+{
+	if (!client)
+		return INSTPROXY_E_INVALID_ARG;
+
+	client->status_interval = interval;
+
+	return INSTPROXY_E_SUCCESS;
+}
+
 /**
  * Send a command with specified options to the device.
  * Only used internally.
@@ -162,33 +195,34 @@ static instproxy_error_t instproxy_send_command(instproxy_client_t client, const
 	return err;
 }
 
-LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result)
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_with_callback(instproxy_client_t client, plist_t client_options, instproxy_browse_cb_t callback, void *user_data)
 {
-	if (!client || !client->parent || !result)
+	if (!client || !client->parent || !callback)
 		return INSTPROXY_E_INVALID_ARG;
 
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
 
 	instproxy_lock(client);
 	res = instproxy_send_command(client, "Browse", client_options, NULL, NULL);
+	instproxy_unlock(client);
 	if (res != INSTPROXY_E_SUCCESS) {
 		debug_info("could not send plist");
-		goto leave_unlock;
+		return res;
 	}
 
 	int browsing = 0;
-	plist_t apps_array = plist_new_array();
 	plist_t dict = NULL;
 
 	do {
 		browsing = 0;
 		dict = NULL;
+		instproxy_lock(client);
 		res = instproxy_error(property_list_service_receive_plist(client->parent, &dict));
+		instproxy_unlock(client);
 		if (res != INSTPROXY_E_SUCCESS && res != INSTPROXY_E_RECEIVE_TIMEOUT) {
 			break;
 		}
 		if (dict) {
-			uint64_t i;
 			uint64_t current_amount = 0;
 			char *status = NULL;
 			plist_t camount = plist_dict_get_item(dict, "CurrentAmount");
@@ -197,10 +231,11 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t clien
 				plist_get_uint_val(camount, &current_amount);
 			}
 			if (current_amount > 0) {
+				/* hand out the page as received, it is freed right after.
+				 * Like status callbacks it runs without the client locked. */
 				plist_t current_list = plist_dict_get_item(dict, "CurrentList");
-				for (i = 0; current_list && (i < current_amount); i++) {
-					plist_t item = plist_array_get_item(current_list, i);
-					plist_array_append_item(apps_array, plist_copy(item));
+				if (current_list && plist_get_node_type(current_list) == PLIST_ARRAY) {
+					callback(current_list, user_data);
 				}
 			}
 			if (pstatus) {
@@ -219,17 +254,93 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t clien
 		}
 	} while (browsing);
 
+	return res;
+}
+
+static void instproxy_browse_collect_cb(plist_t apps, void *user_data)
+{
+	plist_t apps_array = (plist_t)user_data;
+	uint32_t i;
+
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		plist_array_append_item(apps_array, plist_copy(plist_array_get_item(apps, i)));
+	}
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result)
+{
+	if (!client || !client->parent || !result)
+		return INSTPROXY_E_INVALID_ARG;
+
+	plist_t apps_array = plist_new_array();
+
+	instproxy_error_t res = instproxy_browse_with_callback(client, client_options, instproxy_browse_collect_cb, apps_array);
 	if (res == INSTPROXY_E_SUCCESS) {
 		*result = apps_array;
 	} else {
 		plist_free(apps_array);
 	}
 
-leave_unlock:
-	instproxy_unlock(client);
 	return res;
 }
 
+/**
+ * Checks a status message for an error or the completion of the operation.
+ *
+ * @param operation Operation name, shown in debug messages.
+ * @param dict The status message received.
+ * @param res Pointer that will be set to the result of the operation if it
+ *        has finished.
+ *
+ * @return 1 if the operation has finished, 0 otherwise.
+ */
+static int instproxy_status_is_final(const char *operation, plist_t dict, instproxy_error_t *res)
+{
+	int final = 0;
+
+	/* check for 'Error', so we can abort cleanly */
+	plist_t err = plist_dict_get_item(dict, "Error");
+	if (err) {
+#ifndef STRIP_DEBUG_CODE
+		char *err_msg = NULL;
+		plist_get_string_val(err, &err_msg);
+		if (err_msg) {
+			debug_info("(%s): ERROR: %s", operation, err_msg);
+			free(err_msg);
+		}
+#endif
+		final = 1;
+		*res = INSTPROXY_E_OP_FAILED;
+	}
+	/* get 'Status' */
+	plist_t status = plist_dict_get_item(dict, "Status");
+	if (status) {
+		char *status_msg = NULL;
+		plist_get_string_val(status, &status_msg);
+		if (status_msg) {
+			if (!strcmp(status_msg, "Complete")) {
+				final = 1;
+				*res = INSTPROXY_E_SUCCESS;
+			}
+#ifndef STRIP_DEBUG_CODE
+			plist_t npercent = plist_dict_get_item(dict, "PercentComplete");
+			if (npercent) {
+				uint64_t val = 0;
+				int percent;
+				plist_get_uint_val(npercent, &val);
+				percent = val;
+				debug_info("(%s): %s (%d%%)", operation, status_msg, percent);
+			} else {
+				debug_info("(%s): %s", operation, status_msg);
+			}
+#endif
+			free(status_msg);
+		}
+	}
+
+	return final;
+}
+
 /**
  * Internally used function that will synchronously receive messages from
  * the specified installation_proxy until it completes or an error occurs.
@@ -262,44 +373,8 @@ static instproxy_error_t instproxy_perform_operation(instproxy_client_t client,
 			if (status_cb) {
 				status_cb(operation, dict, user_data);
 			}
-			/* check for 'Error', so we can abort cleanly */
-			plist_t err = plist_dict_get_item(dict, "Error");
-			if (err) {
-#ifndef STRIP_DEBUG_CODE
-				char *err_msg = NULL;
-				plist_get_string_val(err, &err_msg);
-				if (err_msg) {
-					debug_info("(%s): ERROR: %s", operation, err_msg);
-					free(err_msg);
-				}
-#endif
+			if (instproxy_status_is_final(operation, dict, &res)) {
 				ok = 0;
-				res = INSTPROXY_E_OP_FAILED;
-			}
-			/* get 'Status' */
-			plist_t status = plist_dict_get_item(dict, "Status");
-			if (status) {
-				char *status_msg = NULL;
-				plist_get_string_val(status, &status_msg);
-				if (status_msg) {
-					if (!strcmp(status_msg, "Complete")) {
-						ok = 0;
-						res = INSTPROXY_E_SUCCESS;
-					}
-#ifndef STRIP_DEBUG_CODE
-					plist_t npercent = plist_dict_get_item(dict, "PercentComplete");
-					if (npercent) {
-						uint64_t val = 0;
-						int percent;
-						plist_get_uint_val(npercent, &val);
-						percent = val;
-						debug_info("(%s): %s (%d%%)", operation, status_msg, percent);
-					} else {
-						debug_info("(%s): %s", operation, status_msg);
-					}
-#endif
-					free(status_msg);
-				}
 			}
 			plist_free(dict);
 			dict = NULL;
@@ -312,7 +387,7 @@ static instproxy_error_t instproxy_perform_operation(instproxy_client_t client,
 /**
  * Internally used status updater thread function that will call the specified
  * callback function when status update messages (or error messages) are
- * received.
+ * received. Only used for connections that cannot be polled.
  *
  * @param arg Pointer to an allocated struct instproxy_status_data that holds
  *     the required data about the connected client and the callback function.
@@ -339,11 +414,394 @@ static void* instproxy_status_updater(void* arg)
 	return NULL;
 }
 
+/* An asynchronous operation whose status updates are delivered by the executor */
+struct instproxy_status_job {
+	instproxy_client_t client;
+	instproxy_status_cb_t cbfunc;
+	char *operation;
+	void *user_data;
+	int fd;
+	int thread;
+	uint32_t interval;
+	uint64_t last_update;
+	plist_t pending;
+	int finished;
+	int cancelled;
+	int removed;
+	struct instproxy_status_job *next;
+};
+
+struct instproxy_executor_thread {
+	thread_t thread;
+	int running;
+	uint32_t num_jobs;
+	int wakeup_fds[2];
+};
+
+/* Status updates of all clients are delivered by a small set of threads
+ * that wait for their connections to become readable. The threads are
+ * started on demand and then kept for the lifetime of the process. */
+static struct {
+	mutex_t mutex;
+	cond_t cond;
+	struct instproxy_status_job *jobs;
+	struct instproxy_executor_thread threads[INSTPROXY_EXECUTOR_THREADS];
+} instproxy_executor;
+
+static thread_once_t instproxy_executor_once = THREAD_ONCE_INIT;
+
+static void instproxy_executor_init(void)
+{
+	int i;
+
+	mutex_init(&instproxy_executor.mutex);
+	cond_init(&instproxy_executor.cond);
+	instproxy_executor.jobs = NULL;
+	for (i = 0; i < INSTPROXY_EXECUTOR_THREADS; i++) {
+		instproxy_executor.threads[i].running = 0;
+		instproxy_executor.threads[i].num_jobs = 0;
+		instproxy_executor.threads[i].wakeup_fds[0] = -1;
+		instproxy_executor.threads[i].wakeup_fds[1] = -1;
+	}
+}
+
+/**
+ * Returns the current time in milliseconds.
+ */
+static uint64_t instproxy_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+/**
+ * Gets the socket of a client's connection if it can be polled for status
+ * updates. SSL connections may buffer data and are therefore excluded.
+ *
+ * @return The socket or -1.
+ */
+static int instproxy_get_fd(instproxy_client_t client)
+{
+	idevice_connection_t connection = client->parent->parent->connection;
+	int fd = -1;
+
+	if (connection->ssl_data || idevice_connection_get_fd(connection, &fd) != IDEVICE_E_SUCCESS) {
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Wakes up an executor thread so it picks up changes of its jobs.
+ * Must be called with the executor mutex held.
+ */
+static void instproxy_executor_wakeup(int index)
+{
+#ifndef WIN32
+	if (instproxy_executor.threads[index].wakeup_fds[1] >= 0) {
+		char c = 0;
+		if (write(instproxy_executor.threads[index].wakeup_fds[1], &c, 1) < 0) {
+			/* the pipe is full, so a wakeup is already pending */
+		}
+	}
+#endif
+	cond_broadcast(&instproxy_executor.cond);
+}
+
+static void instproxy_status_job_free(struct instproxy_status_job *job)
+{
+	if (job->pending) {
+		plist_free(job->pending);
+	}
+	free(job->operation);
+	free(job);
+}
+
+/**
+ * Passes a status message to the callback of a job, or holds it back if
+ * it is a progress update arriving faster than requested.
+ * Takes ownership of dict.
+ */
+static void instproxy_status_job_deliver(struct instproxy_status_job *job, plist_t dict, uint64_t now)
+{
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+
+	if (instproxy_status_is_final(job->operation, dict, &res)) {
+		job->finished = 1;
+	} else if (job->interval > 0 && now - job->last_update < job->interval) {
+		/* coalesce with a progress update that was not passed on yet */
+		if (job->pending) {
+			plist_free(job->pending);
+		}
+		job->pending = dict;
+		return;
+	}
+
+	/* a newer message supersedes the held back one */
+	if (job->pending) {
+		plist_free(job->pending);
+		job->pending = NULL;
+	}
+	job->cbfunc(job->operation, dict, job->user_data);
+	job->last_update = now;
+	plist_free(dict);
+}
+
+/**
+ * Receives a status message of a job whose connection became readable.
+ */
+static void instproxy_status_job_receive(struct instproxy_status_job *job)
+{
+	plist_t dict = NULL;
+
+	instproxy_lock(job->client);
+	instproxy_error_t res = instproxy_error(property_list_service_receive_plist_with_timeout(job->client->parent, &dict, 1000));
+	instproxy_unlock(job->client);
+	if (res != INSTPROXY_E_SUCCESS && res != INSTPROXY_E_RECEIVE_TIMEOUT) {
+		debug_info("could not receive plist, error %d", res);
+		job->finished = 1;
+		return;
+	}
+	if (dict) {
+		instproxy_status_job_deliver(job, dict, instproxy_time_ms());
+	}
+}
+
+/**
+ * Executor thread function. Waits for the connections of its jobs to become
+ * readable and delivers their status updates.
+ *
+ * @param arg Pointer to the struct instproxy_executor_thread of the thread.
+ *
+ * @return Never returns.
+ */
+static void* instproxy_executor_thread_func(void* arg)
+{
+	struct instproxy_executor_thread *self = (struct instproxy_executor_thread*)arg;
+	int index = (int)(self - instproxy_executor.threads);
+	struct pollfd *fds = NULL;
+	struct instproxy_status_job **polled = NULL;
+	uint32_t capacity = 0;
+
+	mutex_lock(&instproxy_executor.mutex);
+	while (1) {
+		struct instproxy_status_job **link = &instproxy_executor.jobs;
+		struct instproxy_status_job *job;
+		uint64_t now = instproxy_time_ms();
+		int timeout = -1;
+		uint32_t num = 0;
+		uint32_t i;
+
+		/* drop finished and cancelled jobs */
+		while ((job = *link) != NULL) {
+			if (job->thread != index || (!job->finished && !job->cancelled)) {
+				link = &job->next;
+				continue;
+			}
+			*link = job->next;
+			self->num_jobs--;
+			if (job->cancelled) {
+				/* freed by the canceling thread */
+				job->removed = 1;
+				cond_broadcast(&instproxy_executor.cond);
+			} else {
+				debug_info("(%s): done, cleaning up.", job->operation);
+				job->client->status_job = NULL;
+				instproxy_status_job_free(job);
+			}
+		}
+
+		if (self->num_jobs == 0) {
+			cond_wait(&instproxy_executor.cond, &instproxy_executor.mutex);
+			continue;
+		}
+
+		if (self->num_jobs + 1 > capacity) {
+			capacity = self->num_jobs + 1;
+			fds = (struct pollfd*)realloc(fds, capacity * sizeof(struct pollfd));
+			polled = (struct instproxy_status_job**)realloc(polled, capacity * sizeof(struct instproxy_status_job*));
+		}
+
+		fds[num].fd = self->wakeup_fds[0];
+		fds[num].events = POLLIN;
+		fds[num].revents = 0;
+		polled[num] = NULL;
+		num++;
+		for (job = instproxy_executor.jobs; job; job = job->next) {
+			if (job->thread != index)
+				continue;
+			fds[num].fd = job->fd;
+			fds[num].events = POLLIN;
+			fds[num].revents = 0;
+			polled[num] = job;
+			num++;
+			if (job->pending) {
+				uint64_t due = job->last_update + job->interval;
+				int wait = (due > now) ? (int)(due - now) : 0;
+				if (timeout < 0 || wait < timeout)
+					timeout = wait;
+			}
+		}
+#ifdef WIN32
+		/* there is no wakeup pipe, so check for changes regularly */
+		if (timeout < 0 || timeout > INSTPROXY_EXECUTOR_POLL_TIMEOUT)
+			timeout = INSTPROXY_EXECUTOR_POLL_TIMEOUT;
+#endif
+		mutex_unlock(&instproxy_executor.mutex);
+
+		/* only this thread removes its jobs, so they stay valid while unlocked */
+		if (poll(fds, num, timeout) < 0 && errno != EINTR) {
+			debug_info("poll failed: %s", strerror(errno));
+		}
+#ifndef WIN32
+		if (fds[0].revents & POLLIN) {
+			char buf[64];
+			while (read(self->wakeup_fds[0], buf, sizeof(buf)) > 0);
+		}
+#endif
+		for (i = 1; i < num; i++) {
+			job = polled[i];
+			if (job->cancelled)
+				continue;
+			if (fds[i].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) {
+				instproxy_status_job_receive(job);
+			}
+			if (job->pending && !job->finished) {
+				now = instproxy_time_ms();
+				if (now - job->last_update >= job->interval) {
+					plist_t dict = job->pending;
+					job->pending = NULL;
+					instproxy_status_job_deliver(job, dict, now);
+				}
+			}
+		}
+
+		mutex_lock(&instproxy_executor.mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * Hands an asynchronous operation to the executor, starting another
+ * executor thread if all running ones are busy.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_UNKNOWN_ERROR if no
+ *     executor thread could be started.
+ */
+static instproxy_error_t instproxy_executor_add(struct instproxy_status_job *job)
+{
+	int best = -1;
+	int i;
+
+	thread_once(&instproxy_executor_once, instproxy_executor_init);
+
+	mutex_lock(&instproxy_executor.mutex);
+	for (i = 0; i < INSTPROXY_EXECUTOR_THREADS; i++) {
+		if (instproxy_executor.threads[i].running && (best < 0 || instproxy_executor.threads[i].num_jobs < instproxy_executor.threads[best].num_jobs)) {
+			best = i;
+		}
+	}
+	if (best < 0 || instproxy_executor.threads[best].num_jobs > 0) {
+		for (i = 0; i < INSTPROXY_EXECUTOR_THREADS; i++) {
+			struct instproxy_executor_thread *t = &instproxy_executor.threads[i];
+			if (t->running)
+				continue;
+#ifndef WIN32
+			if (pipe(t->wakeup_fds) != 0) {
+				t->wakeup_fds[0] = -1;
+				t->wakeup_fds[1] = -1;
+				break;
+			}
+			fcntl(t->wakeup_fds[0], F_SETFL, fcntl(t->wakeup_fds[0], F_GETFL) | O_NONBLOCK);
+			fcntl(t->wakeup_fds[1], F_SETFL, fcntl(t->wakeup_fds[1], F_GETFL) | O_NONBLOCK);
+#endif
+			if (thread_create(&t->thread, instproxy_executor_thread_func, t) != 0) {
+#ifndef WIN32
+				close(t->wakeup_fds[0]);
+				close(t->wakeup_fds[1]);
+				t->wakeup_fds[0] = -1;
+				t->wakeup_fds[1] = -1;
+#endif
+				break;
+			}
+			t->running = 1;
+			best = i;
+			break;
+		}
+	}
+	if (best < 0) {
+		mutex_unlock(&instproxy_executor.mutex);
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	}
+
+	job->thread = best;
+	job->next = instproxy_executor.jobs;
+	instproxy_executor.jobs = job;
+	instproxy_executor.threads[best].num_jobs++;
+	job->client->status_job = job;
+	instproxy_executor_wakeup(best);
+	mutex_unlock(&instproxy_executor.mutex);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+/**
+ * Stops delivering status updates for the operation of a client, waiting
+ * for a callback that is currently running to return.
+ */
+static void instproxy_executor_cancel(instproxy_client_t client)
+{
+	struct instproxy_status_job *job;
+
+	if (!client->status_job)
+		return;
+
+	mutex_lock(&instproxy_executor.mutex);
+	job = client->status_job;
+	if (job) {
+		job->cancelled = 1;
+		instproxy_executor_wakeup(job->thread);
+		while (!job->removed) {
+			cond_wait(&instproxy_executor.cond, &instproxy_executor.mutex);
+		}
+		client->status_job = NULL;
+	}
+	mutex_unlock(&instproxy_executor.mutex);
+
+	if (job) {
+		instproxy_status_job_free(job);
+	}
+}
+
+/**
+ * Checks whether status updates of an asynchronous operation are still
+ * being received for a client.
+ */
+static int instproxy_status_pending(instproxy_client_t client)
+{
+	int pending = 0;
+
+	thread_once(&instproxy_executor_once, instproxy_executor_init);
+	mutex_lock(&instproxy_executor.mutex);
+	pending = (client->status_job != NULL);
+	mutex_unlock(&instproxy_executor.mutex);
+
+	instproxy_lock(client);
+	pending |= (client->status_updater != (thread_t)NULL);
+	instproxy_unlock(client);
+
+	return pending;
+}
+
 /**
- * Internally used helper function that creates a status updater thread which
- * will call the passed callback function when status updates occur.
- * If status_cb is NULL no thread will be created, but the operation will
- * run synchronously until it completes or an error occurs.
+ * Internally used helper function that hands the status updates of an
+ * operation to the shared executor, which will call the passed callback
+ * function when status updates occur.
+ * If status_cb is NULL the operation will run synchronously until it
+ * completes or an error occurs.
  *
  * @param client The connected installation proxy client
  * @param status_cb Pointer to a callback function or NULL
@@ -351,15 +809,38 @@ static void* instproxy_status_updater(void* arg)
  *        in async mode or shown in debug messages in sync mode.
  * @param user_data Callback data passed to status_cb.
  *
- * @return INSTPROXY_E_SUCCESS when the thread was created (async mode), or
- *         when the operation completed successfully (sync).
+ * @return INSTPROXY_E_SUCCESS when the operation was handed to the executor
+ *         (async mode), or when the operation completed successfully (sync).
  *         An INSTPROXY_E_* error value is returned if an error occured.
  */
 static instproxy_error_t instproxy_create_status_updater(instproxy_client_t client, instproxy_status_cb_t status_cb, const char *operation, void *user_data)
 {
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
-	if (status_cb) {
-		/* async mode */
+	int fd;
+
+	if (!status_cb) {
+		/* sync mode */
+		return instproxy_perform_operation(client, NULL, operation, NULL);
+	}
+
+	fd = instproxy_get_fd(client);
+	if (fd >= 0) {
+		/* async mode, delivered by the executor */
+		struct instproxy_status_job *job = (struct instproxy_status_job*)calloc(1, sizeof(struct instproxy_status_job));
+		if (job) {
+			job->client = client;
+			job->cbfunc = status_cb;
+			job->operation = strdup(operation);
+			job->user_data = user_data;
+			job->fd = fd;
+			job->interval = client->status_interval;
+			res = instproxy_executor_add(job);
+			if (res != INSTPROXY_E_SUCCESS) {
+				instproxy_status_job_free(job);
+			}
+		}
+	} else {
+		/* async mode with a dedicated thread */
 		struct instproxy_status_data *data = (struct instproxy_status_data*)malloc(sizeof(struct instproxy_status_data));
 		if (data) {
 			data->client = client;
@@ -371,14 +852,10 @@ static instproxy_error_t instproxy_create_status_updater(instproxy_client_t clie
 				res = INSTPROXY_E_SUCCESS;
 			}
 		}
-	} else {
-		/* sync mode */
-		res = instproxy_perform_operation(client, NULL, operation, NULL);
 	}
 	return res;
 }
 
-
 /**
  * Internal function used by instproxy_install and instproxy_upgrade.
  *
@@ -398,7 +875,7 @@ static instproxy_error_t instproxy_install_or_upgrade(instproxy_client_t client,
 	if (!client || !client->parent || !pkg_path) {
 		return INSTPROXY_E_INVALID_ARG;
 	}
-	if (client->status_updater) {
+	if (client->status_updater || client->status_job) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -430,7 +907,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_uninstall(instproxy_client_t cl
 		return INSTPROXY_E_INVALID_ARG;
 	}
 
-	if (client->status_updater) {
+	if (client->status_updater || client->status_job) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -479,7 +956,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_archive(instproxy_client_t clie
 	if (!client || !client->parent || !appid)
 		return INSTPROXY_E_INVALID_ARG;
 
-	if (client->status_updater) {
+	if (client->status_updater || client->status_job) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -499,7 +976,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_restore(instproxy_client_t clie
 	if (!client || !client->parent || !appid)
 		return INSTPROXY_E_INVALID_ARG;
 
-	if (client->status_updater) {
+	if (client->status_updater || client->status_job) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -519,7 +996,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_remove_archive(instproxy_client
 	if (!client || !client->parent || !appid)
 		return INSTPROXY_E_INVALID_ARG;
 
-	if (client->status_updater) {
+	if (client->status_updater || client->status_job) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -534,16 +1011,403 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_remove_archive(instproxy_client
 	return instproxy_create_status_updater(client, status_cb, "RemoveArchive", user_data);
 }
 
-LIBIMOBILEDEVICE_API plist_t instproxy_client_options_new()
+struct instproxy_deploy;
+
+struct instproxy_deploy_device {
+	struct instproxy_deploy *deploy;
+	const char *udid;
+	idevice_t device;
+	instproxy_client_t client;
+	instproxy_error_t result;
+	int done;
+};
+
+struct instproxy_deploy {
+	const char *data;
+	uint64_t length;
+	char *staging_path;
+	plist_t client_options;
+	uint64_t max_bandwidth;
+	uint64_t next_send;
+	instproxy_deploy_cb_t status_cb;
+	void *user_data;
+	struct instproxy_deploy_device *devices;
+	uint32_t count;
+	uint32_t next_device;
+	mutex_t mutex;
+	cond_t cond;
+};
+
+/**
+ * Passes a status message of a device to the deployment's callback.
+ * Calls are serialized so the callback does not need to be thread safe.
+ */
+static void instproxy_deploy_report(struct instproxy_deploy_device *dev, const char *operation, plist_t status)
 {
-	return plist_new_dict();
+	struct instproxy_deploy *deploy = dev->deploy;
+
+	mutex_lock(&deploy->mutex);
+	if (deploy->status_cb) {
+		deploy->status_cb(dev->udid, operation, status, deploy->user_data);
+	}
+	mutex_unlock(&deploy->mutex);
 }
 
-LIBIMOBILEDEVICE_API void instproxy_client_options_add(plist_t client_options, ...)
+/**
+ * Reports a failure before the installation on a device could be started.
+ */
+static void instproxy_deploy_fail(struct instproxy_deploy_device *dev, instproxy_error_t err, const char *description)
 {
-	if (!client_options)
+	struct instproxy_deploy *deploy = dev->deploy;
+	plist_t status = plist_new_dict();
+
+	debug_info("%s: %s", dev->udid, description);
+	plist_dict_set_item(status, "Error", plist_new_string("DeployFailed"));
+	plist_dict_set_item(status, "ErrorDescription", plist_new_string(description));
+
+	mutex_lock(&deploy->mutex);
+	if (deploy->status_cb) {
+		deploy->status_cb(dev->udid, "Upload", status, deploy->user_data);
+	}
+	dev->result = err;
+	dev->done = 1;
+	cond_broadcast(&deploy->cond);
+	mutex_unlock(&deploy->mutex);
+
+	plist_free(status);
+}
+
+/**
+ * Forwards the status messages of an installation and records its result.
+ */
+static void instproxy_deploy_status_cb(const char *operation, plist_t status, void *user_data)
+{
+	struct instproxy_deploy_device *dev = (struct instproxy_deploy_device*)user_data;
+	struct instproxy_deploy *deploy = dev->deploy;
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+	int final = instproxy_status_is_final(operation, status, &res);
+
+	mutex_lock(&deploy->mutex);
+	if (deploy->status_cb) {
+		deploy->status_cb(dev->udid, operation, status, deploy->user_data);
+	}
+	if (final) {
+		dev->result = res;
+		dev->done = 1;
+		cond_broadcast(&deploy->cond);
+	}
+	mutex_unlock(&deploy->mutex);
+}
+
+/**
+ * Waits until length more bytes may be uploaded without exceeding the
+ * bandwidth budget shared by all uploads of a deployment.
+ */
+static void instproxy_deploy_throttle(struct instproxy_deploy *deploy, uint32_t length)
+{
+	struct timeval tv;
+	uint64_t now;
+	uint64_t start;
+
+	if (!deploy->max_bandwidth)
 		return;
-	va_list args;
+
+	gettimeofday(&tv, NULL);
+	now = ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+
+	mutex_lock(&deploy->mutex);
+	if (deploy->next_send < now) {
+		deploy->next_send = now;
+	}
+	start = deploy->next_send;
+	deploy->next_send += (uint64_t)length * 1000000 / deploy->max_bandwidth;
+	while (now < start) {
+		cond_wait_timeout(&deploy->cond, &deploy->mutex, (unsigned int)((start - now + 999) / 1000));
+		gettimeofday(&tv, NULL);
+		now = ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+	}
+	mutex_unlock(&deploy->mutex);
+}
+
+/**
+ * Uploads the package to the staging directory of a device.
+ */
+static instproxy_error_t instproxy_deploy_upload(struct instproxy_deploy_device *dev)
+{
+	struct instproxy_deploy *deploy = dev->deploy;
+	afc_client_t afc = NULL;
+	afc_stream_t stream = NULL;
+	uint64_t handle = 0;
+	uint64_t offset = 0;
+	int percent = -1;
+	afc_error_t aerr;
+
+	if (afc_client_start_service(dev->device, &afc, NULL) != AFC_E_SUCCESS) {
+		return INSTPROXY_E_CONN_FAILED;
+	}
+
+	/* fails if the directory already exists */
+	afc_make_directory(afc, INSTPROXY_DEPLOY_STAGING_DIR);
+
+	aerr = afc_file_open(afc, deploy->staging_path, AFC_FOPEN_WRONLY, &handle);
+	if (aerr == AFC_E_SUCCESS) {
+		aerr = afc_stream_new(afc, handle, INSTPROXY_DEPLOY_CHUNK_SIZE, 0, &stream);
+	}
+	while (aerr == AFC_E_SUCCESS && offset < deploy->length) {
+		uint32_t length = INSTPROXY_DEPLOY_CHUNK_SIZE;
+		uint32_t written = 0;
+		if (deploy->length - offset < length)
+			length = (uint32_t)(deploy->length - offset);
+		instproxy_deploy_throttle(deploy, length);
+		aerr = afc_stream_write(stream, deploy->data + offset, length, &written);
+		if (aerr == AFC_E_SUCCESS && written == 0) {
+			aerr = AFC_E_IO_ERROR;
+		}
+		offset += written;
+		if (offset < deploy->length && (int)(offset * 100 / deploy->length) != percent) {
+			plist_t status = plist_new_dict();
+			percent = (int)(offset * 100 / deploy->length);
+			plist_dict_set_item(status, "Status", plist_new_string("Uploading"));
+			plist_dict_set_item(status, "PercentComplete", plist_new_uint(percent));
+			instproxy_deploy_report(dev, "Upload", status);
+			plist_free(status);
+		}
+	}
+	if (stream) {
+		afc_error_t ferr = afc_stream_free(stream);
+		if (aerr == AFC_E_SUCCESS)
+			aerr = ferr;
+	}
+	if (handle) {
+		afc_error_t cerr = afc_file_close(afc, handle);
+		if (aerr == AFC_E_SUCCESS)
+			aerr = cerr;
+	}
+	afc_client_free(afc);
+
+	if (aerr != AFC_E_SUCCESS) {
+		debug_info("%s: upload failed, error %d", dev->udid, aerr);
+		return INSTPROXY_E_OP_FAILED;
+	}
+
+	plist_t status = plist_new_dict();
+	plist_dict_set_item(status, "Status", plist_new_string("Uploading"));
+	plist_dict_set_item(status, "PercentComplete", plist_new_uint(100));
+	instproxy_deploy_report(dev, "Upload", status);
+	plist_free(status);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+/**
+ * Upload thread function. Takes the next device, uploads the package and
+ * starts the installation, which then runs on the device while the thread
+ * continues with another one.
+ *
+ * @param arg Pointer to the struct instproxy_deploy.
+ *
+ * @return Always NULL.
+ */
+static void* instproxy_deploy_worker(void* arg)
+{
+	struct instproxy_deploy *deploy = (struct instproxy_deploy*)arg;
+
+	while (1) {
+		struct instproxy_deploy_device *dev;
+		instproxy_error_t res;
+
+		mutex_lock(&deploy->mutex);
+		if (deploy->next_device >= deploy->count) {
+			mutex_unlock(&deploy->mutex);
+			break;
+		}
+		dev = &deploy->devices[deploy->next_device++];
+		mutex_unlock(&deploy->mutex);
+
+		if (idevice_new(&dev->device, dev->udid) != IDEVICE_E_SUCCESS) {
+			dev->device = NULL;
+			instproxy_deploy_fail(dev, INSTPROXY_E_CONN_FAILED, "Device not found");
+			continue;
+		}
+
+		res = instproxy_deploy_upload(dev);
+		if (res != INSTPROXY_E_SUCCESS) {
+			instproxy_deploy_fail(dev, res, "Could not upload package");
+			continue;
+		}
+
+		res = instproxy_client_start_service(dev->device, &dev->client, NULL);
+		if (res != INSTPROXY_E_SUCCESS) {
+			dev->client = NULL;
+			instproxy_deploy_fail(dev, res, "Could not start installation_proxy");
+			continue;
+		}
+
+		res = instproxy_install(dev->client, deploy->staging_path, deploy->client_options, instproxy_deploy_status_cb, dev);
+		if (res != INSTPROXY_E_SUCCESS) {
+			instproxy_deploy_fail(dev, res, "Could not start installation");
+		}
+	}
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_deploy(const char *pkg_path, const char **udids, uint32_t count, plist_t client_options, uint32_t max_uploads, uint64_t max_bandwidth, instproxy_deploy_cb_t status_cb, void *user_data, instproxy_error_t *results)
+{
+	struct instproxy_deploy deploy;
+	thread_t *threads = NULL;
+	uint32_t num_threads = 0;
+	const char *basename;
+	char *data = NULL;
+	uint64_t length = 0;
+	int mapped = 0;
+	instproxy_error_t res = INSTPROXY_E_SUCCESS;
+	uint32_t i;
+
+	/* devices are failed until their deployment finished */
+	for (i = 0; results && i < count; i++) {
+		results[i] = INSTPROXY_E_UNKNOWN_ERROR;
+	}
+
+	if (!pkg_path || !udids || count == 0)
+		return INSTPROXY_E_INVALID_ARG;
+
+	if (client_options && plist_get_node_type(client_options) != PLIST_DICT)
+		return INSTPROXY_E_INVALID_ARG;
+
+	/* read the package once, it is shared by all uploads */
+#ifdef WIN32
+	buffer_read_from_filename(pkg_path, &data, &length);
+	if (!data) {
+		debug_info("could not read %s", pkg_path);
+		return INSTPROXY_E_INVALID_ARG;
+	}
+#else
+	{
+		struct stat st;
+		int fd = open(pkg_path, O_RDONLY);
+		if (fd < 0) {
+			debug_info("could not open %s", pkg_path);
+			return INSTPROXY_E_INVALID_ARG;
+		}
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			close(fd);
+			return INSTPROXY_E_INVALID_ARG;
+		}
+		length = st.st_size;
+		data = (char*)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			return INSTPROXY_E_UNKNOWN_ERROR;
+		}
+		mapped = 1;
+	}
+#endif
+
+	memset(&deploy, '\0', sizeof(struct instproxy_deploy));
+	deploy.data = data;
+	deploy.length = length;
+	deploy.client_options = client_options;
+	deploy.max_bandwidth = max_bandwidth;
+	deploy.status_cb = status_cb;
+	deploy.user_data = user_data;
+	deploy.count = count;
+	mutex_init(&deploy.mutex);
+	cond_init(&deploy.cond);
+
+	basename = strrchr(pkg_path, '/');
+#ifdef WIN32
+	if (!basename)
+		basename = strrchr(pkg_path, '\\');
+#endif
+	basename = (basename) ? basename + 1 : pkg_path;
+	deploy.staging_path = string_build_path(INSTPROXY_DEPLOY_STAGING_DIR, basename, NULL);
+
+	deploy.devices = (struct instproxy_deploy_device*)calloc(count, sizeof(struct instproxy_deploy_device));
+	if (!deploy.devices || !deploy.staging_path) {
+		res = INSTPROXY_E_UNKNOWN_ERROR;
+		goto leave;
+	}
+	for (i = 0; i < count; i++) {
+		deploy.devices[i].deploy = &deploy;
+		deploy.devices[i].udid = udids[i];
+		deploy.devices[i].result = INSTPROXY_E_UNKNOWN_ERROR;
+	}
+
+	if (max_uploads == 0)
+		max_uploads = INSTPROXY_DEPLOY_DEFAULT_UPLOADS;
+	if (max_uploads > count)
+		max_uploads = count;
+	threads = (thread_t*)malloc(max_uploads * sizeof(thread_t));
+	for (i = 0; threads && i < max_uploads; i++) {
+		if (thread_create(&threads[num_threads], instproxy_deploy_worker, &deploy) == 0) {
+			num_threads++;
+		}
+	}
+	if (num_threads == 0) {
+		instproxy_deploy_worker(&deploy);
+	}
+	for (i = 0; i < num_threads; i++) {
+		thread_join(threads[i]);
+	}
+	free(threads);
+
+	/* wait for the installations still running on the devices */
+	mutex_lock(&deploy.mutex);
+	for (i = 0; i < count; i++) {
+		struct instproxy_deploy_device *dev = &deploy.devices[i];
+		while (!dev->done) {
+			if (dev->client && !instproxy_status_pending(dev->client)) {
+				/* the connection was lost before the installation finished */
+				cond_wait_timeout(&deploy.cond, &deploy.mutex, 10);
+				if (!dev->done) {
+					dev->result = INSTPROXY_E_CONN_FAILED;
+					dev->done = 1;
+				}
+				break;
+			}
+			cond_wait_timeout(&deploy.cond, &deploy.mutex, 100);
+		}
+	}
+	mutex_unlock(&deploy.mutex);
+
+	for (i = 0; i < count; i++) {
+		struct instproxy_deploy_device *dev = &deploy.devices[i];
+		if (dev->client)
+			instproxy_client_free(dev->client);
+		if (dev->device)
+			idevice_free(dev->device);
+		if (results)
+			results[i] = dev->result;
+		if (dev->result != INSTPROXY_E_SUCCESS)
+			res = INSTPROXY_E_OP_FAILED;
+	}
+
+leave:
+	free(deploy.devices);
+	free(deploy.staging_path);
+	cond_destroy(&deploy.cond);
+	mutex_destroy(&deploy.mutex);
+#ifndef WIN32
+	if (mapped) {
+		munmap(data, length);
+	} else
+#endif
+	free(data);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API plist_t instproxy_client_options_new()
+{
+	return plist_new_dict();
+}
+
+LIBIMOBILEDEVICE_API void instproxy_client_options_add(plist_t client_options, ...)
+{
+	if (!client_options)
+		return;
+	va_list args;
 	va_start(args, client_options);
 	char *arg = va_arg(args, char*);
 	while (arg) {
@@ -579,12 +1443,42 @@ LIBIMOBILEDEVICE_API void instproxy_client_options_free(plist_t client_options)
 	}
 }
 
+struct instproxy_find_app {
+	const char *appid;
+	plist_t app;
+};
+
+static void instproxy_find_app_cb(plist_t apps, void *user_data)
+{
+	struct instproxy_find_app *find_app = (struct instproxy_find_app*)user_data;
+	uint32_t i;
+
+	if (find_app->app)
+		return;
+
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		char *appid_str = NULL;
+		plist_t app_info = plist_array_get_item(apps, i);
+		plist_t idp = plist_dict_get_item(app_info, "CFBundleIdentifier");
+		if (idp) {
+			plist_get_string_val(idp, &appid_str);
+		}
+		if (appid_str && strcmp(find_app->appid, appid_str) == 0) {
+			find_app->app = plist_copy(app_info);
+		}
+		free(appid_str);
+		if (find_app->app) {
+			break;
+		}
+	}
+}
+
 LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_get_path_for_bundle_identifier(instproxy_client_t client, const char* appid, char** path)
 {
 	if (!client || !client->parent || !appid)
 		return INSTPROXY_E_INVALID_ARG;
 
-	plist_t apps = NULL;
+	struct instproxy_find_app find_app = { appid, NULL };
 
 	// create client options for any application types
 	plist_t client_opts = instproxy_client_options_new();
@@ -599,34 +1493,17 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_get_path_for_bundle_iden
 	plist_free(return_attributes);
 	return_attributes = NULL;
 
-	// query device for list of apps
-	instproxy_error_t ierr = instproxy_browse(client, client_opts, &apps);
+	// query device for list of apps, keeping only the matching one
+	instproxy_error_t ierr = instproxy_browse_with_callback(client, client_opts, instproxy_find_app_cb, &find_app);
 	instproxy_client_options_free(client_opts);
 	if (ierr != INSTPROXY_E_SUCCESS) {
+		if (find_app.app)
+			plist_free(find_app.app);
 		return ierr;
 	}
 
-	plist_t app_found = NULL;
-	uint32_t i;
-	for (i = 0; i < plist_array_get_size(apps); i++) {
-		char *appid_str = NULL;
-		plist_t app_info = plist_array_get_item(apps, i);
-		plist_t idp = plist_dict_get_item(app_info, "CFBundleIdentifier");
-		if (idp) {
-			plist_get_string_val(idp, &appid_str);
-		}
-		if (appid_str && strcmp(appid, appid_str) == 0) {
-			app_found = app_info;
-		}
-		free(appid_str);
-		if (app_found) {
-			break;
-		}
-	}
-
+	plist_t app_found = find_app.app;
 	if (!app_found) {
-		if (apps)
-			plist_free(apps);
 		*path = NULL;
 		return INSTPROXY_E_OP_FAILED;
 	}
@@ -643,18 +1520,20 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_get_path_for_bundle_iden
 		plist_get_string_val(exec_p, &exec_str);
 	}
 
+	plist_free(app_found);
+
 	if (!path_str) {
 		debug_info("app path not found");
+		free(exec_str);
 		return INSTPROXY_E_OP_FAILED;
 	}
 
 	if (!exec_str) {
 		debug_info("bundle executable not found");
+		free(path_str);
 		return INSTPROXY_E_OP_FAILED;
 	}
 
-	plist_free(apps);
-
 	char* ret = (char*)malloc(strlen(path_str) + 1 + strlen(exec_str) + 1);
 	strcpy(ret, path_str);
 	strcat(ret, "/");
@@ -672,3 +1551,562 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_get_path_for_bundle_iden
 
 	return INSTPROXY_E_SUCCESS;
 }
+
+/* attributes whose values change whenever an application is installed again */
+static const char *instproxy_inventory_markers[] = {
+	"CFBundleVersion",
+	"CFBundleShortVersionString",
+	"SignerIdentity",
+	"Path",
+	NULL
+};
+
+struct instproxy_inventory_item {
+	char *bundle_id;
+	uint64_t marker;
+	const char *record;
+	uint32_t record_length;
+	char *record_bin;
+};
+
+struct instproxy_inventory_browse {
+	struct instproxy_inventory_item *items;
+	uint32_t count;
+	uint32_t capacity;
+	int error;
+};
+
+static uint64_t instproxy_inventory_hash(uint64_t hash, const char *data, size_t length)
+{
+	size_t i;
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Combines the change markers of an application into a single value.
+ */
+static uint64_t instproxy_inventory_get_marker(plist_t app)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; instproxy_inventory_markers[i]; i++) {
+		plist_t node = plist_dict_get_item(app, instproxy_inventory_markers[i]);
+		char *value = NULL;
+		uint32_t length = 0;
+		if (!node) {
+			hash = instproxy_inventory_hash(hash, "", 1);
+			continue;
+		}
+		if (plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &value);
+			if (value)
+				length = strlen(value);
+		} else {
+			plist_to_bin(node, &value, &length);
+		}
+		if (value)
+			hash = instproxy_inventory_hash(hash, value, length);
+		hash = instproxy_inventory_hash(hash, "", 1);
+		free(value);
+	}
+
+	return hash;
+}
+
+static void instproxy_inventory_browse_cb(plist_t apps, void *user_data)
+{
+	struct instproxy_inventory_browse *browse = (struct instproxy_inventory_browse*)user_data;
+	uint32_t i;
+
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		plist_t app = plist_array_get_item(apps, i);
+		plist_t idp = plist_dict_get_item(app, "CFBundleIdentifier");
+		char *bundle_id = NULL;
+		if (idp) {
+			plist_get_string_val(idp, &bundle_id);
+		}
+		if (!bundle_id) {
+			continue;
+		}
+		if (browse->count == browse->capacity) {
+			uint32_t capacity = browse->capacity ? browse->capacity * 2 : 256;
+			struct instproxy_inventory_item *items = (struct instproxy_inventory_item*)realloc(browse->items, capacity * sizeof(struct instproxy_inventory_item));
+			if (!items) {
+				free(bundle_id);
+				browse->error = 1;
+				return;
+			}
+			browse->items = items;
+			browse->capacity = capacity;
+		}
+		memset(&browse->items[browse->count], '\0', sizeof(struct instproxy_inventory_item));
+		browse->items[browse->count].bundle_id = bundle_id;
+		browse->items[browse->count].marker = instproxy_inventory_get_marker(app);
+		browse->count++;
+	}
+}
+
+static int instproxy_inventory_item_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct instproxy_inventory_item*)a)->bundle_id, ((const struct instproxy_inventory_item*)b)->bundle_id);
+}
+
+static void instproxy_inventory_items_free(struct instproxy_inventory_item *items, uint32_t count)
+{
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		free(items[i].bundle_id);
+		free(items[i].record_bin);
+	}
+	free(items);
+}
+
+static const InstproxyInventoryEntry *instproxy_inventory_get_entry(instproxy_inventory_t inventory, uint32_t index)
+{
+	return (const InstproxyInventoryEntry*)(inventory->data + sizeof(InstproxyInventoryHeader)) + index;
+}
+
+static const char *instproxy_inventory_entry_get_bundle_id(instproxy_inventory_t inventory, const InstproxyInventoryEntry *entry)
+{
+	return inventory->data + sizeof(InstproxyInventoryHeader) + (uint64_t)inventory->count * sizeof(InstproxyInventoryEntry) + le32toh(entry->id_offset);
+}
+
+static const char *instproxy_inventory_entry_get_record(instproxy_inventory_t inventory, const InstproxyInventoryEntry *entry)
+{
+	InstproxyInventoryHeader header;
+	memcpy(&header, inventory->data, sizeof(InstproxyInventoryHeader));
+	return inventory->data + sizeof(InstproxyInventoryHeader) + (uint64_t)inventory->count * sizeof(InstproxyInventoryEntry) + le64toh(header.strings_length) + le64toh(entry->record_offset);
+}
+
+/**
+ * Requests the full records of a batch of applications with the Lookup
+ * command and stores them as binary plists in the given items.
+ * Items of applications that are no longer installed keep a NULL record.
+ */
+static instproxy_error_t instproxy_inventory_fetch(instproxy_client_t client, plist_t client_options, struct instproxy_inventory_item **batch, uint32_t count)
+{
+	plist_t options = (client_options) ? plist_copy(client_options) : plist_new_dict();
+	plist_t bundle_ids = plist_new_array();
+	plist_t dict = NULL;
+	plist_t lookup_result;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		plist_array_append_item(bundle_ids, plist_new_string(batch[i]->bundle_id));
+	}
+	plist_dict_set_item(options, "BundleIDs", bundle_ids);
+
+	instproxy_lock(client);
+	instproxy_error_t res = instproxy_send_command(client, "Lookup", options, NULL, NULL);
+	plist_free(options);
+	if (res != INSTPROXY_E_SUCCESS) {
+		debug_info("could not send plist, error %d", res);
+		goto leave_unlock;
+	}
+
+	res = instproxy_error(property_list_service_receive_plist(client->parent, &dict));
+	if (res != INSTPROXY_E_SUCCESS) {
+		debug_info("could not receive plist, error %d", res);
+		goto leave_unlock;
+	}
+
+	if (plist_dict_get_item(dict, "Error")) {
+		debug_info("Lookup failed");
+		res = INSTPROXY_E_OP_FAILED;
+		goto leave_unlock;
+	}
+
+	lookup_result = plist_dict_get_item(dict, "LookupResult");
+	if (!lookup_result || plist_get_node_type(lookup_result) != PLIST_DICT) {
+		res = INSTPROXY_E_PLIST_ERROR;
+		goto leave_unlock;
+	}
+
+	for (i = 0; i < count; i++) {
+		plist_t app = plist_dict_get_item(lookup_result, batch[i]->bundle_id);
+		if (app && plist_get_node_type(app) == PLIST_DICT) {
+			plist_to_bin(app, &batch[i]->record_bin, &batch[i]->record_length);
+			batch[i]->record = batch[i]->record_bin;
+		}
+	}
+
+leave_unlock:
+	instproxy_unlock(client);
+	if (dict)
+		plist_free(dict);
+	return res;
+}
+
+/**
+ * Hashes the client options used for a refresh (FNV-1a over their binary
+ * plist), so a change of "ApplicationType" or "ReturnAttributes" is noticed.
+ */
+static uint32_t instproxy_inventory_options_hash(plist_t client_options)
+{
+	plist_t options = (client_options) ? client_options : plist_new_dict();
+	char *bin = NULL;
+	uint32_t length = 0;
+	uint32_t hash = 2166136261U;
+	uint32_t i;
+
+	plist_to_bin(options, &bin, &length);
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)bin[i];
+		hash *= 16777619U;
+	}
+	free(bin);
+	if (options != client_options)
+		plist_free(options);
+
+	return hash;
+}
+
+/**
+ * Writes an inventory file, replacing it atomically.
+ * Items without a record are left out.
+ */
+static instproxy_error_t instproxy_inventory_write(const char *filename, uint32_t options_hash, struct instproxy_inventory_item *items, uint32_t count)
+{
+	InstproxyInventoryHeader header;
+	InstproxyInventoryEntry *entries;
+	uint64_t strings_length = 0;
+	uint64_t records_length = 0;
+	uint32_t num = 0;
+	char *tmpname;
+	FILE *f;
+	uint32_t i;
+	int res = 1;
+
+	entries = (InstproxyInventoryEntry*)malloc((count + 1) * sizeof(InstproxyInventoryEntry));
+	if (!entries)
+		return INSTPROXY_E_UNKNOWN_ERROR;
+
+	for (i = 0; i < count; i++) {
+		if (!items[i].record)
+			continue;
+		entries[num].marker = htole64(items[i].marker);
+		entries[num].record_offset = htole64(records_length);
+		entries[num].record_length = htole32(items[i].record_length);
+		entries[num].id_offset = htole32((uint32_t)strings_length);
+		strings_length += strlen(items[i].bundle_id) + 1;
+		records_length += items[i].record_length;
+		num++;
+	}
+	if (strings_length > UINT32_MAX) {
+		free(entries);
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	}
+
+	memcpy(header.magic, INSTPROXY_INVENTORY_MAGIC, INSTPROXY_INVENTORY_MAGIC_LEN);
+	header.count = htole32(num);
+	header.options_hash = htole32(options_hash);
+	header.strings_length = htole64(strings_length);
+	header.records_length = htole64(records_length);
+
+	tmpname = string_concat(filename, ".tmp", NULL);
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		debug_info("could not open %s for writing", tmpname);
+		free(tmpname);
+		free(entries);
+		return INSTPROXY_E_OP_FAILED;
+	}
+	res = (fwrite(&header, sizeof(header), 1, f) == 1);
+	if (res && num > 0)
+		res = (fwrite(entries, sizeof(InstproxyInventoryEntry), num, f) == num);
+	for (i = 0; res && i < count; i++) {
+		if (items[i].record)
+			res = (fwrite(items[i].bundle_id, 1, strlen(items[i].bundle_id) + 1, f) == strlen(items[i].bundle_id) + 1);
+	}
+	for (i = 0; res && i < count; i++) {
+		if (items[i].record && items[i].record_length > 0)
+			res = (fwrite(items[i].record, 1, items[i].record_length, f) == items[i].record_length);
+	}
+	if (fclose(f) != 0)
+		res = 0;
+	free(entries);
+
+#ifdef WIN32
+	if (res)
+		remove(filename);
+#endif
+	if (!res || rename(tmpname, filename) != 0) {
+		remove(tmpname);
+		free(tmpname);
+		return INSTPROXY_E_OP_FAILED;
+	}
+	free(tmpname);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_inventory_refresh(instproxy_client_t client, plist_t client_options, const char *filename, uint32_t *changed)
+{
+	struct instproxy_inventory_browse browse = { NULL, 0, 0, 0 };
+	struct instproxy_inventory_item **batch = NULL;
+	instproxy_inventory_t old = NULL;
+	uint32_t old_count = 0;
+	uint32_t options_hash;
+	uint32_t num_changed = 0;
+	uint32_t num_batch = 0;
+	uint32_t i = 0;
+	uint32_t j = 0;
+	int k;
+
+	if (!client || !client->parent || !filename)
+		return INSTPROXY_E_INVALID_ARG;
+
+	if (client_options && plist_get_node_type(client_options) != PLIST_DICT)
+		return INSTPROXY_E_INVALID_ARG;
+
+	options_hash = instproxy_inventory_options_hash(client_options);
+	if (instproxy_inventory_open(filename, &old) == INSTPROXY_E_SUCCESS) {
+		InstproxyInventoryHeader header;
+		if (old->data)
+			memcpy(&header, old->data, sizeof(InstproxyInventoryHeader));
+		if (!old->data || le32toh(header.options_hash) == options_hash) {
+			old_count = old->count;
+		} else {
+			/* the records hold other attributes or applications */
+			debug_info("client options changed, rebuilding inventory %s", filename);
+			instproxy_inventory_free(old);
+			old = NULL;
+		}
+	} else {
+		debug_info("rebuilding inventory %s", filename);
+		old = NULL;
+	}
+
+	/* browse only the attributes needed to detect changes */
+	plist_t browse_options = (client_options) ? plist_copy(client_options) : plist_new_dict();
+	plist_t return_attributes = plist_new_array();
+	plist_array_append_item(return_attributes, plist_new_string("CFBundleIdentifier"));
+	for (k = 0; instproxy_inventory_markers[k]; k++) {
+		plist_array_append_item(return_attributes, plist_new_string(instproxy_inventory_markers[k]));
+	}
+	plist_dict_set_item(browse_options, "ReturnAttributes", return_attributes);
+
+	instproxy_error_t res = instproxy_browse_with_callback(client, browse_options, instproxy_inventory_browse_cb, &browse);
+	plist_free(browse_options);
+	if (res == INSTPROXY_E_SUCCESS && browse.error) {
+		res = INSTPROXY_E_UNKNOWN_ERROR;
+	}
+	if (res != INSTPROXY_E_SUCCESS) {
+		goto leave;
+	}
+
+	if (browse.count > 0) {
+		qsort(browse.items, browse.count, sizeof(struct instproxy_inventory_item), instproxy_inventory_item_compare);
+		batch = (struct instproxy_inventory_item**)malloc(browse.count * sizeof(struct instproxy_inventory_item*));
+		if (!batch) {
+			res = INSTPROXY_E_UNKNOWN_ERROR;
+			goto leave;
+		}
+	}
+
+	/* both lists are sorted by bundle identifier, so a single merge pass
+	 * finds the records that can be carried over */
+	while (i < browse.count || j < old_count) {
+		const InstproxyInventoryEntry *entry = NULL;
+		int cmp;
+		if (j < old_count) {
+			entry = instproxy_inventory_get_entry(old, j);
+		}
+		if (i >= browse.count) {
+			cmp = 1;
+		} else if (j >= old_count) {
+			cmp = -1;
+		} else {
+			cmp = strcmp(browse.items[i].bundle_id, instproxy_inventory_entry_get_bundle_id(old, entry));
+		}
+		if (cmp > 0) {
+			/* removed */
+			num_changed++;
+			j++;
+			continue;
+		}
+		if (cmp == 0 && le64toh(entry->marker) == browse.items[i].marker) {
+			browse.items[i].record = instproxy_inventory_entry_get_record(old, entry);
+			browse.items[i].record_length = le32toh(entry->record_length);
+		} else {
+			batch[num_batch++] = &browse.items[i];
+			num_changed++;
+		}
+		if (cmp == 0) {
+			j++;
+		}
+		i++;
+	}
+
+	/* fetch full records only for added or changed applications */
+	for (i = 0; i < num_batch; i += INSTPROXY_INVENTORY_LOOKUP_BATCH) {
+		uint32_t n = num_batch - i;
+		if (n > INSTPROXY_INVENTORY_LOOKUP_BATCH)
+			n = INSTPROXY_INVENTORY_LOOKUP_BATCH;
+		res = instproxy_inventory_fetch(client, client_options, batch + i, n);
+		if (res != INSTPROXY_E_SUCCESS) {
+			goto leave;
+		}
+	}
+
+	debug_info("%u of %u applications changed, fetched %u records", num_changed, browse.count, num_batch);
+
+	if (!old || !old->data || num_changed > 0) {
+		res = instproxy_inventory_write(filename, options_hash, browse.items, browse.count);
+	}
+	if (res == INSTPROXY_E_SUCCESS && changed) {
+		*changed = num_changed;
+	}
+
+leave:
+	free(batch);
+	instproxy_inventory_items_free(browse.items, browse.count);
+	if (old)
+		instproxy_inventory_free(old);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_inventory_open(const char *filename, instproxy_inventory_t *inventory)
+{
+	instproxy_inventory_t inventory_loc;
+	InstproxyInventoryHeader header;
+	uint64_t strings_length;
+	uint64_t records_length;
+	uint32_t i;
+
+	if (!filename || !inventory)
+		return INSTPROXY_E_INVALID_ARG;
+
+	inventory_loc = (instproxy_inventory_t)calloc(1, sizeof(struct instproxy_inventory_private));
+	if (!inventory_loc)
+		return INSTPROXY_E_UNKNOWN_ERROR;
+
+#ifdef WIN32
+	buffer_read_from_filename(filename, &inventory_loc->data, &inventory_loc->length);
+	if (!inventory_loc->data) {
+		*inventory = inventory_loc;
+		return INSTPROXY_E_SUCCESS;
+	}
+#else
+	{
+		struct stat st;
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			/* no inventory yet */
+			*inventory = inventory_loc;
+			return INSTPROXY_E_SUCCESS;
+		}
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(InstproxyInventoryHeader)) {
+			close(fd);
+			free(inventory_loc);
+			return INSTPROXY_E_OP_FAILED;
+		}
+		inventory_loc->length = st.st_size;
+		inventory_loc->data = (char*)mmap(NULL, inventory_loc->length, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (inventory_loc->data == MAP_FAILED) {
+			free(inventory_loc);
+			return INSTPROXY_E_OP_FAILED;
+		}
+		inventory_loc->mapped = 1;
+	}
+#endif
+
+	/* validate the header, the string table and the record offsets */
+	if (inventory_loc->length < sizeof(InstproxyInventoryHeader)) {
+		instproxy_inventory_free(inventory_loc);
+		return INSTPROXY_E_OP_FAILED;
+	}
+	memcpy(&header, inventory_loc->data, sizeof(InstproxyInventoryHeader));
+	inventory_loc->count = le32toh(header.count);
+	strings_length = le64toh(header.strings_length);
+	records_length = le64toh(header.records_length);
+	if (memcmp(header.magic, INSTPROXY_INVENTORY_MAGIC, INSTPROXY_INVENTORY_MAGIC_LEN) != 0
+	    || inventory_loc->length != sizeof(InstproxyInventoryHeader) + (uint64_t)inventory_loc->count * sizeof(InstproxyInventoryEntry) + strings_length + records_length
+	    || (strings_length > 0 && inventory_loc->data[inventory_loc->length - records_length - 1] != '\0')) {
+		debug_info("%s is not a valid inventory file", filename);
+		instproxy_inventory_free(inventory_loc);
+		return INSTPROXY_E_OP_FAILED;
+	}
+	for (i = 0; i < inventory_loc->count; i++) {
+		const InstproxyInventoryEntry *entry = instproxy_inventory_get_entry(inventory_loc, i);
+		if (le32toh(entry->id_offset) >= strings_length
+		    || le64toh(entry->record_offset) > records_length
+		    || le32toh(entry->record_length) > records_length - le64toh(entry->record_offset)) {
+			instproxy_inventory_free(inventory_loc);
+			return INSTPROXY_E_OP_FAILED;
+		}
+	}
+	*inventory = inventory_loc;
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_inventory_free(instproxy_inventory_t inventory)
+{
+	if (!inventory)
+		return INSTPROXY_E_INVALID_ARG;
+
+#ifndef WIN32
+	if (inventory->mapped) {
+		munmap(inventory->data, inventory->length);
+	} else
+#endif
+	free(inventory->data);
+	free(inventory);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_inventory_get_count(instproxy_inventory_t inventory, uint32_t *count)
+{
+	if (!inventory || !count)
+		return INSTPROXY_E_INVALID_ARG;
+
+	*count = inventory->count;
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_inventory_get_bundle_identifier(instproxy_inventory_t inventory, uint32_t index, const char **bundle_id)
+{
+	if (!inventory || !bundle_id || index >= inventory->count)
+		return INSTPROXY_E_INVALID_ARG;
+
+	*bundle_id = instproxy_inventory_entry_get_bundle_id(inventory, instproxy_inventory_get_entry(inventory, index));
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_inventory_lookup(instproxy_inventory_t inventory, const char *bundle_id, plist_t *app)
+{
+	uint32_t lo = 0;
+	uint32_t hi;
+
+	if (!inventory || !bundle_id || !app)
+		return INSTPROXY_E_INVALID_ARG;
+
+	hi = inventory->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const InstproxyInventoryEntry *entry = instproxy_inventory_get_entry(inventory, mid);
+		int cmp = strcmp(bundle_id, instproxy_inventory_entry_get_bundle_id(inventory, entry));
+		if (cmp == 0) {
+			*app = NULL;
+			plist_from_bin(instproxy_inventory_entry_get_record(inventory, entry), le32toh(entry->record_length), app);
+			return (*app) ? INSTPROXY_E_SUCCESS : INSTPROXY_E_PLIST_ERROR;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return INSTPROXY_E_OP_FAILED;
+}
@@ -26,10 +26,60 @@
 #include "property_list_service.h"
 #include "common/thread.h"
 
+/* Number of threads shared by all clients to deliver status updates */
+#define INSTPROXY_EXECUTOR_THREADS (4)
+
+/* Longest time an executor thread waits for events without being woken up */
+#define INSTPROXY_EXECUTOR_POLL_TIMEOUT (100)
+
+/* Directory packages are uploaded to by instproxy_deploy() */
+#define INSTPROXY_DEPLOY_STAGING_DIR "PublicStaging"
+
+/* Size of the chunks packages are uploaded and throttled in */
+#define INSTPROXY_DEPLOY_CHUNK_SIZE (0x40000)
+
+/* Number of concurrent uploads if the caller does not choose one */
+#define INSTPROXY_DEPLOY_DEFAULT_UPLOADS (8)
+
+struct instproxy_status_job;
+
 struct instproxy_client_private {
 	property_list_service_client_t parent;
 	mutex_t mutex;
 	thread_t status_updater;
+	struct instproxy_status_job *status_job;
+	uint32_t status_interval;
+};
+
+/* On-disk format of application inventories, all values little endian */
+#define INSTPROXY_INVENTORY_MAGIC "IPINVEN1"
+#define INSTPROXY_INVENTORY_MAGIC_LEN (8)
+
+/* Number of applications requested per Lookup command during a refresh */
+#define INSTPROXY_INVENTORY_LOOKUP_BATCH (64)
+
+/* options_hash identifies the client options the records were fetched
+ * with, records are only carried over while they stay the same */
+typedef struct {
+	char magic[INSTPROXY_INVENTORY_MAGIC_LEN];
+	uint32_t count, options_hash;
+	uint64_t strings_length;
+	uint64_t records_length;
+} InstproxyInventoryHeader;
+
+/* followed by count entries sorted by bundle identifier, the NUL terminated
+ * bundle identifiers, then the binary plist record of every application */
+typedef struct {
+	uint64_t marker;
+	uint64_t record_offset;
+	uint32_t record_length, id_offset;
+} InstproxyInventoryEntry;
+
+struct instproxy_inventory_private {
+	char *data;
+	uint64_t length;
+	uint32_t count;
+	int mapped;
 };
 
 #endif
@@ -22,16 +22,20 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#ifdef WIN32
+#include <winsock2.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <fcntl.h>
+#endif
 #include <plist/plist.h>
 
 #include "notification_proxy.h"
 #include "property_list_service.h"
 #include "common/debug.h"
 
-#ifdef WIN32
-#define sleep(x) Sleep(x*1000)
-#endif
-
 struct np_thread {
 	np_client_t client;
 	np_notify_cb_t cbfunc;
@@ -86,6 +90,54 @@ static np_error_t np_error(property_list_service_error_t err)
 	return NP_E_UNKNOWN_ERROR;
 }
 
+/**
+ * Gets the socket of a client's connection if it can be polled for
+ * notifications. SSL connections may buffer data and are therefore excluded.
+ *
+ * @return The socket or -1.
+ */
+static int np_get_fd(np_client_t client)
+{
+	idevice_connection_t connection = client->parent->parent->connection;
+	int fd = -1;
+
+	if (connection->ssl_data || idevice_connection_get_fd(connection, &fd) != IDEVICE_E_SUCCESS) {
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Creates the pipe used to wake up the notifier thread when it should stop.
+ */
+static void np_open_wakeup(np_client_t client)
+{
+	client->wakeup_fds[0] = -1;
+	client->wakeup_fds[1] = -1;
+#ifndef WIN32
+	if (pipe(client->wakeup_fds) != 0) {
+		debug_info("could not create wakeup pipe: %s", strerror(errno));
+		client->wakeup_fds[0] = -1;
+		client->wakeup_fds[1] = -1;
+		return;
+	}
+	fcntl(client->wakeup_fds[1], F_SETFL, fcntl(client->wakeup_fds[1], F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+static void np_close_wakeup(np_client_t client)
+{
+#ifndef WIN32
+	if (client->wakeup_fds[0] >= 0) {
+		close(client->wakeup_fds[0]);
+		close(client->wakeup_fds[1]);
+	}
+#endif
+	client->wakeup_fds[0] = -1;
+	client->wakeup_fds[1] = -1;
+}
+
 LIBIMOBILEDEVICE_API np_error_t np_client_new(idevice_t device, lockdownd_service_descriptor_t service, np_client_t *client)
 {
 	property_list_service_client_t plistclient = NULL;
@@ -99,6 +151,9 @@ LIBIMOBILEDEVICE_API np_error_t np_client_new(idevice_t device, lockdownd_servic
 
 	mutex_init(&client_loc->mutex);
 	client_loc->notifier = (thread_t)NULL;
+	client_loc->notifier_stop = 0;
+	client_loc->wakeup_fds[0] = -1;
+	client_loc->wakeup_fds[1] = -1;
 
 	*client = client_loc;
 	return NP_E_SUCCESS;
@@ -126,6 +181,7 @@ LIBIMOBILEDEVICE_API np_error_t np_client_free(np_client_t client)
 	if (client->notifier) {
 		debug_info("joining np callback");
 		thread_join(client->notifier);
+		np_close_wakeup(client);
 	} else {
 		dict = NULL;
 		property_list_service_receive_plist(client->parent, &dict);
@@ -232,6 +288,7 @@ LIBIMOBILEDEVICE_API np_error_t np_observe_notifications(np_client_t client, con
  * @param client NP to get a notification from
  * @param notification Pointer to a buffer that will be allocated and filled
  *  with the notification that has been received.
+ * @param timeout Maximum time in milliseconds to wait for a notification.
  *
  * @return 0 if a notification has been received or nothing has been received,
  *         or a negative value if an error occured.
@@ -239,7 +296,7 @@ LIBIMOBILEDEVICE_API np_error_t np_observe_notifications(np_client_t client, con
  * @note You probably want to check out np_set_notify_callback
  * @see np_set_notify_callback
  */
-static int np_get_notification(np_client_t client, char **notification)
+static int np_get_notification(np_client_t client, char **notification, unsigned int timeout)
 {
 	int res = 0;
 	plist_t dict = NULL;
@@ -249,7 +306,7 @@ static int np_get_notification(np_client_t client, char **notification)
 
 	np_lock(client);
 
-	property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(client->parent, &dict, 500);
+	property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(client->parent, &dict, timeout);
 	if (perr == PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT) {
 		debug_info("NotificationProxy: no notification received!");
 		res = 0;
@@ -300,19 +357,78 @@ static int np_get_notification(np_client_t client, char **notification)
 	return res;
 }
 
+/**
+ * Asks the notifier thread to stop and waits for it to exit.
+ * Must not be called with the client locked.
+ */
+static void np_stop_notifier(np_client_t client)
+{
+	client->notifier_stop = 1;
+#ifndef WIN32
+	if (client->wakeup_fds[1] >= 0) {
+		char c = 0;
+		if (write(client->wakeup_fds[1], &c, 1) < 0) {
+			debug_info("could not wake up notifier");
+		}
+	}
+#endif
+	thread_join(client->notifier);
+	client->notifier = (thread_t)NULL;
+	client->notifier_stop = 0;
+	np_close_wakeup(client);
+}
+
 /**
  * Internally used thread function.
+ * Waits for the connection to become readable without holding the client
+ * lock and passes every notification to the callback as soon as it arrives.
  */
 void* np_notifier( void* arg )
 {
 	char *notification = NULL;
 	struct np_thread *npt = (struct np_thread*)arg;
+	np_client_t client;
+	int fd;
 
 	if (!npt) return NULL;
 
+	client = npt->client;
+	fd = np_get_fd(client);
+
 	debug_info("starting callback.");
-	while (npt->client->parent) {
-		if (np_get_notification(npt->client, &notification) < 0) {
+	while (!client->notifier_stop) {
+		unsigned int timeout = NP_RECEIVE_TIMEOUT;
+		if (fd >= 0) {
+			struct pollfd fds[2];
+			int num = 1;
+			int poll_timeout = -1;
+			fds[0].fd = fd;
+			fds[0].events = POLLIN;
+			fds[0].revents = 0;
+			if (client->wakeup_fds[0] >= 0) {
+				fds[1].fd = client->wakeup_fds[0];
+				fds[1].events = POLLIN;
+				fds[1].revents = 0;
+				num++;
+			} else {
+				poll_timeout = NP_NOTIFIER_POLL_TIMEOUT;
+			}
+			if (poll(fds, num, poll_timeout) < 0) {
+				if (errno == EINTR)
+					continue;
+				debug_info("poll failed: %s", strerror(errno));
+				npt->cbfunc("", npt->user_data);
+				break;
+			}
+			if (client->notifier_stop)
+				break;
+			if (!(fds[0].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)))
+				continue;
+		} else {
+			/* keep the lock only briefly so other requests can get through */
+			timeout = NP_NOTIFIER_POLL_TIMEOUT;
+		}
+		if (np_get_notification(client, &notification, timeout) < 0) {
 			npt->cbfunc("", npt->user_data);
 			break;
 		}
@@ -321,7 +437,6 @@ void* np_notifier( void* arg )
 			free(notification);
 			notification = NULL;
 		}
-		sleep(1);
 	}
 	if (npt) {
 		free(npt);
@@ -337,16 +452,12 @@ LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_n
 
 	np_error_t res = NP_E_UNKNOWN_ERROR;
 
-	np_lock(client);
 	if (client->notifier) {
 		debug_info("callback already set, removing");
-		property_list_service_client_t parent = client->parent;
-		client->parent = NULL;
-		thread_join(client->notifier);
-		client->notifier = (thread_t)NULL;
-		client->parent = parent;
+		np_stop_notifier(client);
 	}
 
+	np_lock(client);
 	if (notify_cb) {
 		struct np_thread *npt = (struct np_thread*)malloc(sizeof(struct np_thread));
 		if (npt) {
@@ -354,8 +465,13 @@ LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_n
 			npt->cbfunc = notify_cb;
 			npt->user_data = user_data;
 
+			np_open_wakeup(client);
 			if (thread_create(&client->notifier, np_notifier, npt) == 0) {
 				res = NP_E_SUCCESS;
+			} else {
+				client->notifier = (thread_t)NULL;
+				np_close_wakeup(client);
+				free(npt);
 			}
 		}
 	} else {
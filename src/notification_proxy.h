@@ -26,10 +26,19 @@
 #include "property_list_service.h"
 #include "common/thread.h"
 
+/* Time to wait for the rest of a notification once data has arrived */
+#define NP_RECEIVE_TIMEOUT (500)
+
+/* Longest time the notifier waits without checking whether it should stop,
+ * used where it cannot be woken up and for connections that cannot be polled */
+#define NP_NOTIFIER_POLL_TIMEOUT (100)
+
 struct np_client_private {
 	property_list_service_client_t parent;
 	mutex_t mutex;
 	thread_t notifier;
+	int notifier_stop;
+	int wakeup_fds[2];
 };
 
 void* np_notifier(void* arg);
@@ -22,16 +22,39 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef WIN32
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 #include "syslog_relay.h"
 #include "lockdown.h"
 #include "common/debug.h"
+#include "common/utils.h"
+#include "endianness.h"
+
+/* the queue indices are shared between the receiving and delivering thread */
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ATOMIC_CAS(ptr, oldval, newval) __extension__ ({ __typeof__(*(ptr)) __expected = (oldval); __atomic_compare_exchange_n((ptr), &__expected, (newval), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#define ATOMIC_ADD(ptr, val) __atomic_add_fetch((ptr), (val), __ATOMIC_RELAXED)
 
 struct syslog_relay_worker_thread {
 	syslog_relay_client_t client;
 	syslog_relay_receive_cb_t cbfunc;
+	syslog_relay_receive_lines_cb_t lines_cbfunc;
+	syslog_relay_receive_records_cb_t records_cbfunc;
 	void *user_data;
 };
 
@@ -82,6 +105,12 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_client_new(idevice_t devi
 	syslog_relay_client_t client_loc = (syslog_relay_client_t) malloc(sizeof(struct syslog_relay_client_private));
 	client_loc->parent = parent;
 	client_loc->worker = (thread_t)NULL;
+	memset(&client_loc->filter, 0, sizeof(struct syslog_relay_filter));
+	client_loc->filter.pid_max = UINT32_MAX;
+	client_loc->filter.level = SYSLOG_RELAY_LEVEL_UNKNOWN;
+	memset(&client_loc->queue, 0, sizeof(struct syslog_relay_queue));
+	mutex_init(&client_loc->queue.mutex);
+	cond_init(&client_loc->queue.cond);
 
 	*client = client_loc;
 
@@ -106,7 +135,11 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_client_free(syslog_relay_
 	if (client->worker) {
 		debug_info("Joining syslog capture callback worker thread");
 		thread_join(client->worker);
+		client->worker = (thread_t)NULL;
 	}
+	syslog_relay_filter_clear(client);
+	mutex_destroy(&client->queue.mutex);
+	cond_destroy(&client->queue.cond);
 	free(client);
 
 	return err;
@@ -137,45 +170,386 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_receive_with_timeout(sysl
 	return res;
 }
 
+/**
+ * Finds a string in a buffer that is not NUL terminated.
+ */
+static int syslog_relay_contains(const char *haystack, uint32_t length, const char *needle, uint32_t needle_length)
+{
+	const char *end;
+	const char *p;
+
+	if (needle_length == 0)
+		return 1;
+	if (needle_length > length)
+		return 0;
+
+	end = haystack + length - needle_length;
+	for (p = haystack; p <= end; p++) {
+		p = (const char*)memchr(p, needle[0], end - p + 1);
+		if (!p)
+			return 0;
+		if (memcmp(p, needle, needle_length) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Checks a parsed line against the filters of a client.
+ *
+ * @return 1 if the line passes all filters, 0 otherwise.
+ */
+static int syslog_relay_filter_match(struct syslog_relay_filter *filter, const struct syslog_relay_record *record)
+{
+	uint32_t i;
+
+	if (filter->level != SYSLOG_RELAY_LEVEL_UNKNOWN && record->level > filter->level)
+		return 0;
+	if (record->pid < filter->pid_min || record->pid > filter->pid_max)
+		return 0;
+	if (filter->num_processes > 0) {
+		for (i = 0; i < filter->num_processes; i++) {
+			if (strlen(filter->processes[i]) == record->process_length && memcmp(filter->processes[i], record->process, record->process_length) == 0)
+				break;
+		}
+		if (i == filter->num_processes)
+			return 0;
+	}
+	if (filter->num_substrings > 0) {
+		for (i = 0; i < filter->num_substrings; i++) {
+			if (syslog_relay_contains(record->message, record->message_length, filter->substrings[i], strlen(filter->substrings[i])))
+				break;
+		}
+		if (i == filter->num_substrings)
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Calls the capture callback for a line, or for a block of raw data when
+ * capturing characters.
+ */
+static void syslog_relay_invoke(struct syslog_relay_worker_thread *srwt, const char *line, uint32_t length, const struct syslog_relay_record *record)
+{
+	struct syslog_relay_record record_loc;
+	uint32_t i;
+
+	if (srwt->cbfunc) {
+		for (i = 0; i < length; i++) {
+			if (line[i] != 0) {
+				srwt->cbfunc(line[i], srwt->user_data);
+			}
+		}
+	} else if (srwt->records_cbfunc) {
+		if (!record) {
+			syslog_relay_parse_line(line, length, &record_loc);
+			record = &record_loc;
+		}
+		srwt->records_cbfunc(record, srwt->user_data);
+	} else {
+		srwt->lines_cbfunc(line, length, srwt->user_data);
+	}
+}
+
+/**
+ * Wakes up the other thread of a queue if it is waiting. Called after
+ * moving the head or tail, and checks for waiting threads under the mutex,
+ * so the wakeup cannot get lost while the other thread is going to sleep.
+ * Both threads can be waiting for a moment, as the one that was woken up
+ * only leaves the wait after getting the mutex back, so wake up both.
+ */
+static void syslog_relay_queue_wakeup(struct syslog_relay_queue *queue)
+{
+	mutex_lock(&queue->mutex);
+	if (queue->waiting > 0)
+		cond_broadcast(&queue->cond);
+	mutex_unlock(&queue->mutex);
+}
+
+/**
+ * Waits until the other thread of a queue moved a position away from the
+ * value the caller has seen, or until the queue is done.
+ *
+ * @param queue The queue to wait on.
+ * @param pos The head or tail of the queue.
+ * @param seen The value of pos the caller has seen.
+ */
+static void syslog_relay_queue_wait(struct syslog_relay_queue *queue, uint64_t *pos, uint64_t seen)
+{
+	mutex_lock(&queue->mutex);
+	queue->waiting++;
+	while (ATOMIC_LOAD(pos) == seen && !ATOMIC_LOAD(&queue->done)) {
+		cond_wait(&queue->cond, &queue->mutex);
+	}
+	queue->waiting--;
+	mutex_unlock(&queue->mutex);
+}
+
+static void syslog_relay_queue_copy_in(struct syslog_relay_queue *queue, uint64_t pos, const char *data, uint32_t length)
+{
+	uint32_t offset = pos % queue->capacity;
+	uint32_t first = queue->capacity - offset;
+
+	if (first >= length) {
+		memcpy(queue->data + offset, data, length);
+	} else {
+		memcpy(queue->data + offset, data, first);
+		memcpy(queue->data, data + first, length - first);
+	}
+}
+
+static void syslog_relay_queue_copy_out(struct syslog_relay_queue *queue, uint64_t pos, char *data, uint32_t length)
+{
+	uint32_t offset = pos % queue->capacity;
+	uint32_t first = queue->capacity - offset;
+
+	if (first >= length) {
+		memcpy(data, queue->data + offset, length);
+	} else {
+		memcpy(data, queue->data + offset, first);
+		memcpy(data + first, queue->data, length - first);
+	}
+}
+
+/**
+ * Puts a line into the queue, applying the queue policy if it is full.
+ * Called by the receiving thread only.
+ */
+static void syslog_relay_queue_push(struct syslog_relay_worker_thread *srwt, const char *line, uint32_t length)
+{
+	struct syslog_relay_queue *queue = &srwt->client->queue;
+	uint32_t needed = sizeof(uint32_t) + length;
+	uint64_t head = queue->head;
+	uint64_t tail;
+	uint32_t used;
+
+	while (1) {
+		tail = ATOMIC_LOAD(&queue->tail);
+		if (head - tail + needed <= queue->capacity)
+			break;
+		if (queue->policy == SYSLOG_RELAY_QUEUE_DROP_NEWEST) {
+			ATOMIC_ADD(&queue->lines_dropped, 1);
+			return;
+		} else if (queue->policy == SYSLOG_RELAY_QUEUE_DROP_OLDEST) {
+			uint32_t oldest = 0;
+			syslog_relay_queue_copy_out(queue, tail, (char*)&oldest, sizeof(uint32_t));
+			/* fails if the delivering thread took the entry meanwhile */
+			if (ATOMIC_CAS(&queue->tail, tail, tail + sizeof(uint32_t) + oldest)) {
+				ATOMIC_ADD(&queue->lines_dropped, 1);
+			}
+		} else {
+			if (!srwt->client->parent)
+				return;
+			syslog_relay_queue_wait(queue, &queue->tail, tail);
+		}
+	}
+
+	syslog_relay_queue_copy_in(queue, head, (const char*)&length, sizeof(uint32_t));
+	syslog_relay_queue_copy_in(queue, head + sizeof(uint32_t), line, length);
+	ATOMIC_STORE(&queue->head, head + needed);
+
+	used = (uint32_t)(head + needed - tail);
+	if (used > queue->high_water)
+		ATOMIC_STORE(&queue->high_water, used);
+
+	syslog_relay_queue_wakeup(queue);
+}
+
+/**
+ * Delivers the lines put into the queue by the receiving thread.
+ */
+static void *syslog_relay_delivery_worker(void *arg)
+{
+	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)arg;
+	struct syslog_relay_queue *queue = &srwt->client->queue;
+	char *line = (char*)malloc(SYSLOG_RELAY_BUFFER_SIZE + 1);
+
+	if (!line)
+		return NULL;
+
+	while (1) {
+		uint64_t tail = ATOMIC_LOAD(&queue->tail);
+		uint64_t head = ATOMIC_LOAD(&queue->head);
+		uint32_t length = 0;
+
+		if (tail == head) {
+			if (ATOMIC_LOAD(&queue->done) && ATOMIC_LOAD(&queue->head) == tail)
+				break;
+			syslog_relay_queue_wait(queue, &queue->head, head);
+			continue;
+		}
+
+		/* copy the entry out first, as the receiving thread may drop it
+		 * when the queue is full, and only deliver it if we got it */
+		syslog_relay_queue_copy_out(queue, tail, (char*)&length, sizeof(uint32_t));
+		if (length > SYSLOG_RELAY_BUFFER_SIZE)
+			continue;
+		syslog_relay_queue_copy_out(queue, tail + sizeof(uint32_t), line, length);
+		if (!ATOMIC_CAS(&queue->tail, tail, tail + sizeof(uint32_t) + length))
+			continue;
+		syslog_relay_queue_wakeup(queue);
+
+		line[length] = '\0';
+		syslog_relay_invoke(srwt, line, length, NULL);
+	}
+
+	free(line);
+
+	return NULL;
+}
+
+/**
+ * Passes a complete line to the callback of the capture thread, after
+ * filtering it if required.
+ */
+static void syslog_relay_deliver_line(struct syslog_relay_worker_thread *srwt, const char *line, uint32_t length)
+{
+	struct syslog_relay_record record;
+	int parsed = 0;
+
+	if (srwt->client->filter.active) {
+		syslog_relay_parse_line(line, length, &record);
+		if (!syslog_relay_filter_match(&srwt->client->filter, &record))
+			return;
+		parsed = 1;
+	}
+
+	if (srwt->client->queue.data) {
+		syslog_relay_queue_push(srwt, line, length);
+	} else {
+		syslog_relay_invoke(srwt, line, length, (parsed) ? &record : NULL);
+	}
+}
+
+/**
+ * Splits the data received by the capture thread into lines and delivers
+ * them. Each line is terminated in place, so the callback gets a NUL
+ * terminated string without any copying.
+ *
+ * @param srwt The worker thread data.
+ * @param buffer The buffer holding the data, with room for one extra byte.
+ * @param length The number of bytes in the buffer.
+ * @param flush Whether to deliver an incomplete line at the end as well.
+ *
+ * @return The number of bytes at the end of the buffer that belong to an
+ *     incomplete line.
+ */
+static uint32_t syslog_relay_dispatch_lines(struct syslog_relay_worker_thread *srwt, char *buffer, uint32_t length, int flush)
+{
+	uint32_t start = 0;
+	uint32_t i;
+
+	for (i = 0; i < length; i++) {
+		if (buffer[i] == '\n' || (buffer[i] == '\0' && i > start)) {
+			buffer[i] = '\0';
+			syslog_relay_deliver_line(srwt, buffer + start, i - start);
+			start = i + 1;
+		} else if (buffer[i] == '\0') {
+			/* skip the NUL following a newline */
+			start = i + 1;
+		}
+	}
+	if (flush && start < length) {
+		buffer[length] = '\0';
+		syslog_relay_deliver_line(srwt, buffer + start, length - start);
+		start = length;
+	}
+
+	return length - start;
+}
+
 void *syslog_relay_worker(void *arg)
 {
 	syslog_relay_error_t ret = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)arg;
+	struct syslog_relay_queue *queue;
+	thread_t delivery = (thread_t)NULL;
+	char *buffer = NULL;
+	uint32_t length = 0;
 
 	if (!srwt)
 		return NULL;
 
 	debug_info("Running");
 
+	/* one extra byte to terminate the last line in place */
+	buffer = (char*)malloc(SYSLOG_RELAY_BUFFER_SIZE + 1);
+	if (!buffer) {
+		free(srwt);
+		return NULL;
+	}
+
+	queue = &srwt->client->queue;
+	if (queue->capacity > 0) {
+		queue->head = 0;
+		queue->tail = 0;
+		queue->lines_dropped = 0;
+		queue->high_water = 0;
+		queue->waiting = 0;
+		queue->done = 0;
+		queue->data = (char*)malloc(queue->capacity);
+		if (queue->data && thread_create(&delivery, syslog_relay_delivery_worker, srwt) != 0) {
+			free(queue->data);
+			queue->data = NULL;
+		}
+		if (!queue->data) {
+			debug_info("Could not set up queue, delivering synchronously");
+		}
+	}
+
 	while (srwt->client->parent) {
-		char c;
 		uint32_t bytes = 0;
-		ret = syslog_relay_receive_with_timeout(srwt->client, &c, 1, &bytes, 100);
+		ret = syslog_relay_receive_with_timeout(srwt->client, buffer + length, SYSLOG_RELAY_BUFFER_SIZE - length, &bytes, 100);
 		if ((bytes == 0) && (ret == SYSLOG_RELAY_E_SUCCESS)) {
 			continue;
 		} else if (ret < 0) {
 			debug_info("Connection to syslog relay interrupted");
 			break;
 		}
-		if(c != 0) {
-			srwt->cbfunc(c, srwt->user_data);
+		if (!srwt->cbfunc) {
+			uint32_t remaining = syslog_relay_dispatch_lines(srwt, buffer, length + bytes, (length + bytes == SYSLOG_RELAY_BUFFER_SIZE));
+			/* keep the incomplete line for the next read */
+			if (remaining > 0 && remaining < length + bytes)
+				memmove(buffer, buffer + length + bytes - remaining, remaining);
+			length = remaining;
+		} else if (queue->data) {
+			syslog_relay_queue_push(srwt, buffer, bytes);
+		} else {
+			syslog_relay_invoke(srwt, buffer, bytes, NULL);
 		}
 	}
 
-	if (srwt) {
-		free(srwt);
+	if (!srwt->cbfunc && length > 0) {
+		syslog_relay_dispatch_lines(srwt, buffer, length, 1);
+	}
+
+	if (queue->data) {
+		/* let the delivery thread drain the queue and exit */
+		ATOMIC_STORE(&queue->done, 1);
+		mutex_lock(&queue->mutex);
+		cond_signal(&queue->cond);
+		mutex_unlock(&queue->mutex);
+		thread_join(delivery);
+		free(queue->data);
+		queue->data = NULL;
 	}
 
+	free(buffer);
+	free(srwt);
+
 	debug_info("Exiting");
 
 	return NULL;
 }
 
-LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+/**
+ * Starts the capture thread with either a character or a lines callback.
+ */
+static syslog_relay_error_t syslog_relay_start_capture_internal(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, syslog_relay_receive_lines_cb_t lines_callback, syslog_relay_receive_records_cb_t records_callback, void* user_data)
 {
-	if (!client || !callback)
-		return SYSLOG_RELAY_E_INVALID_ARG;
-
 	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 
 	if (client->worker) {
@@ -188,16 +562,44 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_rela
 	if (srwt) {
 		srwt->client = client;
 		srwt->cbfunc = callback;
+		srwt->lines_cbfunc = lines_callback;
+		srwt->records_cbfunc = records_callback;
 		srwt->user_data = user_data;
 
 		if (thread_create(&client->worker, syslog_relay_worker, srwt) == 0) {
 			res = SYSLOG_RELAY_E_SUCCESS;
+		} else {
+			free(srwt);
 		}
 	}
 
 	return res;
 }
 
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_capture_internal(client, callback, NULL, NULL, user_data);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_receive_lines_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_capture_internal(client, NULL, callback, NULL, user_data);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_records(syslog_relay_client_t client, syslog_relay_receive_records_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_capture_internal(client, NULL, NULL, callback, user_data);
+}
+
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client)
 {
 	if (client->worker) {
@@ -211,4 +613,629 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_stop_capture(syslog_relay
 	}
 
 	return SYSLOG_RELAY_E_SUCCESS;
-}
\ No newline at end of file
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_set_queue(syslog_relay_client_t client, uint32_t capacity, syslog_relay_queue_policy_t policy)
+{
+	if (!client || policy < SYSLOG_RELAY_QUEUE_BLOCK || policy > SYSLOG_RELAY_QUEUE_DROP_NEWEST)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	if (client->worker)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	if (capacity > 0 && capacity < SYSLOG_RELAY_BUFFER_SIZE + sizeof(uint32_t))
+		capacity = SYSLOG_RELAY_BUFFER_SIZE + sizeof(uint32_t);
+	client->queue.capacity = capacity;
+	client->queue.policy = policy;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_get_queue_stats(syslog_relay_client_t client, uint64_t *lines_dropped, uint32_t *high_water)
+{
+	if (!client)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (lines_dropped)
+		*lines_dropped = ATOMIC_LOAD(&client->queue.lines_dropped);
+	if (high_water)
+		*high_water = ATOMIC_LOAD(&client->queue.high_water);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+/**
+ * Updates whether any filter of a client is set.
+ */
+static void syslog_relay_filter_update(struct syslog_relay_filter *filter)
+{
+	filter->active = (filter->num_processes > 0 || filter->num_substrings > 0
+		|| filter->pid_min > 0 || filter->pid_max < UINT32_MAX
+		|| filter->level != SYSLOG_RELAY_LEVEL_UNKNOWN);
+}
+
+/**
+ * Appends a copy of a string to a filter list.
+ */
+static syslog_relay_error_t syslog_relay_filter_list_add(char ***list, uint32_t *count, const char *str)
+{
+	char **newlist = (char**)realloc(*list, (*count + 1) * sizeof(char*));
+	if (!newlist)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	*list = newlist;
+	newlist[*count] = strdup(str);
+	if (!newlist[*count])
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	(*count)++;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_add_process(syslog_relay_client_t client, const char *process)
+{
+	syslog_relay_error_t res;
+
+	if (!client || !process)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	if (client->worker)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	res = syslog_relay_filter_list_add(&client->filter.processes, &client->filter.num_processes, process);
+	syslog_relay_filter_update(&client->filter);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_set_pid_range(syslog_relay_client_t client, uint32_t pid_min, uint32_t pid_max)
+{
+	if (!client || pid_min > pid_max)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	if (client->worker)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	client->filter.pid_min = pid_min;
+	client->filter.pid_max = pid_max;
+	syslog_relay_filter_update(&client->filter);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_set_level(syslog_relay_client_t client, syslog_relay_level_t level)
+{
+	if (!client || level < SYSLOG_RELAY_LEVEL_EMERGENCY || level > SYSLOG_RELAY_LEVEL_UNKNOWN)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	if (client->worker)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	client->filter.level = level;
+	syslog_relay_filter_update(&client->filter);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_add_substring(syslog_relay_client_t client, const char *substring)
+{
+	syslog_relay_error_t res;
+
+	if (!client || !substring)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	if (client->worker)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	res = syslog_relay_filter_list_add(&client->filter.substrings, &client->filter.num_substrings, substring);
+	syslog_relay_filter_update(&client->filter);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_filter_clear(syslog_relay_client_t client)
+{
+	uint32_t i;
+
+	if (!client)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	if (client->worker)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	for (i = 0; i < client->filter.num_processes; i++) {
+		free(client->filter.processes[i]);
+	}
+	free(client->filter.processes);
+	for (i = 0; i < client->filter.num_substrings; i++) {
+		free(client->filter.substrings[i]);
+	}
+	free(client->filter.substrings);
+	memset(&client->filter, 0, sizeof(struct syslog_relay_filter));
+	client->filter.pid_max = UINT32_MAX;
+	client->filter.level = SYSLOG_RELAY_LEVEL_UNKNOWN;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+static const struct {
+	const char *name;
+	uint32_t length;
+	syslog_relay_level_t level;
+} syslog_relay_levels[] = {
+	{ "<Emergency>:", 12, SYSLOG_RELAY_LEVEL_EMERGENCY },
+	{ "<Alert>:", 8, SYSLOG_RELAY_LEVEL_ALERT },
+	{ "<Critical>:", 11, SYSLOG_RELAY_LEVEL_CRITICAL },
+	{ "<Error>:", 8, SYSLOG_RELAY_LEVEL_ERROR },
+	{ "<Warning>:", 10, SYSLOG_RELAY_LEVEL_WARNING },
+	{ "<Notice>:", 9, SYSLOG_RELAY_LEVEL_NOTICE },
+	{ "<Info>:", 7, SYSLOG_RELAY_LEVEL_INFO },
+	{ "<Debug>:", 8, SYSLOG_RELAY_LEVEL_DEBUG },
+	{ NULL, 0, SYSLOG_RELAY_LEVEL_UNKNOWN }
+};
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_parse_line(const char *line, uint32_t length, struct syslog_relay_record *record)
+{
+	const char *p;
+	const char *end;
+	const char *token;
+	const char *bracket;
+	int i;
+
+	if (!line || !record)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	memset(record, 0, sizeof(struct syslog_relay_record));
+	record->line = line;
+	record->line_length = length;
+	record->level = SYSLOG_RELAY_LEVEL_UNKNOWN;
+	record->message = line;
+	record->message_length = length;
+
+	/* "Mmm dd hh:mm:ss device process[pid] <Level>: message" */
+	if (length < 16 || line[3] != ' ' || line[6] != ' ' || line[9] != ':' || line[12] != ':' || line[15] != ' ')
+		return SYSLOG_RELAY_E_SUCCESS;
+
+	end = line + length;
+	p = line + 16;
+
+	/* device name */
+	token = p;
+	p = (const char*)memchr(p, ' ', end - p);
+	if (!p)
+		return SYSLOG_RELAY_E_SUCCESS;
+	record->timestamp = line;
+	record->timestamp_length = 15;
+	record->device_name = token;
+	record->device_name_length = p - token;
+
+	/* process name, optional subsystem and pid */
+	token = ++p;
+	p = (const char*)memchr(p, ' ', end - p);
+	if (!p)
+		p = end;
+	bracket = token;
+	while (bracket < p && *bracket != '(' && *bracket != '[')
+		bracket++;
+	record->process = token;
+	record->process_length = bracket - token;
+	if (p > token && *(p-1) == ']') {
+		const char *pid = p - 2;
+		while (pid > token && *pid >= '0' && *pid <= '9')
+			pid--;
+		if (*pid == '[') {
+			for (pid++; pid < p - 1; pid++)
+				record->pid = record->pid * 10 + (*pid - '0');
+		}
+	}
+	if (p == end) {
+		record->message = end;
+		record->message_length = 0;
+		return SYSLOG_RELAY_E_SUCCESS;
+	}
+
+	/* level */
+	p++;
+	for (i = 0; syslog_relay_levels[i].name; i++) {
+		if ((uint32_t)(end - p) >= syslog_relay_levels[i].length && memcmp(p, syslog_relay_levels[i].name, syslog_relay_levels[i].length) == 0) {
+			record->level = syslog_relay_levels[i].level;
+			p += syslog_relay_levels[i].length;
+			if (p < end && *p == ' ')
+				p++;
+			break;
+		}
+	}
+
+	record->message = p;
+	record->message_length = end - p;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+/**
+ * Returns the current time in milliseconds since epoch.
+ */
+static uint64_t syslog_relay_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+static int syslog_relay_write_fully(int fd, const char *data, uint32_t length)
+{
+	while (length > 0) {
+		ssize_t res = write(fd, data, length);
+		if (res <= 0)
+			return -1;
+		data += res;
+		length -= res;
+	}
+	return 0;
+}
+
+/**
+ * Writes out the buffered data of the current segment.
+ */
+static syslog_relay_error_t syslog_relay_archive_write_buffer(syslog_relay_archive_t archive)
+{
+	syslog_relay_error_t res = SYSLOG_RELAY_E_SUCCESS;
+
+	if (archive->fd >= 0 && archive->buffer_length > 0) {
+		if (syslog_relay_write_fully(archive->fd, archive->buffer, archive->buffer_length) < 0) {
+			debug_info("Could not write archive segment");
+			res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
+		}
+	}
+	archive->buffer_length = 0;
+	archive->last_flush = syslog_relay_time_ms();
+
+	return res;
+}
+
+/**
+ * Completes the current segment of an archive, if any.
+ */
+static syslog_relay_error_t syslog_relay_archive_finish_segment(syslog_relay_archive_t archive)
+{
+	syslog_relay_error_t res;
+
+	if (archive->fd < 0)
+		return SYSLOG_RELAY_E_SUCCESS;
+
+	res = syslog_relay_archive_write_buffer(archive);
+	if (fsync(archive->fd) != 0 || fsync(archive->index_fd) != 0)
+		res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	close(archive->fd);
+	close(archive->index_fd);
+	archive->fd = -1;
+	archive->index_fd = -1;
+
+	return res;
+}
+
+/**
+ * Completes a segment that could not be written completely, so the offsets
+ * in the index of the next segment match its file again.
+ */
+static void syslog_relay_archive_abort_segment(syslog_relay_archive_t archive)
+{
+	debug_info("Could not write archive segment, starting a new one");
+	archive->buffer_length = 0;
+	syslog_relay_archive_finish_segment(archive);
+}
+
+/**
+ * Starts a new segment of an archive. Segment files are named by their
+ * start time, so they sort chronologically.
+ */
+static syslog_relay_error_t syslog_relay_archive_start_segment(syslog_relay_archive_t archive, uint64_t now)
+{
+	char name[32];
+	char *path;
+	char *index_path;
+
+	/* keep names unique when segments are rotated quickly */
+	if (now <= archive->segment_start)
+		now = archive->segment_start + 1;
+
+	snprintf(name, sizeof(name), "%013llu.log", (unsigned long long)now);
+	path = string_build_path(archive->directory, name, NULL);
+	snprintf(name, sizeof(name), "%013llu.idx", (unsigned long long)now);
+	index_path = string_build_path(archive->directory, name, NULL);
+
+	archive->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	archive->index_fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	free(path);
+	free(index_path);
+	if (archive->fd < 0 || archive->index_fd < 0) {
+		debug_info("Could not create archive segment in %s", archive->directory);
+		if (archive->fd >= 0)
+			close(archive->fd);
+		if (archive->index_fd >= 0)
+			close(archive->index_fd);
+		archive->fd = -1;
+		archive->index_fd = -1;
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	archive->segment_start = now;
+	archive->segment_size = 0;
+	archive->next_index_offset = 0;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_archive_open(const char *directory, uint64_t max_segment_size, uint32_t max_segment_time, syslog_relay_archive_t *archive)
+{
+	syslog_relay_archive_t archive_loc;
+	struct stat st;
+
+	if (!directory || !archive)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (stat(directory, &st) != 0) {
+#ifdef WIN32
+		mkdir(directory);
+#else
+		mkdir(directory, 0755);
+#endif
+		if (stat(directory, &st) != 0 || !S_ISDIR(st.st_mode)) {
+			debug_info("Could not create archive directory %s", directory);
+			return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+		}
+	}
+
+	archive_loc = (syslog_relay_archive_t)calloc(1, sizeof(struct syslog_relay_archive_private));
+	if (!archive_loc)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	archive_loc->buffer = (char*)malloc(SYSLOG_RELAY_ARCHIVE_BUFFER_SIZE);
+	archive_loc->directory = strdup(directory);
+	if (!archive_loc->buffer || !archive_loc->directory) {
+		free(archive_loc->buffer);
+		free(archive_loc->directory);
+		free(archive_loc);
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+	archive_loc->max_segment_size = max_segment_size;
+	archive_loc->max_segment_time = max_segment_time;
+	archive_loc->fd = -1;
+	archive_loc->index_fd = -1;
+	archive_loc->last_flush = syslog_relay_time_ms();
+	mutex_init(&archive_loc->mutex);
+
+	*archive = archive_loc;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API void syslog_relay_archive_write(const char *line, uint32_t length, void *user_data)
+{
+	syslog_relay_archive_t archive = (syslog_relay_archive_t)user_data;
+	uint64_t now = syslog_relay_time_ms();
+	char stamp[24];
+	int stamp_length;
+
+	if (!archive || !line)
+		return;
+
+	mutex_lock(&archive->mutex);
+
+	/* rotate by size or age */
+	if (archive->fd >= 0
+	    && ((archive->max_segment_size > 0 && archive->segment_size >= archive->max_segment_size)
+	     || (archive->max_segment_time > 0 && now >= archive->segment_start + (uint64_t)archive->max_segment_time * 1000))) {
+		syslog_relay_archive_finish_segment(archive);
+	}
+	if (archive->fd < 0 && syslog_relay_archive_start_segment(archive, now) != SYSLOG_RELAY_E_SUCCESS) {
+		mutex_unlock(&archive->mutex);
+		return;
+	}
+
+	/* sparse index: one entry per interval of data */
+	if (archive->segment_size >= archive->next_index_offset) {
+		SyslogRelayIndexEntry entry;
+		entry.timestamp = htole64(now);
+		entry.offset = htole64(archive->segment_size);
+		if (syslog_relay_write_fully(archive->index_fd, (const char*)&entry, sizeof(entry)) < 0) {
+			debug_info("Could not write archive index");
+		}
+		archive->next_index_offset = archive->segment_size + SYSLOG_RELAY_ARCHIVE_INDEX_INTERVAL;
+	}
+
+	stamp_length = snprintf(stamp, sizeof(stamp), "%llu ", (unsigned long long)now);
+	if (archive->buffer_length + stamp_length + length + 1 > SYSLOG_RELAY_ARCHIVE_BUFFER_SIZE
+	    && syslog_relay_archive_write_buffer(archive) != SYSLOG_RELAY_E_SUCCESS) {
+		syslog_relay_archive_abort_segment(archive);
+		mutex_unlock(&archive->mutex);
+		return;
+	}
+	if (stamp_length + length + 1 > SYSLOG_RELAY_ARCHIVE_BUFFER_SIZE) {
+		/* too long to buffer, write through */
+		if (syslog_relay_write_fully(archive->fd, stamp, stamp_length) < 0
+		    || syslog_relay_write_fully(archive->fd, line, length) < 0
+		    || syslog_relay_write_fully(archive->fd, "\n", 1) < 0) {
+			syslog_relay_archive_abort_segment(archive);
+			mutex_unlock(&archive->mutex);
+			return;
+		}
+	} else {
+		memcpy(archive->buffer + archive->buffer_length, stamp, stamp_length);
+		memcpy(archive->buffer + archive->buffer_length + stamp_length, line, length);
+		archive->buffer[archive->buffer_length + stamp_length + length] = '\n';
+		archive->buffer_length += stamp_length + length + 1;
+	}
+	archive->segment_size += stamp_length + length + 1;
+
+	if (now >= archive->last_flush + SYSLOG_RELAY_ARCHIVE_FLUSH_INTERVAL
+	    && syslog_relay_archive_write_buffer(archive) != SYSLOG_RELAY_E_SUCCESS) {
+		syslog_relay_archive_abort_segment(archive);
+	}
+
+	mutex_unlock(&archive->mutex);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_archive_flush(syslog_relay_archive_t archive)
+{
+	syslog_relay_error_t res;
+
+	if (!archive)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	mutex_lock(&archive->mutex);
+	res = syslog_relay_archive_write_buffer(archive);
+	if (res != SYSLOG_RELAY_E_SUCCESS)
+		syslog_relay_archive_abort_segment(archive);
+	mutex_unlock(&archive->mutex);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_archive_close(syslog_relay_archive_t archive)
+{
+	syslog_relay_error_t res;
+
+	if (!archive)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	res = syslog_relay_archive_finish_segment(archive);
+	mutex_destroy(&archive->mutex);
+	free(archive->buffer);
+	free(archive->directory);
+	free(archive);
+
+	return res;
+}
+
+static int syslog_relay_segment_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+/**
+ * Finds the offset to start reading a segment at for a given time, using
+ * the last index entry earlier than that time. Lines sharing a timestamp
+ * can span several index entries, so an entry at exactly that time might
+ * already be past some of them.
+ */
+static uint64_t syslog_relay_segment_seek_offset(const char *index_path, uint64_t from)
+{
+	SyslogRelayIndexEntry *entries = NULL;
+	uint64_t length = 0;
+	uint64_t offset = 0;
+	uint64_t count;
+	uint64_t lo = 0;
+	uint64_t hi;
+
+	buffer_read_from_filename(index_path, (char**)&entries, &length);
+	if (!entries)
+		return 0;
+
+	count = length / sizeof(SyslogRelayIndexEntry);
+	hi = count;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (le64toh(entries[mid].timestamp) < from) {
+			offset = le64toh(entries[mid].offset);
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	free(entries);
+
+	return offset;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_archive_read(const char *directory, uint64_t from, uint64_t to, syslog_relay_receive_lines_cb_t callback, void *user_data)
+{
+	uint64_t *segments = NULL;
+	uint32_t num_segments = 0;
+	uint32_t capacity = 0;
+	struct dirent *ep;
+	char *line;
+	DIR *dir;
+	uint32_t i;
+	int done = 0;
+
+	if (!directory || !callback || from > to)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	dir = opendir(directory);
+	if (!dir)
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	while ((ep = readdir(dir))) {
+		size_t len = strlen(ep->d_name);
+		if (len != 17 || strcmp(ep->d_name + 13, ".log") != 0)
+			continue;
+		if (num_segments == capacity) {
+			uint64_t *newsegments;
+			capacity = (capacity) ? capacity * 2 : 64;
+			newsegments = (uint64_t*)realloc(segments, capacity * sizeof(uint64_t));
+			if (!newsegments)
+				break;
+			segments = newsegments;
+		}
+		segments[num_segments++] = strtoull(ep->d_name, NULL, 10);
+	}
+	closedir(dir);
+
+	if (num_segments > 0)
+		qsort(segments, num_segments, sizeof(uint64_t), syslog_relay_segment_cmp);
+
+	line = (char*)malloc(SYSLOG_RELAY_ARCHIVE_BUFFER_SIZE);
+	if (!line) {
+		free(segments);
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	for (i = 0; i < num_segments && !done; i++) {
+		char name[32];
+		char *path;
+		uint64_t offset;
+		FILE *f;
+
+		/* a segment ends where the next one starts, but might still hold
+		 * lines with the same timestamp the next one starts with */
+		if (segments[i] > to)
+			break;
+		if (i + 1 < num_segments && segments[i+1] < from)
+			continue;
+
+		snprintf(name, sizeof(name), "%013llu.idx", (unsigned long long)segments[i]);
+		path = string_build_path(directory, name, NULL);
+		offset = syslog_relay_segment_seek_offset(path, from);
+		free(path);
+
+		snprintf(name, sizeof(name), "%013llu.log", (unsigned long long)segments[i]);
+		path = string_build_path(directory, name, NULL);
+		f = fopen(path, "rb");
+		free(path);
+		if (!f)
+			continue;
+		if (offset > 0 && fseeko(f, (off_t)offset, SEEK_SET) != 0) {
+			fclose(f);
+			continue;
+		}
+
+		while (fgets(line, SYSLOG_RELAY_ARCHIVE_BUFFER_SIZE, f)) {
+			char *text = NULL;
+			uint64_t timestamp = strtoull(line, &text, 10);
+			size_t len;
+			if (!text || *text != ' ')
+				continue;
+			text++;
+			if (timestamp < from)
+				continue;
+			if (timestamp > to) {
+				done = 1;
+				break;
+			}
+			len = strlen(text);
+			if (len > 0 && text[len-1] == '\n')
+				text[--len] = '\0';
+			callback(text, (uint32_t)len, user_data);
+		}
+		fclose(f);
+	}
+
+	free(line);
+	free(segments);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
@@ -26,9 +26,69 @@
 #include "service.h"
 #include "common/thread.h"
 
+/* Size of the blocks read from the service by the capture thread */
+#define SYSLOG_RELAY_BUFFER_SIZE (16384)
+
+struct syslog_relay_filter {
+	char **processes;
+	uint32_t num_processes;
+	char **substrings;
+	uint32_t num_substrings;
+	uint32_t pid_min;
+	uint32_t pid_max;
+	syslog_relay_level_t level;
+	int active;
+};
+
+/* Ring buffer between the receiving and the delivering thread. Entries are
+ * a 32 bit length followed by the data. head is only advanced by the
+ * receiving thread, tail by the delivering thread, or by the receiving
+ * thread when dropping the oldest entry. */
+struct syslog_relay_queue {
+	char *data;
+	uint32_t capacity;
+	syslog_relay_queue_policy_t policy;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t lines_dropped;
+	uint32_t high_water;
+	int waiting;
+	int done;
+	mutex_t mutex;
+	cond_t cond;
+};
+
 struct syslog_relay_client_private {
 	service_client_t parent;
 	thread_t worker;
+	struct syslog_relay_filter filter;
+	struct syslog_relay_queue queue;
+};
+
+/* Archive segments, see syslog_relay_archive_open() */
+#define SYSLOG_RELAY_ARCHIVE_BUFFER_SIZE (65536)
+#define SYSLOG_RELAY_ARCHIVE_INDEX_INTERVAL (65536)
+#define SYSLOG_RELAY_ARCHIVE_FLUSH_INTERVAL (1000)
+
+/* index files are a sequence of these, little endian */
+typedef struct {
+	uint64_t timestamp;
+	uint64_t offset;
+} SyslogRelayIndexEntry;
+
+struct syslog_relay_archive_private {
+	char *directory;
+	uint64_t max_segment_size;
+	uint32_t max_segment_time;
+	int fd;
+	int index_fd;
+	uint64_t segment_start;
+	uint64_t segment_size;
+	uint64_t next_index_offset;
+	uint64_t last_flush;
+	char *buffer;
+	uint32_t buffer_length;
+	mutex_t mutex;
 };
 
 void *syslog_relay_worker(void *arg);
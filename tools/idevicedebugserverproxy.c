@@ -19,11 +19,26 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA 
  */
 
+#ifdef __linux__
+/* for splice() */
+#define _GNU_SOURCE 1
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <unistd.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -31,21 +46,49 @@
 #include "common/socket.h"
 #include "common/thread.h"
 
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+#define HAVE_SPLICE 1
+#endif
+
 #define info(...) fprintf(stdout, __VA_ARGS__); fflush(stdout)
 #define debug(...) if(debug_mode) fprintf(stdout, __VA_ARGS__)
 
+#define TRANSFER_SIZE (131072)
+
 static int debug_mode = 0;
 static int quit_flag = 0;
 
+/* one direction of a proxied connection */
 typedef struct {
-	int server_fd;
+	int from_fd;
+	int to_fd;
+	/* data read but not yet written, in a pipe when splicing */
+	int pipe_fds[2];
+	char *buffer;
+	uint32_t offset;
+	uint32_t length;
+	/* the source hung up while data was still pending */
+	int source_hup;
+} proxy_direction_t;
+
+/* an LLDB client and its own debugserver connection */
+typedef struct proxy_session {
+	int id;
 	int client_fd;
-	uint16_t local_port;
-	uint16_t remote_port;
+	int device_fd;
+	idevice_t device;
 	idevice_connection_t device_connection;
-	volatile int stop_ctod;
-	volatile int stop_dtoc;
-} socket_info_t;
+	proxy_direction_t to_device;
+	proxy_direction_t to_client;
+	thread_t setup_thread;
+	int setup_failed;
+	struct proxy_session *next;
+} proxy_session_t;
+
+/* sessions set up by their own thread, until serve_clients() takes them */
+static mutex_t setup_mutex;
+static proxy_session_t *ready_sessions = NULL;
+static int setup_count = 0;
 
 static void clean_exit(int sig)
 {
@@ -66,171 +109,439 @@ static void print_usage(int argc, char **argv)
 	printf("\n");
 }
 
-static void *thread_device_to_client(void *data)
+static int set_nonblocking(int fd)
 {
-	socket_info_t* socket_info = (socket_info_t*)data;
-	idevice_error_t res = IDEVICE_E_UNKNOWN_ERROR;
+#ifdef WIN32
+	u_long nonblocking = 1;
+	return ioctlsocket(fd, FIONBIO, &nonblocking);
+#else
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
 
-	int recv_len;
-	int sent;
-	char buffer[131072];
+static int would_block(void)
+{
+#ifdef WIN32
+	return (WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+#endif
+}
 
-	debug("%s: started thread...\n", __func__);
+static uint32_t direction_pending(proxy_direction_t *dir)
+{
+	return dir->length - dir->offset;
+}
 
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
-	debug("%s: server fd = %d\n", __func__, socket_info->server_fd);
+/**
+ * Prepares a direction of a session. Where available the data is moved
+ * with splice() through a pipe, so it is never copied to user space.
+ */
+static int direction_init(proxy_direction_t *dir, int from_fd, int to_fd)
+{
+	memset(dir, '\0', sizeof(proxy_direction_t));
+	dir->from_fd = from_fd;
+	dir->to_fd = to_fd;
+	dir->pipe_fds[0] = -1;
+	dir->pipe_fds[1] = -1;
+
+#ifdef HAVE_SPLICE
+	if (pipe(dir->pipe_fds) == 0) {
+		return 0;
+	}
+	dir->pipe_fds[0] = -1;
+	dir->pipe_fds[1] = -1;
+#endif
 
-	while (!quit_flag && !socket_info->stop_dtoc && socket_info->client_fd > 0 && socket_info->server_fd > 0) {
-		debug("%s: receiving data from device...\n", __func__);
+	dir->buffer = (char*)malloc(TRANSFER_SIZE);
 
-		res = idevice_connection_receive_timeout(socket_info->device_connection, buffer, sizeof(buffer), (uint32_t*)&recv_len, 5000);
+	return (dir->buffer) ? 0 : -1;
+}
 
-		if (recv_len <= 0) {
-			if (recv_len == 0 && res == IDEVICE_E_SUCCESS) {
-				// try again
-				continue;
-			} else {
-				fprintf(stderr, "recv failed: %s\n", strerror(errno));
-				break;
-			}
-		} else {
-			/* send to device */
-			debug("%s: sending data to client...\n", __func__);
-			sent = socket_send(socket_info->client_fd, buffer, recv_len);
-			if (sent < recv_len) {
-				if (sent <= 0) {
-					fprintf(stderr, "send failed: %s\n", strerror(errno));
-					break;
-				} else {
-					fprintf(stderr, "only sent %d from %d bytes\n", sent, recv_len);
-				}
-			} else {
-				// sending succeeded, receive from device
-				debug("%s: pushed %d bytes to client\n", __func__, sent);
-			}
-		}
+static void direction_free(proxy_direction_t *dir)
+{
+	if (dir->pipe_fds[0] >= 0)
+		close(dir->pipe_fds[0]);
+	if (dir->pipe_fds[1] >= 0)
+		close(dir->pipe_fds[1]);
+	free(dir->buffer);
+}
+
+/**
+ * Reads what is available from the source of a direction.
+ *
+ * @return 0 on success, -1 when the source was closed or failed.
+ */
+static int direction_fill(proxy_direction_t *dir)
+{
+	int bytes;
+
+	dir->offset = 0;
+	dir->length = 0;
+
+#ifdef HAVE_SPLICE
+	if (dir->pipe_fds[0] >= 0) {
+		ssize_t res = splice(dir->from_fd, NULL, dir->pipe_fds[1], NULL, TRANSFER_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (res < 0 && would_block())
+			return 0;
+		if (res <= 0)
+			return -1;
+		dir->length = (uint32_t)res;
+		return 0;
 	}
+#endif
 
-	debug("%s: shutting down...\n", __func__);
+	bytes = recv(dir->from_fd, dir->buffer, TRANSFER_SIZE, 0);
+	if (bytes < 0 && would_block())
+		return 0;
+	if (bytes <= 0)
+		return -1;
+	dir->length = (uint32_t)bytes;
 
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+	return 0;
+}
 
-	socket_info->client_fd = -1;
-	socket_info->stop_ctod = 1;
+/**
+ * Writes as much pending data to the destination of a direction as
+ * possible without blocking.
+ *
+ * @return 0 on success, -1 when the destination was closed or failed.
+ */
+static int direction_flush(proxy_direction_t *dir)
+{
+	while (direction_pending(dir) > 0) {
+		int bytes;
 
-	return NULL;
+#ifdef HAVE_SPLICE
+		if (dir->pipe_fds[0] >= 0) {
+			ssize_t res = splice(dir->pipe_fds[0], NULL, dir->to_fd, NULL, direction_pending(dir), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (res < 0 && would_block())
+				return 0;
+			if (res <= 0)
+				return -1;
+			dir->offset += (uint32_t)res;
+			continue;
+		}
+#endif
+
+		bytes = send(dir->to_fd, dir->buffer + dir->offset, direction_pending(dir), 0);
+		if (bytes < 0 && would_block())
+			return 0;
+		if (bytes <= 0)
+			return -1;
+		dir->offset += (uint32_t)bytes;
+	}
+
+	return 0;
 }
 
-static void *thread_client_to_device(void *data)
+/**
+ * Moves data along a direction after poll() reported its source readable.
+ */
+static int direction_transfer(proxy_direction_t *dir)
 {
-	socket_info_t* socket_info = (socket_info_t*)data;
-	idevice_error_t res = IDEVICE_E_UNKNOWN_ERROR;
+	if (direction_fill(dir) < 0)
+		return -1;
 
-	int recv_len;
-	int sent;
-	char buffer[131072];
-	thread_t dtoc;
+	return direction_flush(dir);
+}
 
-	debug("%s: started thread...\n", __func__);
+/**
+ * Starts a new debugserver service on the device and connects to it.
+ */
+static idevice_connection_t start_debugserver(idevice_t device)
+{
+	lockdownd_client_t lockdown = NULL;
+	lockdownd_error_t ldret = LOCKDOWN_E_UNKNOWN_ERROR;
+	lockdownd_service_descriptor_t service = NULL;
+	idevice_connection_t connection = NULL;
 
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
-	debug("%s: server_fd = %d\n", __func__, socket_info->server_fd);
+	if (LOCKDOWN_E_SUCCESS != (ldret = lockdownd_client_new_with_handshake(device, &lockdown, "idevicedebugserverproxy"))) {
+		fprintf(stderr, "ERROR: Could not connect to lockdownd, error code %d\n", ldret);
+		return NULL;
+	}
 
-	/* spawn server to client thread */
-	socket_info->stop_dtoc = 0;
-	if (thread_create(&dtoc, thread_device_to_client, data) != 0) {
-		fprintf(stderr, "Failed to start device to client thread...\n");
+	if ((lockdownd_start_service(lockdown, "com.apple.debugserver", &service) != LOCKDOWN_E_SUCCESS) || !service || !service->port) {
+		fprintf(stderr, "Could not start com.apple.debugserver!\nPlease make sure to mount the developer disk image first.\n");
+		goto leave;
 	}
 
-	while (!quit_flag && !socket_info->stop_ctod && socket_info->client_fd > 0 && socket_info->server_fd > 0) {
-		debug("%s: receiving data from client...\n", __func__);
+	if (idevice_connect(device, service->port, &connection) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "Connection to debugserver port %d failed!\n", (int)service->port);
+		connection = NULL;
+	}
 
-		/* attempt to read incoming data from client */
-		recv_len = socket_receive_timeout(socket_info->client_fd, buffer, sizeof(buffer), 0, 5000);
+leave:
+	if (service)
+		lockdownd_service_descriptor_free(service);
+	lockdownd_client_free(lockdown);
 
-		/* any data received? */
-		if (recv_len <= 0) {
-			if (recv_len == 0) {
-				/* try again */
-				continue;
-			} else {
-				fprintf(stderr, "Receive failed: %s\n", strerror(errno));
-				break;
-			}
-		} else {
-			/* forward data to device */
-			debug("%s: sending data to device...\n", __func__);
-			res = idevice_connection_send(socket_info->device_connection, buffer, recv_len, (uint32_t*)&sent);
-
-			if (sent < recv_len || res != IDEVICE_E_SUCCESS) {
-				if (sent <= 0) {
-					fprintf(stderr, "send failed: %s\n", strerror(errno));
-					break;
-				} else {
-					fprintf(stderr, "only sent %d from %d bytes\n", sent, recv_len);
-				}
-			} else {
-				// sending succeeded, receive from device
-				debug("%s: sent %d bytes to device\n", __func__, sent);
-			}
+	return connection;
+}
+
+static void session_free(proxy_session_t *session)
+{
+	if (session->client_fd >= 0) {
+		socket_shutdown(session->client_fd, SHUT_RDWR);
+		socket_close(session->client_fd);
+	}
+	if (session->device_connection)
+		idevice_disconnect(session->device_connection);
+	direction_free(&session->to_device);
+	direction_free(&session->to_client);
+	free(session);
+}
+
+/**
+ * Connects a new session to its own debugserver. Starting the service
+ * takes a lockdown handshake, so this runs on a thread of its own and
+ * does not stall the sessions already being served.
+ */
+static void *session_setup_thread(void *arg)
+{
+	proxy_session_t *session = (proxy_session_t*)arg;
+
+	session->device_connection = start_debugserver(session->device);
+	if (!session->device_connection || idevice_connection_get_fd(session->device_connection, &session->device_fd) != IDEVICE_E_SUCCESS) {
+		session->setup_failed = 1;
+	} else {
+		/* the connection is plain, so data is moved on the sockets directly */
+		set_nonblocking(session->device_fd);
+		set_nonblocking(session->client_fd);
+
+		if (direction_init(&session->to_device, session->client_fd, session->device_fd) < 0
+		    || direction_init(&session->to_client, session->device_fd, session->client_fd) < 0) {
+			session->setup_failed = 1;
 		}
 	}
 
-	debug("%s: shutting down...\n", __func__);
+	mutex_lock(&setup_mutex);
+	session->next = ready_sessions;
+	ready_sessions = session;
+	mutex_unlock(&setup_mutex);
+
+	return NULL;
+}
+
+/**
+ * Creates a session for a client that connected and starts setting up
+ * its debugserver connection. The session is served once
+ * take_ready_sessions() picks it up.
+ */
+static int session_new(idevice_t device, int client_fd, int id)
+{
+	proxy_session_t *session = (proxy_session_t*)calloc(1, sizeof(proxy_session_t));
+
+	if (!session) {
+		socket_close(client_fd);
+		return -1;
+	}
+	session->id = id;
+	session->client_fd = client_fd;
+	session->device_fd = -1;
+	session->device = device;
+	session->to_device.pipe_fds[0] = session->to_device.pipe_fds[1] = -1;
+	session->to_client.pipe_fds[0] = session->to_client.pipe_fds[1] = -1;
+
+	mutex_lock(&setup_mutex);
+	setup_count++;
+	mutex_unlock(&setup_mutex);
+
+	if (thread_create(&session->setup_thread, session_setup_thread, session) != 0) {
+		mutex_lock(&setup_mutex);
+		setup_count--;
+		mutex_unlock(&setup_mutex);
+		session_free(session);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Takes over the sessions whose setup finished, and drops those that
+ * failed.
+ *
+ * @return the number of sessions added to the list.
+ */
+static int take_ready_sessions(proxy_session_t **sessions)
+{
+	proxy_session_t *ready;
+	int added = 0;
+
+	mutex_lock(&setup_mutex);
+	ready = ready_sessions;
+	ready_sessions = NULL;
+	mutex_unlock(&setup_mutex);
+
+	while (ready) {
+		proxy_session_t *session = ready;
+		ready = ready->next;
+
+		thread_join(session->setup_thread);
+		mutex_lock(&setup_mutex);
+		setup_count--;
+		mutex_unlock(&setup_mutex);
+
+		if (session->setup_failed) {
+			info("Client %d could not be connected to debugserver\n", session->id);
+			session_free(session);
+			continue;
+		}
+
+		info("Client %d connected\n", session->id);
+		session->next = *sessions;
+		*sessions = session;
+		added++;
+	}
 
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+	return added;
+}
 
-	socket_info->client_fd = -1;
-	socket_info->stop_dtoc = 1;
+static int setup_pending(void)
+{
+	int count;
 
-	/* join other thread to allow it to stop */
-	thread_join(dtoc);
+	mutex_lock(&setup_mutex);
+	count = setup_count;
+	mutex_unlock(&setup_mutex);
 
-	return NULL;
+	return count;
 }
 
-static void* connection_handler(void* data)
+/**
+ * Serves all clients from a single loop. Each direction of a session
+ * waits for its source to become readable while nothing is pending, and
+ * for its destination to become writable otherwise. A source that hung
+ * up is not polled until its pending data was written, as poll() would
+ * keep reporting the hangup.
+ */
+static void serve_clients(idevice_t device, int server_fd, uint16_t local_port)
 {
-	socket_info_t* socket_info = (socket_info_t*)data;
-	thread_t ctod;
+	proxy_session_t *sessions = NULL;
+	struct pollfd *fds = NULL;
+	int fds_capacity = 0;
+	int num_sessions = 0;
+	int next_id = 1;
 
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
+	mutex_init(&setup_mutex);
 
-	/* spawn client to device thread */
-	socket_info->stop_ctod = 0;
-	if (thread_create(&ctod, thread_client_to_device, data) != 0) {
-		fprintf(stderr, "Failed to start client to device thread...\n");
-	}
+	while (!quit_flag) {
+		proxy_session_t *session;
+		proxy_session_t **link;
+		int nfds = 1;
+		int i;
+
+		num_sessions += take_ready_sessions(&sessions);
+
+		if (fds_capacity < 1 + 2 * num_sessions) {
+			struct pollfd *newfds;
+			fds_capacity = 1 + 2 * num_sessions + 16;
+			newfds = (struct pollfd*)realloc(fds, fds_capacity * sizeof(struct pollfd));
+			if (!newfds)
+				break;
+			fds = newfds;
+		}
+
+		fds[0].fd = server_fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		for (session = sessions; session; session = session->next) {
+			fds[nfds].fd = (session->to_device.source_hup && direction_pending(&session->to_device)) ? -1 : session->client_fd;
+			fds[nfds].events = (direction_pending(&session->to_device) ? 0 : POLLIN) | (direction_pending(&session->to_client) ? POLLOUT : 0);
+			fds[nfds].revents = 0;
+			fds[nfds + 1].fd = (session->to_client.source_hup && direction_pending(&session->to_client)) ? -1 : session->device_fd;
+			fds[nfds + 1].events = (direction_pending(&session->to_client) ? 0 : POLLIN) | (direction_pending(&session->to_device) ? POLLOUT : 0);
+			fds[nfds + 1].revents = 0;
+			nfds += 2;
+		}
+
+		/* wake up regularly to check quit_flag, and soon while sessions
+		 * are being set up */
+		if (poll(fds, nfds, setup_pending() ? 50 : 1000) <= 0)
+			continue;
 
-	/* join the fun */
-	thread_join(ctod);
+		i = 1;
+		link = &sessions;
+		while ((session = *link)) {
+			short client_events = fds[i].revents;
+			short device_events = fds[i + 1].revents;
+			int failed = 0;
+			i += 2;
+
+			if ((client_events | device_events) & (POLLERR | POLLNVAL))
+				failed = 1;
+			if (!failed && (device_events & POLLOUT))
+				failed = direction_flush(&session->to_device);
+			if (!failed && (client_events & POLLOUT))
+				failed = direction_flush(&session->to_client);
+			if (!failed && (client_events & (POLLIN | POLLHUP))) {
+				if (!direction_pending(&session->to_device))
+					failed = direction_transfer(&session->to_device);
+				else if (client_events & POLLHUP)
+					session->to_device.source_hup = 1;
+			}
+			if (!failed && (device_events & (POLLIN | POLLHUP))) {
+				if (!direction_pending(&session->to_client))
+					failed = direction_transfer(&session->to_client);
+				else if (device_events & POLLHUP)
+					session->to_client.source_hup = 1;
+			}
 
-	/* shutdown client socket */
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+			if (failed) {
+				info("Client %d disconnected\n", session->id);
+				*link = session->next;
+				session_free(session);
+				num_sessions--;
+				continue;
+			}
+			link = &session->next;
+		}
 
-	/* shutdown server socket if we have to terminate to unblock the server loop */
-	if (quit_flag) {
-		socket_shutdown(socket_info->server_fd, SHUT_RDWR);
-		socket_close(socket_info->server_fd);
+		if (fds[0].revents & POLLIN) {
+			int client_fd = socket_accept(server_fd, local_port);
+			if (client_fd < 0) {
+				debug("%s: Continuing...\n", __func__);
+				continue;
+			}
+
+			debug("%s: Handling new client connection...\n", __func__);
+
+			if (session_new(device, client_fd, next_id) == 0)
+				next_id++;
+		}
 	}
 
-	return NULL;
+	/* sessions still being set up cannot be interrupted */
+	while (setup_pending() > 0) {
+		if (take_ready_sessions(&sessions) == 0 && setup_pending() > 0) {
+#ifdef WIN32
+			Sleep(50);
+#else
+			usleep(50000);
+#endif
+		}
+	}
+
+	while (sessions) {
+		proxy_session_t *session = sessions;
+		sessions = session->next;
+		session_free(session);
+	}
+	free(fds);
+	mutex_destroy(&setup_mutex);
 }
 
 int main(int argc, char *argv[])
 {
-	lockdownd_client_t lockdown = NULL;
-	lockdownd_error_t ldret = LOCKDOWN_E_UNKNOWN_ERROR;
 	idevice_t device = NULL;
-	idevice_connection_t connection = NULL;
 	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
-	thread_t th;
 	const char* udid = NULL;
-	lockdownd_service_descriptor_t service = NULL;
 	uint16_t local_port = 0;
+	int server_fd = -1;
 	int result = EXIT_SUCCESS;
 	int i;
 
@@ -280,7 +591,7 @@ int main(int argc, char *argv[])
 		goto leave_cleanup;
 	}
 
-	/* start services and connect to device */
+	/* connect to device, debugserver is started for each client */
 	ret = idevice_new(&device, udid);
 	if (ret != IDEVICE_E_SUCCESS) {
 		if (udid) {
@@ -292,77 +603,24 @@ int main(int argc, char *argv[])
 		goto leave_cleanup;
 	}
 
-	if (LOCKDOWN_E_SUCCESS != (ldret = lockdownd_client_new_with_handshake(device, &lockdown, "idevicedebugserverproxy"))) {
-		fprintf(stderr, "ERROR: Could not connect to lockdownd, error code %d\n", ldret);
-		result = EXIT_FAILURE;
-		goto leave_cleanup;
-	}
-
-	if ((lockdownd_start_service(lockdown, "com.apple.debugserver", &service) != LOCKDOWN_E_SUCCESS) || !service || !service->port) {
-		fprintf(stderr, "Could not start com.apple.debugserver!\nPlease make sure to mount the developer disk image first.\n");
-		result = EXIT_FAILURE;
-		goto leave_cleanup;
-	}
-
-	if (idevice_connect(device, service->port, &connection) != IDEVICE_E_SUCCESS) {
-		fprintf(stderr, "Connection to debugserver port %d failed!\n", (int)service->port);
-		result = EXIT_FAILURE;
-		goto leave_cleanup;
-	}
-
-	/* free lockdown connection if running as it is not needed anymore */
-	if (lockdown) {
-		lockdownd_client_free(lockdown);
-		lockdown = NULL;
-	}
-
-	/* setup and create socket endpoint */
-	socket_info_t socket_info;
-
-	socket_info.device_connection = connection;
-	socket_info.local_port = local_port;
-	socket_info.remote_port = service->port;
-
-	if (service) {
-		lockdownd_service_descriptor_free(service);
-		service = NULL;
-	}
-
 	/* create local socket */
-	socket_info.server_fd = socket_create(socket_info.local_port);
-	if (socket_info.server_fd < 0) {
+	server_fd = socket_create(local_port);
+	if (server_fd < 0) {
 		fprintf(stderr, "Could not create socket\n");
 		result = EXIT_FAILURE;
 		goto leave_cleanup;
 	}
 
-	while (!quit_flag) {
-		debug("%s: Waiting for connection on local port %d\n", __func__, socket_info.local_port);
-
-		/* wait for client */
-		socket_info.client_fd = socket_accept(socket_info.server_fd, socket_info.local_port);
-		if (socket_info.client_fd < 0) {
-			debug("%s: Continuing...\n", __func__);
-			continue;
-		}
+	debug("%s: Waiting for connections on local port %d\n", __func__, local_port);
 
-		debug("%s: Handling new client connection...\n", __func__);
-
-		if (thread_create(&th, connection_handler, (void*)&socket_info) != 0) {
-			fprintf(stderr, "Could not start connection handler.\n");
-			socket_shutdown(socket_info.server_fd, SHUT_RDWR);
-			socket_close(socket_info.server_fd);
-		}
-	}
+	serve_clients(device, server_fd, local_port);
 
 	debug("%s: Shutting down debugserver proxy...\n", __func__);
 
 leave_cleanup:
-	if (connection) {
-		idevice_disconnect(connection);
-	}
-	if (lockdown) {
-		lockdownd_client_free(lockdown);
+	if (server_fd >= 0) {
+		socket_shutdown(server_fd, SHUT_RDWR);
+		socket_close(server_fd);
 	}
 	if (device) {
 		idevice_free(device);
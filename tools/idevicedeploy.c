@@ -0,0 +1,213 @@
+/*
+ * idevicedeploy.c
+ * Install an application package on several devices at once
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA 
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/installation_proxy.h>
+
+void print_usage(int argc, char **argv);
+
+static void status_cb(const char *udid, const char *operation, plist_t status, void *user_data)
+{
+	plist_t node;
+	char *str = NULL;
+
+	node = plist_dict_get_item(status, "Error");
+	if (node) {
+		char *desc = NULL;
+		plist_get_string_val(node, &str);
+		node = plist_dict_get_item(status, "ErrorDescription");
+		if (node) {
+			plist_get_string_val(node, &desc);
+		}
+		printf("%s: %s: ERROR: %s%s%s\n", udid, operation, (str) ? str : "", (desc) ? " - " : "", (desc) ? desc : "");
+		free(desc);
+		free(str);
+		return;
+	}
+
+	node = plist_dict_get_item(status, "Status");
+	if (node) {
+		plist_get_string_val(node, &str);
+	}
+	if (!str) {
+		return;
+	}
+	node = plist_dict_get_item(status, "PercentComplete");
+	if (node) {
+		uint64_t percent = 0;
+		plist_get_uint_val(node, &percent);
+		printf("%s: %s: %s (%d%%)\n", udid, operation, str, (int)percent);
+	} else {
+		printf("%s: %s: %s\n", udid, operation, str);
+	}
+	fflush(stdout);
+	free(str);
+}
+
+int main(int argc, char **argv)
+{
+	const char **udids = NULL;
+	uint32_t count = 0;
+	char **device_list = NULL;
+	const char *pkg_path = NULL;
+	uint32_t max_uploads = 0;
+	uint64_t max_bandwidth = 0;
+	instproxy_error_t *results = NULL;
+	instproxy_error_t res;
+	uint32_t installed = 0;
+	int result = 0;
+	int i;
+
+	udids = (const char**)malloc(argc * sizeof(char*));
+	if (!udids) {
+		return -1;
+	}
+
+	/* parse cmdline args */
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
+			idevice_set_debug_level(1);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--udid")) {
+			i++;
+			if (!argv[i] || (strlen(argv[i]) != 40)) {
+				print_usage(argc, argv);
+				free(udids);
+				return 0;
+			}
+			udids[count++] = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+			i++;
+			if (!argv[i] || atoi(argv[i]) <= 0) {
+				print_usage(argc, argv);
+				free(udids);
+				return 0;
+			}
+			max_uploads = atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--bandwidth")) {
+			i++;
+			if (!argv[i] || atof(argv[i]) <= 0) {
+				print_usage(argc, argv);
+				free(udids);
+				return 0;
+			}
+			max_bandwidth = (uint64_t)(atof(argv[i]) * 1024 * 1024);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			print_usage(argc, argv);
+			free(udids);
+			return 0;
+		}
+		else if (argv[i][0] != '-' && !pkg_path) {
+			pkg_path = argv[i];
+			continue;
+		}
+		else {
+			print_usage(argc, argv);
+			free(udids);
+			return 0;
+		}
+	}
+
+	if (!pkg_path) {
+		print_usage(argc, argv);
+		free(udids);
+		return 0;
+	}
+
+	if (count == 0) {
+		/* deploy to all attached devices */
+		int num = 0;
+		if (idevice_get_device_list(&device_list, &num) < 0 || num == 0) {
+			fprintf(stderr, "No device found, is it plugged in?\n");
+			free(udids);
+			return -1;
+		}
+		free(udids);
+		udids = (const char**)device_list;
+		count = num;
+	}
+
+	results = (instproxy_error_t*)malloc(count * sizeof(instproxy_error_t));
+	if (!results) {
+		result = -1;
+		goto cleanup;
+	}
+
+	res = instproxy_deploy(pkg_path, udids, count, NULL, max_uploads, max_bandwidth, status_cb, NULL, results);
+	if (res == INSTPROXY_E_INVALID_ARG) {
+		fprintf(stderr, "Could not read package %s\n", pkg_path);
+		result = -1;
+		goto cleanup;
+	}
+	if (res != INSTPROXY_E_SUCCESS && res != INSTPROXY_E_OP_FAILED) {
+		fprintf(stderr, "Could not deploy package %s (%d)\n", pkg_path, res);
+		result = -1;
+		goto cleanup;
+	}
+
+	for (i = 0; i < (int)count; i++) {
+		if (results[i] == INSTPROXY_E_SUCCESS) {
+			installed++;
+		} else {
+			fprintf(stderr, "%s: installation failed (%d)\n", udids[i], results[i]);
+		}
+	}
+	printf("Installed on %u of %u devices.\n", installed, count);
+	if (installed != count) {
+		result = 1;
+	}
+
+cleanup:
+	free(results);
+	if (device_list) {
+		idevice_device_list_free(device_list);
+	} else {
+		free(udids);
+	}
+
+	return result;
+}
+
+void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS] PACKAGE\n", (name ? name + 1: argv[0]));
+	printf("Install an application package (.ipa) on several devices at once.\n");
+	printf("Without -u the package is installed on all attached devices.\n\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -u, --udid UDID\tinstall on the device with this 40-digit UDID,\n");
+	printf("  \t\t\tcan be given several times\n");
+	printf("  -j, --jobs N\t\tupload to at most N devices at the same time\n");
+	printf("  -b, --bandwidth MB\tupload at most MB megabytes per second in total\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
@@ -25,14 +25,23 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #ifdef WIN32
+#include <winsock2.h>
 #include <windows.h>
 #define sleep(x) Sleep(x*1000)
+#else
+#include <sys/select.h>
+#include <sys/time.h>
 #endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/syslog_relay.h>
+#include <libimobiledevice/service.h>
+#include "common/thread.h"
+#include "common/utils.h"
 
 static int quit_flag = 0;
 
@@ -42,12 +51,40 @@ static char* udid = NULL;
 
 static idevice_t device = NULL;
 static syslog_relay_client_t syslog = NULL;
+static syslog_relay_archive_t archive = NULL;
+static mutex_t archive_mutex;
+
+/* archive settings, see open_archive() */
+static char *archive_dir = NULL;
+static uint64_t segment_size = 64 * 1024 * 1024;
+static uint32_t segment_time = 3600;
+
+/* state of the --all mode, see follow_all_devices() */
+#define RECV_BUFFER_SIZE (16384)
+#define OUT_BUFFER_SIZE (65536)
+
+struct syslog_device {
+	char *udid;
+	idevice_t device;
+	service_client_t service;
+	int fd;
+	syslog_relay_archive_t archive;
+	char *buffer;
+	uint32_t length;
+	int remove;
+	struct syslog_device *next;
+};
+
+static mutex_t pending_mutex;
+static struct syslog_device *pending_devices = NULL;
+static struct syslog_device **pending_devices_tail = &pending_devices;
+static struct syslog_device *devices = NULL;
+
+static char out_buffer[OUT_BUFFER_SIZE];
+static size_t out_length = 0;
 
 // Color syslog form rpetrich/deviceconsole
 // https://github.com/rpetrich/deviceconsole/blob/master/main.c
-#define MAX_LINEBUFFER_SIZE (4096)
-static int line_buffer_offset = 0;
-static char line_buffer[MAX_LINEBUFFER_SIZE+1] = {0};
 
 #define COLOR_RESET         "\e[m"
 #define COLOR_NORMAL        "\e[0m"
@@ -171,19 +208,39 @@ static void write_colored(int fd, const char *buffer, size_t length)
     }
 }
 
-static void line_buffer_add(char c)
+static void syslog_callback(const char *line, uint32_t length, void *user_data)
 {
-    line_buffer[line_buffer_offset++] = c;
-    if ((c == '\n') || (line_buffer_offset >= MAX_LINEBUFFER_SIZE)) {
-        write_colored(fileno(stdout), line_buffer, line_buffer_offset);
-        line_buffer_offset = 0;
-    }
+	write_colored(fileno(stdout), line, length);
+	write_const(fileno(stdout), "\n");
 }
 
-static void syslog_callback(char c, void *user_data)
+static void syslog_archive_callback(const char *line, uint32_t length, void *user_data)
+{
+	syslog_callback(line, length, user_data);
+	syslog_relay_archive_write(line, length, archive);
+}
+
+/**
+ * Opens the archive of a device, in a subdirectory of the archive
+ * directory named by its UDID.
+ */
+static syslog_relay_archive_t open_archive(const char *device_udid)
 {
-	//putchar(c);
-    line_buffer_add(c);
+	syslog_relay_archive_t result = NULL;
+	char *path;
+
+#ifdef WIN32
+	mkdir(archive_dir);
+#else
+	mkdir(archive_dir, 0755);
+#endif
+	path = string_build_path(archive_dir, device_udid, NULL);
+	if (syslog_relay_archive_open(path, segment_size, segment_time, &result) != SYSLOG_RELAY_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not open archive directory %s\n", path);
+	}
+	free(path);
+
+	return result;
 }
 
 static int start_logging(void)
@@ -204,12 +261,31 @@ static int start_logging(void)
 		return -1;
 	}
 
+	if (archive_dir) {
+		mutex_lock(&archive_mutex);
+		archive = open_archive(udid);
+		mutex_unlock(&archive_mutex);
+		if (!archive) {
+			syslog_relay_client_free(syslog);
+			syslog = NULL;
+			idevice_free(device);
+			device = NULL;
+			return -1;
+		}
+	}
+
 	/* start capturing syslog */
-	serr = syslog_relay_start_capture(syslog, syslog_callback, NULL);
+	serr = syslog_relay_start_capture_lines(syslog, (archive) ? syslog_archive_callback : syslog_callback, NULL);
 	if (serr != SYSLOG_RELAY_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Unable tot start capturing syslog.\n");
 		syslog_relay_client_free(syslog);
 		syslog = NULL;
+		mutex_lock(&archive_mutex);
+		if (archive) {
+			syslog_relay_archive_close(archive);
+			archive = NULL;
+		}
+		mutex_unlock(&archive_mutex);
 		idevice_free(device);
 		device = NULL;
 		return -1;
@@ -230,6 +306,13 @@ static void stop_logging(void)
 		syslog = NULL;
 	}
 
+	mutex_lock(&archive_mutex);
+	if (archive) {
+		syslog_relay_archive_close(archive);
+		archive = NULL;
+	}
+	mutex_unlock(&archive_mutex);
+
 	if (device) {
 		idevice_free(device);
 		device = NULL;
@@ -257,6 +340,306 @@ static void device_event_cb(const idevice_event_t* event, void* userdata)
 	}
 }
 
+static void out_flush(void)
+{
+	write_fully(fileno(stdout), out_buffer, out_length);
+	out_length = 0;
+}
+
+static void out_append(const char *data, size_t length)
+{
+	while (length > 0) {
+		size_t n = OUT_BUFFER_SIZE - out_length;
+		if (n > length)
+			n = length;
+		memcpy(out_buffer + out_length, data, n);
+		out_length += n;
+		data += n;
+		length -= n;
+		if (out_length == OUT_BUFFER_SIZE)
+			out_flush();
+	}
+}
+
+static void syslog_device_free(struct syslog_device *dev)
+{
+	if (dev->service)
+		service_client_free(dev->service);
+	if (dev->device)
+		idevice_free(dev->device);
+	if (dev->archive)
+		syslog_relay_archive_close(dev->archive);
+	free(dev->buffer);
+	free(dev->udid);
+	free(dev);
+}
+
+/**
+ * Appends the complete lines received from a device to the output buffer,
+ * each prefixed with the UDID of the device.
+ */
+static void syslog_device_output_lines(struct syslog_device *dev, int flush)
+{
+	uint32_t start = 0;
+	uint32_t i;
+
+	for (i = 0; i < dev->length; i++) {
+		if (dev->buffer[i] == '\n' || (dev->buffer[i] == '\0' && i > start)) {
+			out_append("[", 1);
+			out_append(dev->udid, strlen(dev->udid));
+			out_append("] ", 2);
+			out_append(dev->buffer + start, i - start);
+			out_append("\n", 1);
+			if (dev->archive)
+				syslog_relay_archive_write(dev->buffer + start, i - start, dev->archive);
+			start = i + 1;
+		} else if (dev->buffer[i] == '\0') {
+			start = i + 1;
+		}
+	}
+	if ((flush || dev->length == RECV_BUFFER_SIZE) && start < dev->length) {
+		out_append("[", 1);
+		out_append(dev->udid, strlen(dev->udid));
+		out_append("] ", 2);
+		out_append(dev->buffer + start, dev->length - start);
+		out_append("\n", 1);
+		if (dev->archive)
+			syslog_relay_archive_write(dev->buffer + start, dev->length - start, dev->archive);
+		start = dev->length;
+	}
+	if (start > 0) {
+		memmove(dev->buffer, dev->buffer + start, dev->length - start);
+		dev->length -= start;
+	}
+}
+
+/**
+ * Queues an added or removed device for the loop in follow_all_devices().
+ * Events are kept in the order they arrived, so a device that is removed
+ * and added again ends up connected.
+ */
+static void syslog_device_queue(struct syslog_device *dev)
+{
+	dev->next = NULL;
+	mutex_lock(&pending_mutex);
+	*pending_devices_tail = dev;
+	pending_devices_tail = &dev->next;
+	mutex_unlock(&pending_mutex);
+}
+
+/**
+ * Connects to the syslog_relay service of a device that was added.
+ * Called from the device event thread, hands the connection over to the
+ * loop in follow_all_devices().
+ */
+static void syslog_device_add(const char *device_udid)
+{
+	struct syslog_device *dev = (struct syslog_device*)calloc(1, sizeof(struct syslog_device));
+	idevice_connection_t connection = NULL;
+	service_error_t serr = SERVICE_E_UNKNOWN_ERROR;
+
+	if (!dev)
+		return;
+	dev->udid = strdup(device_udid);
+	dev->buffer = (char*)malloc(RECV_BUFFER_SIZE);
+
+	if (idevice_new(&dev->device, device_udid) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "[%s] ERROR: Could not connect to device\n", device_udid);
+		syslog_device_free(dev);
+		return;
+	}
+	service_client_factory_start_service(dev->device, SYSLOG_RELAY_SERVICE_NAME, (void**)&dev->service, "idevicesyslog", SERVICE_CONSTRUCTOR(service_client_new), &serr);
+	if (serr != SERVICE_E_SUCCESS || service_get_connection(dev->service, &connection) != SERVICE_E_SUCCESS || idevice_connection_get_fd(connection, &dev->fd) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "[%s] ERROR: Could not start service %s.\n", device_udid, SYSLOG_RELAY_SERVICE_NAME);
+		syslog_device_free(dev);
+		return;
+	}
+	if (archive_dir) {
+		dev->archive = open_archive(device_udid);
+		if (!dev->archive) {
+			syslog_device_free(dev);
+			return;
+		}
+	}
+
+	syslog_device_queue(dev);
+}
+
+/**
+ * Marks a device that was removed, so the loop in follow_all_devices()
+ * closes its connection.
+ */
+static void syslog_device_remove(const char *device_udid)
+{
+	struct syslog_device *dev = (struct syslog_device*)calloc(1, sizeof(struct syslog_device));
+
+	if (!dev)
+		return;
+	dev->udid = strdup(device_udid);
+	dev->remove = 1;
+
+	syslog_device_queue(dev);
+}
+
+static void device_event_all_cb(const idevice_event_t* event, void* userdata)
+{
+	if (event->event == IDEVICE_DEVICE_ADD) {
+		syslog_device_add(event->udid);
+	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
+		syslog_device_remove(event->udid);
+	}
+}
+
+/**
+ * Takes over devices added or removed by the device event thread.
+ */
+static void take_pending_devices(void)
+{
+	struct syslog_device *pending;
+
+	mutex_lock(&pending_mutex);
+	pending = pending_devices;
+	pending_devices = NULL;
+	pending_devices_tail = &pending_devices;
+	mutex_unlock(&pending_mutex);
+
+	while (pending) {
+		struct syslog_device *dev = pending;
+		struct syslog_device **link = &devices;
+		pending = pending->next;
+
+		/* drop a previous connection to the same device */
+		while (*link) {
+			if (strcmp((*link)->udid, dev->udid) == 0) {
+				struct syslog_device *old = *link;
+				*link = old->next;
+				syslog_device_output_lines(old, 1);
+				syslog_device_free(old);
+				out_flush();
+				fprintf(stdout, "[%s] [disconnected]\n", dev->udid);
+				fflush(stdout);
+				break;
+			}
+			link = &(*link)->next;
+		}
+
+		if (dev->remove) {
+			syslog_device_free(dev);
+		} else {
+			out_flush();
+			fprintf(stdout, "[%s] [connected]\n", dev->udid);
+			fflush(stdout);
+			dev->next = devices;
+			devices = dev;
+		}
+	}
+}
+
+/**
+ * Relays the syslog of all attached devices, following hotplug events.
+ * All connections are served by this single loop, and the output is
+ * collected in a large buffer written once per iteration.
+ */
+static int follow_all_devices(void)
+{
+	time_t last_archive_flush = time(NULL);
+
+	mutex_init(&pending_mutex);
+	idevice_event_subscribe(device_event_all_cb, NULL);
+
+	while (!quit_flag) {
+		struct syslog_device *dev;
+		struct syslog_device **link;
+		struct timeval tv;
+		fd_set fds;
+		int maxfd = -1;
+
+		take_pending_devices();
+
+		/* write out the lines of quiet devices once a second */
+		if (archive_dir && time(NULL) != last_archive_flush) {
+			for (dev = devices; dev; dev = dev->next) {
+				if (dev->archive)
+					syslog_relay_archive_flush(dev->archive);
+			}
+			last_archive_flush = time(NULL);
+		}
+
+		FD_ZERO(&fds);
+		for (dev = devices; dev; dev = dev->next) {
+			FD_SET(dev->fd, &fds);
+			if (dev->fd > maxfd)
+				maxfd = dev->fd;
+		}
+
+		/* wake up regularly to pick up added devices */
+		tv.tv_sec = 0;
+		tv.tv_usec = 200000;
+		if (maxfd < 0) {
+#ifdef WIN32
+			Sleep(200);
+#else
+			select(0, NULL, NULL, NULL, &tv);
+#endif
+			continue;
+		}
+		if (select(maxfd + 1, &fds, NULL, NULL, &tv) <= 0)
+			continue;
+
+		link = &devices;
+		while ((dev = *link)) {
+			uint32_t bytes = 0;
+			if (!FD_ISSET(dev->fd, &fds)) {
+				link = &dev->next;
+				continue;
+			}
+			if (service_receive_with_timeout(dev->service, dev->buffer + dev->length, RECV_BUFFER_SIZE - dev->length, &bytes, 1) != SERVICE_E_SUCCESS || bytes == 0) {
+				/* readable without data means the connection was closed */
+				*link = dev->next;
+				syslog_device_output_lines(dev, 1);
+				out_flush();
+				fprintf(stdout, "[%s] [disconnected]\n", dev->udid);
+				fflush(stdout);
+				syslog_device_free(dev);
+				continue;
+			}
+			dev->length += bytes;
+			syslog_device_output_lines(dev, 0);
+			link = &dev->next;
+		}
+		out_flush();
+	}
+
+	idevice_event_unsubscribe();
+	take_pending_devices();
+	while (devices) {
+		struct syslog_device *dev = devices;
+		devices = dev->next;
+		syslog_device_output_lines(dev, 1);
+		syslog_device_free(dev);
+	}
+	out_flush();
+	mutex_destroy(&pending_mutex);
+
+	return 0;
+}
+
+/**
+ * Prints the archived lines of a device within a time range.
+ */
+static int print_archive(uint64_t from, uint64_t to)
+{
+	char *path = string_build_path(archive_dir, udid, NULL);
+	syslog_relay_error_t serr = syslog_relay_archive_read(path, from, to, syslog_callback, NULL);
+
+	if (serr != SYSLOG_RELAY_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not read archive directory %s\n", path);
+	}
+	free(path);
+
+	return (serr == SYSLOG_RELAY_E_SUCCESS) ? 0 : -1;
+}
+
 /**
  * signal handler function for cleaning up properly
  */
@@ -269,6 +652,10 @@ static void clean_exit(int sig)
 int main(int argc, char *argv[])
 {
 	int i;
+	int all = 0;
+	uint64_t from = 0;
+	uint64_t to = 0;
+	int range = 0;
 
 	signal(SIGINT, clean_exit);
 	signal(SIGTERM, clean_exit);
@@ -292,6 +679,57 @@ int main(int argc, char *argv[])
 			udid = strdup(argv[i]);
 			continue;
 		}
+		else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--all")) {
+			all = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-A") || !strcmp(argv[i], "--archive")) {
+			i++;
+			if (!argv[i] || (strlen(argv[i]) == 0)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			archive_dir = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--segment-size")) {
+			i++;
+			if (!argv[i] || (atoi(argv[i]) <= 0)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			segment_size = (uint64_t)atoi(argv[i]) * 1024 * 1024;
+			continue;
+		}
+		else if (!strcmp(argv[i], "--segment-time")) {
+			i++;
+			if (!argv[i] || (atoi(argv[i]) <= 0)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			segment_time = (uint32_t)atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--from")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			from = strtoull(argv[i], NULL, 10) * 1000;
+			range = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "--to")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			to = strtoull(argv[i], NULL, 10) * 1000 + 999;
+			range = 1;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -302,10 +740,28 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (range) {
+		if (!archive_dir || !udid || all) {
+			print_usage(argc, argv);
+			return 0;
+		}
+		if (to == 0)
+			to = (uint64_t)-1;
+		return print_archive(from, to);
+	}
+
+	if (all) {
+		if (udid) {
+			print_usage(argc, argv);
+			return 0;
+		}
+		return follow_all_devices();
+	}
+
 	int num = 0;
-	char **devices = NULL;
-	idevice_get_device_list(&devices, &num);
-	idevice_device_list_free(devices);
+	char **device_list = NULL;
+	idevice_get_device_list(&device_list, &num);
+	idevice_device_list_free(device_list);
 	if (num == 0) {
 		if (!udid) {
 			fprintf(stderr, "No device found. Plug in a device or pass UDID with -u to wait for device to be available.\n");
@@ -315,13 +771,20 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	mutex_init(&archive_mutex);
 	idevice_event_subscribe(device_event_cb, NULL);
 
 	while (!quit_flag) {
 		sleep(1);
+		/* write out the lines of a quiet device */
+		mutex_lock(&archive_mutex);
+		if (archive)
+			syslog_relay_archive_flush(archive);
+		mutex_unlock(&archive_mutex);
 	}
 	idevice_event_unsubscribe();
 	stop_logging();
+	mutex_destroy(&archive_mutex);
  
 	if (udid) {
 		free(udid);
@@ -339,6 +802,13 @@ void print_usage(int argc, char **argv)
 	printf("Relay syslog of a connected device.\n\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -u, --udid UDID\ttarget specific device by its 40-digit device UDID\n");
+	printf("  -a, --all\t\trelay the syslog of all attached devices, prefixing\n");
+	printf("  \t\t\teach line with the device UDID\n");
+	printf("  -A, --archive DIR\talso write the syslog to segment files in DIR/UDID\n");
+	printf("  --segment-size MB\tstart a new segment after MB megabytes (default 64)\n");
+	printf("  --segment-time SEC\tstart a new segment after SEC seconds (default 3600)\n");
+	printf("  --from T1 --to T2\tprint the archived syslog of the device given with -u\n");
+	printf("  \t\t\tbetween T1 and T2, in seconds since epoch\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("\n");
 }